@@ -0,0 +1,314 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+/* carbon-bench
+ *
+ * Microbenchmarks of the math and intersection kernels and end-to-end
+ * renders at fixed seeds, reported as JSON (ns/op and Mrays/s) so that
+ * results can be compared across releases. Built and run by `scons bench`.
+ */
+
+#include <vector>
+
+#include "carbon.h"
+#include "scene.h"
+#include "renderer.h"
+#include "film.h"
+#include "scenefile.h"
+#include "stats.h"
+#include "tonemap.h"
+#include "sampler.h"
+
+/* Scene of the benchmarks, relative to the top of the tree. */
+#define BENCH_SCENE         "scenes/default.scene"
+/* Minimum run time of a microbenchmark in seconds. Microbenchmarks and
+ * renders report the best of BENCH_REPS runs. */
+#define BENCH_MIN_S         0.2
+#define BENCH_REPS          3
+/* Size of the precomputed inputs, small enough to stay in the L1/L2. */
+#define BENCH_N             1024
+
+/* results are folded into this so the compiler cannot drop the work */
+static volatile double sink;
+
+typedef struct bench_result {
+  const char *name;
+  double ns_per_op;
+} bench_result_t;
+
+/* bench_ns
+ *
+ * Calls f(n) (which performs n operations) until BENCH_MIN_S have passed
+ * and returns the best time per operation of BENCH_REPS runs in ns.
+ */
+template <typename F>
+static double bench_ns(F f)
+{
+  double best = 1e30;
+  for (int rep = 0; rep < BENCH_REPS; ++rep) {
+    uint64_t ops = 0;
+    double t0 = omp_get_wtime(), t;
+    do {
+      f(BENCH_N);
+      ops += BENCH_N;
+    } while ((t = omp_get_wtime() - t0) < BENCH_MIN_S);
+    best = std::min(best, t * 1e9 / ops);
+  }
+  return best;
+}
+
+static void micro(std::vector<bench_result_t> *res, c_scene_t *scene, c_scene_t *big, cam_t *cam)
+{
+  c_rng_t rng(1, 2, 3);
+  std::vector<vec3d> a(BENCH_N), b(BENCH_N);
+  std::vector<c_ray_t> rays(BENCH_N);
+  std::vector<double> x(BENCH_N);
+  for (int k = 0; k < BENCH_N; ++k) {
+    a[k] = vec3d::rand(&rng, -1, 1);
+    b[k] = vec3d::rand(&rng, -1, 1);
+    x[k] = randd(&rng, -.1, 1.1);
+    /* camera rays over the whole image, so they hit what the renders hit */
+    c_rng_t r(1, k, 0);
+    rays[k] = cam->get_ray(randd(&rng) * cam->w, randd(&rng) * cam->h, &r);
+  }
+
+  res->push_back({ "vec3d_add", bench_ns([&](int n) {
+    vec3d s;
+    for (int k = 0; k < n; ++k) s = s + a[k] + b[k];
+    sink = s.x + s.y + s.z;
+  }) });
+  res->push_back({ "vec3d_dot", bench_ns([&](int n) {
+    double s = 0;
+    for (int k = 0; k < n; ++k) s += a[k].dot(&b[k]);
+    sink = s;
+  }) });
+  res->push_back({ "vec3d_cross", bench_ns([&](int n) {
+    vec3d s;
+    for (int k = 0; k < n; ++k) s = s + a[k].prod(&b[k]);
+    sink = s.x + s.y + s.z;
+  }) });
+  res->push_back({ "vec3d_norm", bench_ns([&](int n) {
+    vec3d s;
+    for (int k = 0; k < n; ++k) s = s + a[k].norm();
+    sink = s.x + s.y + s.z;
+  }) });
+  res->push_back({ "sphere_hit", bench_ns([&](int n) {
+    c_hit_t h;
+    int s = 0;
+    for (int k = 0; k < n; ++k) s += scene->spheres[1 + k % 3].hit(rays[k], &h, 1e-4);
+    sink = s;
+  }) });
+  res->push_back({ "collide", bench_ns([&](int n) {
+    c_hit_t h;
+    int s = 0;
+    for (int k = 0; k < n; ++k) s += collide(rays[k], scene, &h);
+    sink = s;
+  }) });
+  res->push_back({ "collide_10k", bench_ns([&](int n) {
+    c_hit_t h;
+    int s = 0;
+    for (int k = 0; k < n; ++k) s += collide(rays[k], big, &h);
+    sink = s;
+  }) });
+  res->push_back({ "random_unit_vec", bench_ns([&](int n) {
+    c_rng_t r(1, 2, 3);
+    vec3 s;
+    for (int k = 0; k < n; ++k) s = s + random_unit_vec(&r);
+    sink = s.x + s.y + s.z;
+  }) });
+  /* one draw per op, eight dimensions of every sample */
+  static const struct { const char *name; c_sampler_type_t type; } samplers[] = {
+    { "sampler_independent", SAMPLER_INDEPENDENT }, { "sampler_sobol", SAMPLER_SOBOL },
+    { "sampler_halton", SAMPLER_HALTON }, { "sampler_bluenoise", SAMPLER_BLUENOISE },
+  };
+  for (const auto &b : samplers) {
+    c_sampler_t smp;
+    sampler_init(&smp, b.type, cam->w, cam->spp);
+    res->push_back({ b.name, bench_ns([&](int n) {
+      real_t s = 0;
+      for (int k = 0; k < n; k += 8) {
+        c_rng_t r(1, k & 255, k >> 3, &smp);
+        for (int d = 0; d < 8; ++d) s += randd(&r);
+      }
+      sink = s;
+    }) });
+  }
+  res->push_back({ "cam_get_ray", bench_ns([&](int n) {
+    c_rng_t r(1, 2, 3);
+    vec3 s;
+    for (int k = 0; k < n; ++k) s = s + cam->get_ray(k & 255, k >> 8, &r).d;
+    sink = s.x + s.y + s.z;
+  }) });
+  res->push_back({ "toInt", bench_ns([&](int n) {
+    int s = 0;
+    for (int k = 0; k < n; ++k) s += toInt(x[k]);
+    sink = s;
+  }) });
+  std::vector<double> ones(BENCH_N, 1);
+  std::vector<uint8_t> codes(BENCH_N);
+  c_tonemap_t tm;
+  res->push_back({ "tonemap_span", bench_ns([&](int n) {
+    tonemap_span(&tm, x.data(), ones.data(), n, codes.data());
+    sink = codes[n - 1];
+  }) });
+}
+
+typedef struct bench_scene {
+  const char *name;
+  uint32_t nrand;
+  unsigned char pt, packet, wavefront;
+} bench_scene_t;
+
+static const bench_scene_t scenes[] = {
+  { "default_rt",           0, 0, 0, 0 },
+  { "default_pt",           0, 1, 0, 0 },
+  { "spheres10k_rt",    10000, 0, 0, 0 },
+  { "spheres10k_pt",    10000, 1, 0, 0 },
+  { "spheres10k_rt_packet", 10000, 0, 1, 0 },
+  { "spheres10k_pt_wavefront", 10000, 1, 0, 1 },
+};
+
+/* FNV-1a of the image, equal for equal output at a fixed seed. */
+static uint64_t image_hash(const uint32_t *im, size_t n)
+{
+  uint64_t h = 0xcbf29ce484222325ull;
+  const unsigned char *p = (const unsigned char *) im;
+  for (size_t k = 0; k < n * sizeof(uint32_t); ++k) h = (h ^ p[k]) * 0x100000001b3ull;
+  return h;
+}
+
+static const char show_help[] =
+  "Usage: carbon-bench [-o file.json] [-w <int>] [-h <int>] [-s <int>] [-threads <int>] [-micro]\n"
+  "  -o        Write the JSON report to <file> instead of stdout.\n"
+  "  -w, -h    Image size of the end-to-end renders (default: 320x240).\n"
+  "  -s        Samples per pixel of the end-to-end renders (default: 8).\n"
+  "  -threads  Number of render threads (default: all cores).\n"
+  "  -micro    Only run the microbenchmarks.\n"
+;
+
+int main(int argc, char **argv)
+{
+  const char *out = NULL;
+  uint32_t w = 320, h = 240, spp = 8, threads = 0;
+  int micro_only = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) out = argv[++i];
+    else if (!strcmp(argv[i], "-w") && i + 1 < argc) w = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-h") && i + 1 < argc) h = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-s") && i + 1 < argc) spp = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-threads") && i + 1 < argc) threads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-micro")) micro_only = 1;
+    else {
+      fputs(show_help, stderr);
+      return 1;
+    }
+  }
+
+  c_scene_t scene = { .spheres = NULL, .num_spheres = 0 };
+  c_scene_t big = { .spheres = NULL, .num_spheres = 0 };
+  cam_t cam;
+  if (scene_load(&scene, &cam, BENCH_SCENE) < 0 || scene_load(&big, &cam, BENCH_SCENE) < 0) return 1;
+  random_spheres(scene_add_spheres(&big, 10000), 10000, 0);
+  cam.init(w, h, spp, cam.vfov);
+  scene_init(&scene, 1);
+  scene_init(&big, 1);
+
+  std::vector<bench_result_t> res;
+  micro(&res, &scene, &big, &cam);
+
+  FILE *f = out ? fopen(out, "w") : stdout;
+  if (!f) {
+    perror("Unable to write the report");
+    return 1;
+  }
+  fprintf(f, "{\n  \"real\": \"%s\",\n  \"threads\": %d,\n  \"micro\": [\n",
+          sizeof(real_t) == 8 ? "double" : "float", threads ? threads : omp_get_max_threads());
+  for (size_t k = 0; k < res.size(); ++k)
+    fprintf(f, "    { \"name\": \"%s\", \"ns_per_op\": %.3f }%s\n",
+            res[k].name, res[k].ns_per_op, k + 1 < res.size() ? "," : "");
+  fprintf(f, "  ],\n  \"scenes\": [\n");
+
+  uint32_t num_scenes = micro_only ? 0 : sizeof(scenes) / sizeof(scenes[0]);
+  for (uint32_t k = 0; k < num_scenes; ++k) {
+    const bench_scene_t *b = &scenes[k];
+    c_scene_t sc = { .spheres = NULL, .num_spheres = 0 };
+    cam_t c;
+    if (scene_load(&sc, &c, BENCH_SCENE) < 0) return 1;
+    if (b->nrand) random_spheres(scene_add_spheres(&sc, b->nrand), b->nrand, 0);
+    scene_init(&sc, 1);
+    c.init(w, h, spp, c.vfov);
+
+    c_state_t st = c_state();
+    st.w = w;
+    st.h = h;
+    st.spp = spp;
+    st.threads = threads;
+    st.pt = b->pt;
+    st.rt = !b->pt;
+    st.packet = b->packet;
+    st.wavefront = b->wavefront;
+    c_film_t film;
+    st.im_buffer = (uint32_t *) malloc(w * h * sizeof(uint32_t));
+    if (!st.im_buffer) {
+      perror("Unable to allocate memory for the image.");
+      return 1;
+    }
+    st.film = &film;
+
+    double t = 1e30;
+    for (int rep = 0; rep < BENCH_REPS; ++rep) {
+      if (film_init(&film, w, h) < 0) {
+        perror("Unable to allocate memory for the film.");
+        return 1;
+      }
+      stats_reset();
+      double t0 = omp_get_wtime();
+      render(&st, &sc, &c);
+      t = std::min(t, omp_get_wtime() - t0);
+      film_free(&film);
+    }
+    /* camera rays, one per sample */
+    double rays = (double) w * h * spp;
+    fprintf(f, "    { \"name\": \"%s\", \"w\": %u, \"h\": %u, \"spp\": %u, \"seconds\": %.4f, "
+               "\"mrays_per_s\": %.3f, \"image\": \"%016llx\"",
+            b->name, w, h, spp, t, rays / t * 1e-6, (unsigned long long) image_hash(st.im_buffer, (size_t) w * h));
+    if (STAT_ENABLED) {
+      /* counters of the last run, with all rays in its Mrays/s */
+      c_stats_t cs;
+      stats_get(&cs);
+      fprintf(f, ", \"stats\": ");
+      stats_json(&cs, t, f);
+    }
+    fprintf(f, " }%s\n", k + 1 < num_scenes ? "," : "");
+    free(st.im_buffer);
+    scene_free(&sc);
+    scene_unload(&sc);
+  }
+  fprintf(f, "  ]\n}\n");
+  if (out) fclose(f);
+  scene_free(&scene);
+  scene_unload(&scene);
+  scene_free(&big);
+  scene_unload(&big);
+  return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef ANIM_H
+#define ANIM_H
+
+#include <vector>
+
+#include "carbon.h"
+#include "scene.h"
+
+/* Track of the camera, the others are keyed by the index of their sphere. */
+#define ANIM_CAMERA         -1
+
+/* Key of a track: the camera origin and look at point (a, b), or the
+ * center of a sphere (a), at frame. */
+typedef struct c_anim_key {
+  uint32_t frame;
+  vec3 a, b;
+} c_anim_key_t;
+
+typedef struct c_anim_track {
+  int32_t target;
+  /* sorted by frame */
+  std::vector<c_anim_key_t> keys;
+} c_anim_track_t;
+
+/* c_anim
+ *
+ * Keyframed camera and sphere positions. Between two keys of a track the
+ * values are interpolated linearly, before the first and after the last
+ * key of a track they are held.
+ */
+typedef struct c_anim {
+  std::vector<c_anim_track_t> tracks;
+  /* last frame with a key */
+  uint32_t last = 0;
+} c_anim_t;
+
+/* anim_load
+ *
+ * Reads the keys of the animation file at path for the scene s. One key
+ * per line, '#' starts a comment:
+ *
+ *   <frame> camera <origin xyz> <look at xyz>
+ *   <frame> sphere <index> <pos xyz>
+ *
+ * Spheres are numbered in the order of the scene file, from 0. Returns -1
+ * if the file is malformed or a sphere is not in s.
+ */
+int anim_load(c_anim_t *a, const c_scene_t *s, const char *path);
+
+/* anim_apply
+ *
+ * Moves the camera and the spheres of s to frame and updates the scene
+ * for the new positions with scene_refit(), if any sphere is animated.
+ */
+void anim_apply(const c_anim_t *a, uint32_t frame, c_scene_t *s, cam_t *cam);
+
+#endif // ANIM_H
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef BVH_H
+#define BVH_H
+
+#include "carbon.h"
+#include "scene.h"
+
+/* Maximum number of primitives stored in a leaf. */
+#define BVH_MAX_LEAF        16
+/* Number of bins evaluated per axis by the SAH builder. */
+#define BVH_BINS            16
+/* Depth limit of the builder, bounds the traversal stack. */
+#define BVH_MAX_DEPTH       64
+
+/* min/max without the NaN handling of fmin/fmax, which is not inlined */
+inline real_t minr(real_t a, real_t b) { return a < b ? a : b; }
+inline real_t maxr(real_t a, real_t b) { return a > b ? a : b; }
+
+/* c_aabb
+ *
+ * Axis aligned bounding box given by its lower (lo) and upper (hi) corner.
+ */
+typedef struct c_aabb {
+  vec3 lo = vec3(1e30, 1e30, 1e30);
+  vec3 hi = vec3(-1e30, -1e30, -1e30);
+
+  void grow(const vec3 &p) {
+    lo = vec3(minr(lo.x, p.x), minr(lo.y, p.y), minr(lo.z, p.z));
+    hi = vec3(maxr(hi.x, p.x), maxr(hi.y, p.y), maxr(hi.z, p.z));
+  }
+  void grow(const c_aabb &b) { grow(b.lo); grow(b.hi); }
+  /* half of the surface area, enough for SAH cost ratios */
+  real_t area() const {
+    vec3 e = hi - lo;
+    return (e.x < 0) ? 0 : e.x * e.y + e.y * e.z + e.z * e.x;
+  }
+  /* Slab test, returns the entry distance in tn. */
+  bool hit(const vec3 &o, const vec3 &inv, real_t tmax, real_t *tn) const {
+    real_t t0 = (lo.x - o.x) * inv.x, t1 = (hi.x - o.x) * inv.x;
+    real_t tmi = minr(t0, t1), tma = maxr(t0, t1);
+    t0 = (lo.y - o.y) * inv.y; t1 = (hi.y - o.y) * inv.y;
+    tmi = maxr(tmi, minr(t0, t1)); tma = minr(tma, maxr(t0, t1));
+    t0 = (lo.z - o.z) * inv.z; t1 = (hi.z - o.z) * inv.z;
+    tmi = maxr(tmi, minr(t0, t1)); tma = minr(tma, maxr(t0, t1));
+    *tn = tmi;
+    return tma >= maxr(tmi, 0.0) && tmi < tmax;
+  }
+} c_aabb_t;
+
+/* c_bvh_node
+ *
+ * Inner nodes (count == 0) store the index of their left child in first,
+ * the right child is always stored at first + 1. Leaves reference the
+ * primitives prims[first] ... prims[first + count - 1].
+ */
+typedef struct c_bvh_node {
+  c_aabb_t box;
+  uint32_t first;
+  uint32_t count;
+} c_bvh_node_t;
+
+/* Bounding volume hierarchy over the spheres or triangles of a scene. */
+typedef struct c_bvh {
+  c_bvh_node_t *nodes;
+  uint32_t num_nodes;
+  /* primitive indices referenced by the leaves */
+  uint32_t *prims;
+  uint32_t num_prims;
+  /* build time in milliseconds */
+  double build_ms;
+} c_bvh_t;
+
+/* bvh_build
+ *
+ * Builds a BVH over n primitives given by their bounds and centroids. The
+ * SAH assumes leaves test width primitives at a time.
+ */
+c_bvh_t *bvh_build(const c_aabb_t *boxes, const vec3 *centroids, uint32_t n, uint32_t width);
+c_bvh_t *bvh_build(const c_sphere *spheres, uint32_t n);
+/* bvh_refit
+ *
+ * Recomputes the boxes of a BVH built over spheres after they moved. The
+ * tree is kept as it is, which costs one pass over the nodes but gets
+ * slower to traverse the further the spheres move from where it was
+ * built. build_ms is set to the time of the refit.
+ */
+void bvh_refit(c_bvh_t *bvh, const c_sphere *spheres);
+void bvh_free(c_bvh_t *bvh);
+
+/* bvh_traverse
+ *
+ * Visits the leaves hit by r front to back and calls visit(first, count)
+ * for the primitive range prims[first] ... prims[first + count - 1] of each.
+ * visit is expected to lower *tmax when it finds a closer hit, which prunes
+ * the remaining nodes.
+ */
+template <typename F>
+inline void bvh_traverse(const c_bvh_t *bvh, const c_ray_t &r, const real_t *tmax, F visit)
+{
+  vec3 inv(1 / r.d.x, 1 / r.d.y, 1 / r.d.z);
+  /* far children together with their entry distance */
+  uint32_t stack[BVH_MAX_DEPTH + 1];
+  real_t stack_t[BVH_MAX_DEPTH + 1];
+  int sp = 0;
+  real_t tn, tl, tr;
+
+  if (!bvh->num_nodes || !bvh->nodes[0].box.hit(r.o, inv, *tmax, &tn)) return;
+
+  uint32_t n = 0;
+  while (true) {
+    const c_bvh_node_t *node = &bvh->nodes[n];
+    STAT_ADD(bvh_nodes, 1);
+    if (node->count) {
+      visit(node->first, node->count);
+    } else {
+      uint32_t l = node->first, rc = node->first + 1;
+      bool hl = bvh->nodes[l].box.hit(r.o, inv, *tmax, &tl);
+      bool hr = bvh->nodes[rc].box.hit(r.o, inv, *tmax, &tr);
+      if (hl && hr) {
+        if (tr < tl) {
+          uint32_t x = l; l = rc; rc = x;
+          real_t y = tl; tl = tr; tr = y;
+        }
+        stack_t[sp] = tr;
+        stack[sp++] = rc;
+        n = l;
+        continue;
+      }
+      if (hl || hr) {
+        n = hl ? l : rc;
+        continue;
+      }
+    }
+    do {
+      if (!sp) return;
+      n = stack[--sp];
+    } while (stack_t[sp] >= *tmax);
+  }
+}
+
+#endif // BVH_H
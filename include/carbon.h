@@ -29,68 +29,159 @@
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <float.h>
 #include <omp.h>
 
-/* Multithreaded */
-#define MT                  0
 /* parse_args return codes: */
 #define ARG_HELP_R          1
 
+/* Maximum number of -mesh arguments. */
+#define C_MAX_MESHES        16
+
 #define C_RGBA(r, g, b, a) ((((r)&0xFF)<<(8*0)) |\
                             (((g)&0xFF)<<(8*1)) |\
                             (((b)&0xFF)<<(8*2)) |\
                             (((a)&0xFF)<<(8*3)))
 
+/* c_rng
+ *
+ * Counter-based random number generator (splitmix64 finalizer). The n-th
+ * value of a stream is a hash of (seed, pixel, sample, n), so every sample
+ * owns an independent stream and renders do not depend on the thread count
+ * or the order in which pixels are processed. With a sampler the values
+ * are taken from its sequence at (pixel, sample, n) instead.
+ */
+inline uint64_t mix64(uint64_t z)
+{
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+struct c_sampler;
+struct c_rng;
+
+/* sampler_next
+ *
+ * Value of the current dimension of the sample of rng in the sequence of
+ * its sampler, in the upper 32 bits. The lower bits are those of the
+ * stream value r. Owen
+ * scrambled Sobol (Burley 2020: the first four dimensions, padded with
+ * independently shuffled copies) and Halton (nested random digit shifts)
+ * are scrambled per pixel. Blue noise rotates one Owen scrambled Sobol
+ * sequence per pixel by a tiled blue noise mask (Georgiev and Fajardo),
+ * so that the error is spread as blue noise over the image.
+ */
+uint64_t sampler_next(const struct c_rng *rng, uint64_t r);
+
+typedef struct c_rng {
+  /* stream key derived from seed, pixel and sample */
+  uint64_t key;
+  /* next dimension to be drawn, and the first one of the current bounce */
+  uint64_t dim, base;
+  /* low discrepancy sequence drawn from, NULL for independent numbers */
+  const struct c_sampler *sampler;
+  uint32_t seed, pixel, sample;
+  /* hash of seed and pixel that scrambles the sequence of the pixel */
+  uint32_t scramble;
+
+  c_rng() : key(0), dim(0), base(0), sampler(NULL), seed(0), pixel(0), sample(0), scramble(0) {}
+  c_rng(uint32_t seed_, uint32_t pixel_, uint32_t sample_, const struct c_sampler *sampler_ = NULL) {
+    key = mix64(mix64(((uint64_t)seed_ << 32) | pixel_) + sample_);
+    dim = base = 0;
+    sampler = sampler_;
+    seed = seed_;
+    pixel = pixel_;
+    sample = sample_;
+    scramble = sampler_ ? (uint32_t) mix64(((uint64_t) seed_ << 32) | pixel_) : 0;
+  }
+  uint64_t next() {
+    uint64_t r = mix64(key + (++dim) * 0x9E3779B97F4A7C15ULL);
+    return sampler ? sampler_next(this, r) : r;
+  }
+  /* continues with dimension d of the current bounce */
+  void seek(uint32_t d) { dim = base + d; }
+} c_rng_t;
+
 /* Helper functions */
 inline double degr_to_rad(double degrees)   { return degrees * M_PI / 180.0; }
-inline double randd()                       { return rand() / (RAND_MAX + 1.0); }
-inline double randd(double min, double max) { return min + (max-min) * (rand() / (RAND_MAX + 1.0)); }
+inline double randd(c_rng_t *rng)           { return (rng->next() >> 11) * 0x1.0p-53; }
+inline double randd(c_rng_t *rng, double min, double max) { return min + (max-min) * randd(rng); }
 inline double clamp(double x)               { return x < 0 ? 0 : x > 1 ? 1 : x; } 
 inline int toInt(double x)                  { return int(pow(clamp(x), 1/2.2) * 255 + .5); } 
 
 /* Basic data structures */
-struct vec3d {      
-  double x, y, z;
-  vec3d(double x_=0, double y_=0, double z_=0){ x=x_; y=y_; z=z_; }
+template <typename T>
+struct vec3_ {      
+  T x, y, z;
+  vec3_(T x_=0, T y_=0, T z_=0){ x=x_; y=y_; z=z_; }
+  template <typename U>
+  explicit vec3_(const vec3_<U> &v) { x=v.x; y=v.y; z=v.z; }
   /* operators */
-  vec3d operator +  (const vec3d &v) const { return vec3d(x + v.x, y + v.y, z + v.z); }
-  vec3d operator += (const vec3d &v) const { return vec3d(x + v.x, y + v.y, z + v.z); }
-  vec3d operator +  (double v)       const { return vec3d(x + v, y + v, z + v); }
-  vec3d operator -  (const vec3d &v) const { return vec3d(x - v.x, y - v.y, z - v.z); }
-  vec3d operator *  (double v)       const { return vec3d(x * v, y * v, z * v); }
-  vec3d operator /  (double v)       const { return vec3d(x * 1/v, y * 1/v, z * 1/v); }
-  vec3d operator /= (double v)       const { return vec3d(x * 1/v, y * 1/v, z * 1/v); }
+  vec3_ operator +  (const vec3_ &v) const { return vec3_(x + v.x, y + v.y, z + v.z); }
+  vec3_ operator += (const vec3_ &v) const { return vec3_(x + v.x, y + v.y, z + v.z); }
+  vec3_ operator +  (T v)            const { return vec3_(x + v, y + v, z + v); }
+  vec3_ operator -  (const vec3_ &v) const { return vec3_(x - v.x, y - v.y, z - v.z); }
+  vec3_ operator *  (T v)            const { return vec3_(x * v, y * v, z * v); }
+  vec3_ operator /  (T v)            const { return vec3_(x * 1/v, y * 1/v, z * 1/v); }
+  vec3_ operator /= (T v)            const { return vec3_(x * 1/v, y * 1/v, z * 1/v); }
   /* normalize vector */
-  vec3d norm()                       const { return *this / sqrt(x * x + y * y + z * z); }
+  vec3_ norm()                       const { return *this / sqrt(x * x + y * y + z * z); }
   /* additional functions */
-  vec3d mul(vec3d *v)                const { return vec3d(x * v->x, y * v->y, z * v->z); }
-  vec3d pow()                        const { return vec3d(x * x, y * y, z * z); }
+  vec3_ mul(const vec3_ *v)          const { return vec3_(x * v->x, y * v->y, z * v->z); }
+  vec3_ pow()                        const { return vec3_(x * x, y * y, z * z); }
   /* dot product */
-  double dot(vec3d *v)               const { return (x * v->x + y * v->y + z * v->z); }
+  T dot(const vec3_ *v)              const { return (x * v->x + y * v->y + z * v->z); }
   /* cross product */
-  vec3d prod(vec3d *v)               const { return vec3d(y * v->z - z * v->y, 
+  vec3_ prod(const vec3_ *v)         const { return vec3_(y * v->z - z * v->y, 
                                                           z * v->x - x * v->z, x * v->y - y * v->x); }
   /* length of vector */
-  double len()                       const { return sqrt(x * x + y * y + z * z); }
+  T len()                            const { return sqrt(x * x + y * y + z * z); }
+  /* largest absolute component */
+  T amax()                           const { T a = fabs(x) > fabs(y) ? fabs(x) : fabs(y); return a > fabs(z) ? a : fabs(z); }
   /* random vector */
-  static vec3d rand()                      { return vec3d(randd(), randd(), randd()); }
-  static vec3d rand(double l, double h)    { return vec3d(randd(l,h), randd(l,h), randd(l,h)); }
+  static vec3_ rand(c_rng_t *r)            { return vec3_(randd(r), randd(r), randd(r)); }
+  static vec3_ rand(c_rng_t *r, double l, double h) { return vec3_(randd(r,l,h), randd(r,l,h), randd(r,l,h)); }
   /* unit vector */
-  static vec3d unit(vec3d v)               { return v / v.len(); }
+  static vec3_ unit(vec3_ v)               { return v / v.len(); }
   /* Return true if the vector is close to zero in all dimensions. */
-  bool zero(double s = 1e-8) { return (fabs(x) < s) && (fabs(y) < s) && (fabs(z) < s); }
+  bool zero(T s = 1e-8) { return (fabs(x) < s) && (fabs(y) < s) && (fabs(z) < s); }
 };
 
+/* real_t
+ *
+ * Scalar type of the geometry and shading code. Doubles by default, floats
+ * when built with `scons float=1` (CARBON_FLOAT), which doubles the SIMD
+ * width and halves the size of the scene and ray buffers, but limits scenes
+ * to 2^24 spheres, whose indices the SIMD tests carry in float lanes.
+ * Sample sums in the film are kept in double either way.
+ */
+#ifdef CARBON_FLOAT
+typedef float real_t;
+#define REAL_EPSILON        FLT_EPSILON
+#else
+typedef double real_t;
+#define REAL_EPSILON        DBL_EPSILON
+#endif
+
+typedef vec3_<real_t> vec3;
+typedef vec3_<double> vec3d;
+typedef vec3_<float> vec3f;
+
 /* c_ray
  *
  * A ray is a parametric line with an origin (o) and a direction (d). 
  * A point along the ray can be defined using a parameter, t:
  * p(t) = o + t*d
 */
-typedef struct c_ray { 
-  vec3d o, d; 
-  c_ray(vec3d o_, vec3d d_) : o(o_), d(d_) {} 
-} c_ray_t;
+template <typename T>
+struct c_ray_ { 
+  vec3_<T> o, d; 
+  c_ray_() {}
+  c_ray_(vec3_<T> o_, vec3_<T> d_) : o(o_), d(d_) {} 
+};
+typedef c_ray_<real_t> c_ray;
+typedef c_ray c_ray_t;
 
 typedef enum arg_types {
   ARG_HELP    =  0,
@@ -103,7 +194,36 @@ typedef enum arg_types {
   ARG_MAXD    =  7,
   ARG_O       =  8,
   ARG_CUDA    =  9,
-  ARG_UNKNOWN = 10,
+  ARG_THREADS = 10,
+  ARG_SEED    = 11,
+  ARG_NOBVH   = 12,
+  ARG_NRAND   = 13,
+  ARG_PACKET  = 14,
+  ARG_WAVEFRONT = 15,
+  ARG_RRD     = 16,
+  ARG_TIME    = 17,
+  ARG_PASS    = 18,
+  ARG_NOISE   = 19,
+  ARG_ADAPTIVE = 20,
+  ARG_MESH    = 21,
+  ARG_SAVE_MESH = 22,
+  ARG_SCENE   = 23,
+  ARG_SAVE_SCENE = 24,
+  ARG_STATS   = 25,
+  ARG_STATS_JSON = 26,
+  ARG_NONEE   = 27,
+  ARG_DENOISE = 28,
+  ARG_AOV     = 29,
+  ARG_TONEMAP = 30,
+  ARG_EXPOSURE = 31,
+  ARG_FORMAT  = 32,
+  ARG_REGION  = 33,
+  ARG_SAMPLE_RANGE = 34,
+  ARG_RESUME  = 35,
+  ARG_ANIM    = 36,
+  ARG_FRAMES  = 37,
+  ARG_SAMPLER = 38,
+  ARG_UNKNOWN = 39,
 } arg_types_t;
 
 typedef struct c_state {
@@ -114,14 +234,83 @@ typedef struct c_state {
   uint32_t spp        = 10;
   /* Maximum number of ray bounces into scene */
   uint32_t maxd       = 10;
+  /* Bounces before russian roulette may terminate a path (raytracing) */
+  uint32_t rrd        = 5;
   /* Using the raytracing algorithm. */
   unsigned char rt    = 1;
   /* Using the pathtracing algorithm. */
   unsigned char pt    = 0;
-  /* Camera params */
-  double vfov         = 90;
+  /* Camera params, a vfov of 0 keeps the one of the scene */
+  double vfov         = 0;
   /* use cuda */
   unsigned char cuda  = 0;
+  /* Number of render threads, 0 uses all available cores. */
+  uint32_t threads    = 0;
+  /* Seed of the random number streams */
+  uint32_t seed       = 0;
+  /* Sequence of the random number streams (c_sampler_type_t) */
+  unsigned char sampler_type = 0;
+  /* sampler of the image set up from sampler_type, NULL for independent numbers */
+  const struct c_sampler *sampler = NULL;
+  /* Use the BVH for intersection tests, else test every sphere. */
+  unsigned char bvh   = 1;
+  /* Sample the emissive spheres directly (pt), else only hit them */
+  unsigned char nee   = 1;
+  /* Number of random spheres added to the scene (stress tests) */
+  uint32_t nrand      = 0;
+  /* Trace primary rays in packets. */
+  unsigned char packet = 0;
+  /* Render with the wavefront (streaming) integrator. */
+  unsigned char wavefront = 0;
+  /* Time budget of the render in milliseconds, 0 for none */
+  uint32_t time_ms    = 0;
+  /* Samples per pixel of a progressive pass, 0 picks a default */
+  uint32_t pass       = 0;
+  /* Stop once the mean relative error of the pixels is below, 0 for never */
+  double noise        = 0;
+  /* Stop every pixel on its own once its relative error is below noise */
+  unsigned char adaptive = 0;
+  /* End of the time budget in omp_get_wtime() seconds, 0 for none */
+  double deadline     = 0;
+  /* Triangle meshes (.obj or binary) added to the scene */
+  char *mesh[C_MAX_MESHES];
+  uint32_t num_mesh   = 0;
+  /* Write the first mesh in the binary format to this file and exit */
+  char *save_mesh     = NULL;
+  /* Scene file (text or binary .cscene), NULL for the built-in scene */
+  char *scene         = NULL;
+  /* Write the scene to this file (format by extension) and exit */
+  char *save_scene    = NULL;
+  /* Print the render counters (builds with CARBON_STATS) */
+  unsigned char stats = 0;
+  /* Write the render counters as JSON to this file */
+  char *stats_json    = NULL;
+  /* Denoise the film before it is resolved */
+  unsigned char denoise = 0;
+  /* Mask of the AOVs written next to the image (c_aov_t) */
+  uint32_t aovs       = 0;
+  /* Tonemapping operator (c_tonemap_op_t) and exposure in stops */
+  unsigned char tonemap = 0;
+  double exposure     = 0;
+  /* HDR accumulation buffer */
+  struct c_film *film = NULL;
+  /* Region [x0, x1) x [y0, y1) of the image rendered, all of it if x1 = 0 */
+  uint32_t x0         = 0;
+  uint32_t y0         = 0;
+  uint32_t x1         = 0;
+  uint32_t y1         = 0;
+  /* Samples [s0, s1) of every pixel rendered, all of them if s1 = 0 */
+  uint32_t s0         = 0;
+  uint32_t s1         = 0;
+  /* Checkpoint of the film continued from (if it exists) and saved to */
+  char *resume        = NULL;
+  /* Keyframes of the camera and the spheres, NULL for none */
+  char *anim          = NULL;
+  /* Frames [f0, f1) rendered, a single image if f1 = 0 */
+  uint32_t f0         = 0;
+  uint32_t f1         = 0;
+  /* Format of the output file (c_format_t), png by default */
+  unsigned char format = 0;
   /* output filename */
   char *outfile; 
   /* image buffer */
@@ -131,6 +320,19 @@ typedef struct c_state {
 } c_state_t;
 
 char *concat_strs(char *s1, char *s2);
+/* Maps the whole file at path privately, NULL on failure. */
+void *map_file(const char *path, size_t *size, int writable);
+/* split_line
+ *
+ * Copies the line at *p (ending at end) to line, at most size - 1 bytes,
+ * drops its comment from '#' on and splits it at blanks into at most max
+ * tokens t. Advances *p to the next line, returns the number of tokens.
+ */
+int split_line(const char **p, const char *end, char *line, size_t size, char **t, int max);
+/* Parses the whole token t as a number, 0 if it is none. */
+int parse_num(const char *t, double *d);
+/* Parses the three tokens t[0..2] as a vector, 0 on failure. */
+int parse_vec(char **t, vec3 *v);
 int get_arg_type(const char* arg);
 int parse_args(c_state_t *s, int *argc, char ***argv);
 
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "carbon.h"
+#include "film.h"
+
+/* Number of a-trous passes, the filter reaches 2^(n+1) pixels. */
+#define DENOISE_ITERATIONS  5
+
+/* Edge stopping: depth and luminance tolerance, the normals are compared
+ * by dot(n, m)^16. The luminance tolerance is in standard deviations of
+ * the pixel noise. */
+#define DENOISE_SIGMA_Z     1.0f
+#define DENOISE_SIGMA_L     4.0f
+
+/* film_denoise
+ *
+ * Edge avoiding a-trous wavelet filter (Dammertz et al.) of the mean
+ * colors of f, guided by its first hit features and the noise estimate
+ * of every pixel (as in SVGF). The illumination is filtered with the
+ * albedo divided out, so that texture and object colors stay sharp.
+ * Writes rgb interleaved to out, f needs the AOV_FEATURES. Returns
+ * -1 if the buffers could not be allocated.
+ */
+int film_denoise(const c_film_t *f, int iterations, float *out);
+
+#endif // DENOISE_H
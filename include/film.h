@@ -0,0 +1,264 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef FILM_H
+#define FILM_H
+
+#include "carbon.h"
+#include "tonemap.h"
+
+/* c_film
+ *
+ * HDR accumulation buffer of the image. Every pixel keeps the sum of its
+ * samples, the number of samples and a running (Welford) mean and squared
+ * deviation of the sample luminance, from which its noise is estimated.
+ * Passes can be added in any number, the image is only quantized to 8 bit
+ * by film_resolve(). film_init_aovs() adds buffers of the arbitrary
+ * output variables (AOVs), such as the first hit of the samples for the
+ * denoiser. They stay NULL, and cost nothing, unless requested.
+ *
+ * A film may cover only the region of the image at (x0, y0), a partial
+ * film rendered by one of several processes (-region) and combined by
+ * carbon-merge. Samples are summed on a grid of FILM_QUANTUM, which keeps
+ * the sums exact (up to 2^25) and so independent of the order of the
+ * samples: partials of different samples merge to the same bits as a
+ * single render.
+ */
+typedef struct c_film {
+  uint32_t w, h;
+  /* origin of the film in the image */
+  uint32_t x0, y0;
+  /* samples [s0, s1) of the pixels rendered into the film */
+  uint32_t s0, s1;
+  /* mapping of a loaded film holding sum, mean, m2 and spp, else NULL */
+  void *map;
+  size_t map_size;
+  /* sum of the samples, rgb interleaved */
+  double *sum;
+  /* mean and sum of squared deviations of the luminance */
+  double *mean, *m2;
+  /* number of samples */
+  uint32_t *spp;
+  /* sum of the FILM_FEATURES of the first hits, NULL if not kept */
+  float *feat;
+  /* primitive hit by the first sample (-1 for a miss), NULL if not kept */
+  int32_t *id;
+  /* render time in seconds, NULL if not kept */
+  float *cost;
+  /* final colors replacing the means (denoised), rgb interleaved, or NULL */
+  float *rgb;
+} c_film_t;
+
+/* Grid the samples are rounded to before they are summed. */
+#define FILM_QUANTUM        0x1p-28
+
+/* Magic ("CFLM") and version of film files. */
+#define FILM_MAGIC          0x4d4c4643
+#define FILM_VERSION        2
+
+/* c_film_header
+ *
+ * Header of a film file (.cfilm, partial films and checkpoints): the size
+ * of the image, the region covered by the film, the samples [s0, s1)
+ * rendered and the seed of their random streams. The sums, means, m2 and
+ * spp of the film follow as they are kept in memory.
+ */
+typedef struct c_film_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t w, h;
+  uint32_t x0, y0, fw, fh;
+  uint32_t s0, s1;
+  uint32_t seed;
+  /* keeps the planes 8 byte aligned */
+  uint32_t reserved;
+} c_film_header_t;
+
+/* Features per pixel: albedo rgb, normal xyz and depth. */
+#define FILM_FEATURES       7
+
+/* Arbitrary output variables, as bits of a mask. */
+typedef enum c_aov {
+  AOV_DEPTH   = 1 << 0,
+  AOV_NORMAL  = 1 << 1,
+  AOV_ALBEDO  = 1 << 2,
+  AOV_ID      = 1 << 3,
+  AOV_SPP     = 1 << 4,
+  AOV_COST    = 1 << 5,
+  AOV_ALL     = (1 << 6) - 1,
+} c_aov_t;
+
+/* AOVs kept in the feature buffer */
+#define AOV_FEATURES        (AOV_DEPTH | AOV_NORMAL | AOV_ALBEDO)
+
+/* id of a pixel without samples */
+#define AOV_NO_ID           INT32_MIN
+
+int film_init(c_film_t *f, uint32_t w, uint32_t h);
+/* Allocates the buffers of the AOVs in mask, -1 on failure. */
+int film_init_aovs(c_film_t *f, uint32_t mask);
+/* Drops the samples and AOVs of f, for the next frame. */
+void film_clear(c_film_t *f);
+void film_free(c_film_t *f);
+
+/* Mask of a comma separated list of AOV names ("depth,normal" or "all"),
+ * -1 if a name is unknown. */
+int aov_mask(const char *list);
+
+/* Name of the single AOV aov, as in file names. */
+const char *aov_name(uint32_t aov);
+
+/* Number of channels of the single AOV aov. */
+int aov_channels(uint32_t aov);
+
+/* film_aov
+ *
+ * Writes the values of the single AOV aov of the rows [y0, y1) to out,
+ * aov_channels() interleaved per pixel: depth, spp and cost
+ * (microseconds) have one, normal and albedo three. The id has three as
+ * well, its high and low 16 bits and 0, as floats only hold integers up
+ * to 2^24 exactly: id = r * 65536 + g, r and g are -1 for a miss. Depth,
+ * normal and albedo are the means over the samples.
+ */
+void film_aov(const c_film_t *f, uint32_t aov, uint32_t y0, uint32_t y1, float *out);
+
+/* Writes the linear colors of the rows [y0, y1) to out, rgb interleaved:
+ * film->rgb if set, else the means of the samples. */
+void film_color(const c_film_t *f, uint32_t y0, uint32_t y1, float *out);
+
+/* Index in the film of pixel (i, j) of the image. */
+inline uint32_t film_index(const c_film_t *f, uint32_t i, uint32_t j)
+{
+  return (j - f->y0) * f->w + (i - f->x0);
+}
+
+inline double luminance(const vec3 &c) { return .2126 * c.x + .7152 * c.y + .0722 * c.z; }
+
+/* film_add
+ *
+ * Adds one sample to pixel k. Only the thread rendering the pixel may call
+ * it, the samples of a pixel are summed in the order they are added.
+ */
+inline void film_add(c_film_t *f, uint32_t k, const vec3 &c)
+{
+  double l = luminance(c), d = l - f->mean[k];
+  uint32_t n = ++f->spp[k];
+
+  f->sum[3*k]   += rint(c.x * (1 / FILM_QUANTUM)) * FILM_QUANTUM;
+  f->sum[3*k+1] += rint(c.y * (1 / FILM_QUANTUM)) * FILM_QUANTUM;
+  f->sum[3*k+2] += rint(c.z * (1 / FILM_QUANTUM)) * FILM_QUANTUM;
+  f->mean[k] += d / n;
+  f->m2[k] += d * (l - f->mean[k]);
+}
+
+/* film_add_features
+ *
+ * Adds the albedo, normal and depth of the first hit of a sample to pixel
+ * k, zeros for a miss. Called once for every film_add() of the pixel.
+ */
+inline void film_add_features(c_film_t *f, uint32_t k, const vec3 &a, const vec3 &n, real_t z)
+{
+  float *p = f->feat + FILM_FEATURES * k;
+  p[0] += a.x; p[1] += a.y; p[2] += a.z;
+  p[3] += n.x; p[4] += n.y; p[5] += n.z;
+  p[6] += z;
+}
+
+/* Keeps id as the primitive of pixel k if it is the pixel's first sample. */
+inline void film_set_id(c_film_t *f, uint32_t k, int id)
+{
+  if (f->id[k] == AOV_NO_ID) f->id[k] = id;
+}
+
+/* film_error
+ *
+ * Relative standard error of the mean luminance of pixel k, 1 until the
+ * pixel has two samples. Dark pixels are measured against a floor of 1e-2
+ * so that a black background does not count as noisy.
+ */
+inline double film_error(const c_film_t *f, uint32_t k)
+{
+  uint32_t n = f->spp[k];
+  if (n < 2) return 1;
+  double var = f->m2[k] / (n - 1);
+  double m = f->mean[k] > 1e-2 ? f->mean[k] : 1e-2;
+  return sqrt(var / n) / m;
+}
+
+/* film_active
+ *
+ * True if pixel k still needs samples: it has fewer than min_spp or its
+ * film_error() is above noise.
+ */
+inline bool film_active(const c_film_t *f, uint32_t k, double noise, uint32_t min_spp)
+{
+  return f->spp[k] < min_spp || film_error(f, k) > noise;
+}
+
+/* Mean of film_error() over the whole image. */
+double film_noise(const c_film_t *f);
+
+/* Number of pixels for which film_active() holds. */
+uint32_t film_active_count(const c_film_t *f, double noise, uint32_t min_spp);
+
+/* Prints the distribution of the samples per pixel and the samples saved
+ * compared to rendering every pixel with the highest count. */
+void film_report(const c_film_t *f, FILE *out);
+
+/* film_save
+ *
+ * Writes f, a region of a w x h image rendered with seed, as film file to
+ * path. The file is written next to path and renamed over it once it is
+ * on disk, so path always holds a complete film. Returns -1 on failure.
+ */
+int film_save(const c_film_t *f, uint32_t w, uint32_t h, uint32_t seed, const char *path);
+
+/* film_load
+ *
+ * Maps the film file at path privately as f, its header to hd. The
+ * samples are used in place from the mapping, a page is only copied when
+ * it is first written to. Returns -1 if path is no film file.
+ */
+int film_load(c_film_t *f, c_film_header_t *hd, const char *path);
+
+/* film_merge
+ *
+ * Adds the partial film at path to f, which covers the whole image. A
+ * zeroed f is first initialized to the size of the image. Sums and counts
+ * add up exactly, means and m2 are combined as by Chan et al. parts holds
+ * the headers of the n_parts films merged before, the one of path is
+ * stored to parts[n_parts]. Returns -1 if path is no partial film of an
+ * image of the size of f, has another seed or samples of a pixel that are
+ * already merged.
+ */
+int film_merge(c_film_t *f, c_film_header_t *parts, uint32_t n_parts, const char *path);
+
+/* film_resolve
+ *
+ * Writes the mean of every pixel, or the color of film->rgb if set,
+ * tonemapped with tm to C_RGBA to im. The rows are tonemapped in
+ * parallel.
+ */
+void film_resolve(const c_film_t *f, uint32_t *im, const c_tonemap_t *tm);
+
+#endif // FILM_H
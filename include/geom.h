@@ -0,0 +1,118 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef GEOM_H
+#define GEOM_H
+
+#include "carbon.h"
+#include "scene.h"
+#include "simd.h"
+
+/* c_geom
+ *
+ * Sphere geometry as a structure of arrays: centers and squared radii in
+ * separate SIMD_ALIGN aligned arrays. Entry k belongs to the scene sphere
+ * id[k], the order follows the BVH leaves so that every leaf is a
+ * contiguous range. The arrays are padded by SIMD_WD spheres that can
+ * never be hit, so a kernel may always load full vectors.
+ */
+typedef struct c_geom {
+  real_t *cx, *cy, *cz, *r2;
+  uint32_t *id;
+  uint32_t n;
+} c_geom_t;
+
+c_geom_t *geom_build(const c_sphere *spheres, const uint32_t *order, uint32_t n);
+/* Copies the spheres to the arrays again, in the order they were built in. */
+void geom_update(c_geom_t *g, const c_sphere *spheres);
+void geom_free(c_geom_t *g);
+
+/* c_ray_lanes
+ *
+ * A ray broadcast to all SIMD lanes, set up once per ray and reused for
+ * every leaf that is tested.
+ */
+typedef struct c_ray_lanes {
+  vr_t ox, oy, oz, dx, dy, dz, a;
+
+  c_ray_lanes(const c_ray_t &r) {
+    ox = vr_set1(r.o.x); oy = vr_set1(r.o.y); oz = vr_set1(r.o.z);
+    dx = vr_set1(r.d.x); dy = vr_set1(r.d.y); dz = vr_set1(r.d.z);
+    a  = vr_set1(r.d.x * r.d.x + r.d.y * r.d.y + r.d.z * r.d.z);
+  }
+} c_ray_lanes_t;
+
+/* geom_closest
+ *
+ * Tests r against the spheres [first, first + count) of g, SIMD_WD at a
+ * time. Returns the entry of the closest hit in (tmin, *tmax) and lowers
+ * *tmax to its distance, or -1 if there is no such hit.
+ */
+inline int geom_closest(const c_geom_t *g, const c_ray_lanes_t &r, uint32_t first, uint32_t count,
+                        real_t tmin, real_t *tmax)
+{
+  vr_t vtmin = vr_set1(tmin), zero = vr_set1(0), lane = vr_iota();
+  vr_t best_t = vr_set1(*tmax), best_k = vr_set1(-1);
+  int any = 0;
+
+  STAT_ADD(sphere_tests, count);
+  for (uint32_t k = first; k < first + count; k += SIMD_WD) {
+    vr_t ocx = vr_sub(r.ox, vr_load(g->cx + k));
+    vr_t ocy = vr_sub(r.oy, vr_load(g->cy + k));
+    vr_t ocz = vr_sub(r.oz, vr_load(g->cz + k));
+    vr_t b = vr_add(vr_add(vr_mul(r.dx, ocx), vr_mul(r.dy, ocy)), vr_mul(r.dz, ocz));
+    vr_t c = vr_sub(vr_add(vr_add(vr_mul(ocx, ocx), vr_mul(ocy, ocy)), vr_mul(ocz, ocz)),
+                    vr_load(g->r2 + k));
+    vr_t sd = vr_sub(vr_mul(b, b), vr_mul(r.a, c));
+    /* lanes past the end of the range are masked out */
+    vm_t m = vm_and(vr_le(zero, sd), vr_lt(lane, vr_set1(first + count - k)));
+    if (!vm_bits(m)) continue;
+
+    vr_t sq = vr_sqrt(vr_max(sd, zero));
+    vr_t t0 = vr_div(vr_sub(vr_sub(zero, b), sq), r.a);
+    vr_t t1 = vr_div(vr_add(vr_sub(zero, b), sq), r.a);
+    vr_t t = vr_select(vr_lt(vtmin, t0), t0, t1);
+    m = vm_and(m, vm_and(vr_lt(vtmin, t), vr_lt(t, best_t)));
+
+    any |= vm_bits(m);
+    best_t = vr_select(m, t, best_t);
+    best_k = vr_select(m, vr_add(lane, vr_set1(k)), best_k);
+  }
+  if (!any) return -1;
+
+  real_t bt[SIMD_WD], bk[SIMD_WD];
+  vr_store(bt, best_t);
+  vr_store(bk, best_k);
+  int hit = -1;
+  for (int l = 0; l < SIMD_WD; ++l) {
+    if (bk[l] < 0) continue;
+    /* equal distances resolve to the lower entry, like a sequential scan */
+    if (bt[l] < *tmax || (bt[l] == *tmax && hit >= 0 && bk[l] < hit)) {
+      *tmax = bt[l];
+      hit = (int) bk[l];
+    }
+  }
+  return hit;
+}
+
+#endif // GEOM_H
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <thread>
+
+#include "carbon.h"
+
+/* Rows converted and written at a time by the float writers. */
+#define IMAGE_BAND          16
+
+/* Filtered bytes of a PNG deflated as one band by write_png(). */
+#define PNG_BAND_BYTES      (1 << 20)
+
+/* Output formats of the image. */
+typedef enum c_format {
+  FORMAT_PNG        = 0,
+  FORMAT_PFM        = 1,
+  FORMAT_EXR        = 2,
+  FORMAT_EXR_RLE    = 3,
+  /* streams of frames without a header: RGBA8 and little endian float RGB */
+  FORMAT_RAW        = 4,
+  FORMAT_RAW_FLOAT  = 5,
+} c_format_t;
+
+/* Format of name (png, pfm, exr, exr-rle, raw, raw-float), -1 if unknown. */
+int image_format(const char *name);
+
+/* File extension of the format, with the dot. Raw streams have none. */
+const char *image_ext(c_format_t format);
+
+inline bool image_raw(c_format_t format) { return format == FORMAT_RAW || format == FORMAT_RAW_FLOAT; }
+
+/* c_rows_fn
+ *
+ * Source of the float writers: fills the rows [y0, y1) of the image into
+ * out, the channels of a pixel interleaved, rows top to bottom.
+ */
+typedef void (*c_rows_fn)(void *ctx, uint32_t y0, uint32_t y1, float *out);
+
+/* write_pfm
+ *
+ * Writes the w x h image of channels 1 (grey) or 3 (rgb) from rows as
+ * Portable Float Map to path. The image is fetched and written
+ * IMAGE_BAND rows at a time, bottom band first as PFM stores the rows
+ * bottom up, so it is never held in memory as a whole. Returns -1 on
+ * failure.
+ */
+int write_pfm(const char *path, uint32_t w, uint32_t h, int channels, c_rows_fn rows, void *ctx);
+
+/* write_exr
+ *
+ * Writes the image like write_pfm() as single part scanline OpenEXR with
+ * 32 bit float channels (Y, or B G R), one scanline per chunk,
+ * uncompressed or RLE compressed. With RLE the offset table is written
+ * once all chunks are, so path has to be seekable. Returns -1 on failure.
+ */
+int write_exr(const char *path, uint32_t w, uint32_t h, int channels, int rle, c_rows_fn rows, void *ctx);
+
+/* Writes the image with write_pfm() or write_exr() by format. */
+int write_float_image(c_format_t format, const char *path, uint32_t w, uint32_t h, int channels,
+                      c_rows_fn rows, void *ctx);
+
+/* write_png
+ *
+ * Writes the w x h RGBA8 image im as PNG to path. The image is cut into
+ * bands of about PNG_BAND_BYTES which are filtered and deflated by all
+ * threads at once, each band an IDAT chunk ending in a sync flush, and
+ * written in order as they are done. The bands do not depend on the
+ * number of threads, neither does the file. Returns -1 on failure.
+ */
+int write_png(const char *path, const uint32_t *im, uint32_t w, uint32_t h);
+
+/* c_image_job
+ *
+ * Image written in the background by write_png_async(),
+ * write_float_image_async() or write_raw_async().
+ */
+typedef struct c_image_job {
+  std::thread thread;
+  int err;
+  /* Time taken to encode and write the image */
+  double ms;
+} c_image_job_t;
+
+/* write_png_async
+ *
+ * Starts write_png() on a thread of its own and returns at once, so the
+ * caller can go on (with the next frame) while the image is encoded. path
+ * and im have to stay untouched until image_wait().
+ */
+void write_png_async(c_image_job_t *job, const char *path, const uint32_t *im, uint32_t w, uint32_t h);
+
+/* Starts write_float_image() like write_png_async(), rows and ctx have to
+ * stay untouched until image_wait(). */
+void write_float_image_async(c_image_job_t *job, c_format_t format, const char *path, uint32_t w, uint32_t h,
+                             int channels, c_rows_fn rows, void *ctx);
+
+/* raw_open
+ *
+ * Opens path for a stream of raw frames: "-" is stdout, a named pipe is
+ * opened for writing (which waits for its reader), anything else is
+ * created or truncated. SIGPIPE is ignored from then on, so a reader that
+ * went away fails the next write instead of ending the process. Returns
+ * the file descriptor, -1 on failure.
+ */
+int raw_open(const char *path);
+
+/* write_raw
+ *
+ * Writes the n bytes of the frame buf to fd with a single write(2), which
+ * is only repeated for the rest if a pipe took less. Returns -1 on failure.
+ */
+int write_raw(int fd, const void *buf, size_t n);
+
+/* Starts write_raw() like write_png_async(), buf has to stay untouched
+ * until image_wait(). */
+void write_raw_async(c_image_job_t *job, int fd, const void *buf, size_t n);
+
+/* Waits for the job to finish, returns the result of its writer. */
+int image_wait(c_image_job_t *job);
+
+#endif // IMAGE_H
@@ -0,0 +1,160 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef MESH_H
+#define MESH_H
+
+#include "carbon.h"
+#include "scene.h"
+
+/* Magic ("CMSH") and version of the binary mesh format. */
+#define MESH_MAGIC          0x48534d43
+#define MESH_VERSION        1
+
+/* c_mesh_header
+ *
+ * Start of a binary mesh file. It is followed by nv vertex positions
+ * (float x, y, z) and nt triangles (uint32_t vertex indices), in the byte
+ * order of the machine that wrote it. Both arrays are used in place from
+ * the mapping, loading does not parse or copy anything.
+ */
+typedef struct c_mesh_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nv, nt;
+  float color[3];
+  float emission[3];
+  float ir;
+  uint32_t material;
+} c_mesh_header_t;
+
+/* c_mesh
+ *
+ * Indexed triangle mesh with one material. The vertex and index arrays
+ * either point into the mapping of a binary mesh or into memory owned by
+ * the mesh (OBJ import).
+ */
+typedef struct c_mesh {
+  /* vertex positions, xyz per vertex */
+  const float *v;
+  /* vertex indices, three per triangle */
+  const uint32_t *idx;
+  uint32_t nv, nt;
+  vec3 color;
+  vec3 emission;
+  real_t ir = 1.0;
+  c_material_t material = DIFF;
+  /* BVH over the triangles, built by scene_init() */
+  struct c_bvh *bvh = NULL;
+  /* scene id of the first triangle */
+  uint32_t first_id = 0;
+  /* mmap of a binary mesh (size > 0) or the malloc'd arrays */
+  void *map = NULL;
+  size_t map_size = 0;
+  /* file the mesh was loaded from, set by mesh_load() */
+  char *path = NULL;
+} c_mesh_t;
+
+/* Loads a binary mesh (.cmesh) with mmap or imports an OBJ file. */
+int mesh_load(c_mesh_t *m, const char *path);
+int mesh_load_obj(c_mesh_t *m, const char *path);
+int mesh_load_bin(c_mesh_t *m, const char *path);
+/* Writes m in the binary mesh format. */
+int mesh_save_bin(const c_mesh_t *m, const char *path);
+void mesh_free(c_mesh_t *m);
+/* Memory used by the vertices, triangles and BVH of m in bytes. */
+size_t mesh_bytes(const c_mesh_t *m);
+
+/* c_ray_shear
+ *
+ * Per ray setup of the watertight ray/triangle test (Woop, Benthin and
+ * Wald 2013): the axis the ray is most aligned with becomes z, the shear
+ * maps the ray onto the z axis.
+ */
+typedef struct c_ray_shear {
+  int kx, ky, kz;
+  real_t sx, sy, sz;
+  vec3 o;
+
+  c_ray_shear(const c_ray_t &r) {
+    real_t d[3] = { r.d.x, r.d.y, r.d.z };
+    kz = fabs(d[0]) > fabs(d[1]) ? (fabs(d[0]) > fabs(d[2]) ? 0 : 2) : (fabs(d[1]) > fabs(d[2]) ? 1 : 2);
+    kx = kz == 2 ? 0 : kz + 1;
+    ky = kx == 2 ? 0 : kx + 1;
+    /* keep the winding of the triangles */
+    if (d[kz] < 0) { int k = kx; kx = ky; ky = k; }
+    sx = d[kx] / d[kz];
+    sy = d[ky] / d[kz];
+    sz = 1 / d[kz];
+    o = r.o;
+  }
+} c_ray_shear_t;
+
+/* tri_hit
+ *
+ * Watertight intersection of a ray with triangle k of m: a ray through an
+ * edge or vertex shared by two triangles hits at least one of them. Stores
+ * the distance in *t if it lies in (tmin, tmax).
+ */
+inline bool tri_hit(const c_ray_shear_t &s, const c_mesh_t *m, uint32_t k, real_t tmin, real_t tmax, real_t *t)
+{
+  const float *p[3] = { m->v + 3 * m->idx[3*k], m->v + 3 * m->idx[3*k+1], m->v + 3 * m->idx[3*k+2] };
+  real_t o[3] = { s.o.x, s.o.y, s.o.z };
+  real_t a[3], b[3], c[3];
+  for (int i = 0; i < 3; ++i) {
+    a[i] = p[0][i] - o[i]; b[i] = p[1][i] - o[i]; c[i] = p[2][i] - o[i];
+  }
+  real_t ax = a[s.kx] - s.sx * a[s.kz], ay = a[s.ky] - s.sy * a[s.kz];
+  real_t bx = b[s.kx] - s.sx * b[s.kz], by = b[s.ky] - s.sy * b[s.kz];
+  real_t cx = c[s.kx] - s.sx * c[s.kz], cy = c[s.ky] - s.sy * c[s.kz];
+
+  /* scaled barycentrics, exactly zero on an edge */
+  real_t u = cx * by - cy * bx;
+  real_t v = ax * cy - ay * cx;
+  real_t w = bx * ay - by * ax;
+  if (u == 0 || v == 0 || w == 0) {
+    /* decided in double so that neighbours agree on the edge */
+    u = (double) cx * by - (double) cy * bx;
+    v = (double) ax * cy - (double) ay * cx;
+    w = (double) bx * ay - (double) by * ax;
+  }
+  if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return false;
+  real_t det = u + v + w;
+  if (det == 0) return false;
+
+  real_t tt = (u * s.sz * a[s.kz] + v * s.sz * b[s.kz] + w * s.sz * c[s.kz]) / det;
+  if (!(tmin < tt && tt < tmax)) return false;
+  *t = tt;
+  return true;
+}
+
+/* Geometric normal of triangle k of m, not normalized. */
+inline vec3 tri_normal(const c_mesh_t *m, uint32_t k)
+{
+  const float *a = m->v + 3 * m->idx[3*k], *b = m->v + 3 * m->idx[3*k+1], *c = m->v + 3 * m->idx[3*k+2];
+  vec3 e1(b[0] - a[0], b[1] - a[1], b[2] - a[2]);
+  vec3 e2(c[0] - a[0], c[1] - a[1], c[2] - a[2]);
+  return e1.prod(&e2);
+}
+
+#endif // MESH_H
@@ -0,0 +1,74 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "carbon.h"
+#include "scene.h"
+#include "simd.h"
+
+/* Edge length in pixels of a primary ray packet. */
+#define PACKET_DIM          8
+#define PACKET_SIZE         (PACKET_DIM * PACKET_DIM)
+
+/* c_packet
+ *
+ * Up to PACKET_SIZE coherent rays in structure of arrays layout, one SIMD
+ * lane per ray. After packet_trace() t[i] holds the distance of the closest
+ * hit of ray i and k[i] its entry in c_scene_t::geom (-1 for a miss).
+ */
+typedef struct c_packet {
+  alignas(SIMD_ALIGN) real_t ox[PACKET_SIZE];
+  alignas(SIMD_ALIGN) real_t oy[PACKET_SIZE];
+  alignas(SIMD_ALIGN) real_t oz[PACKET_SIZE];
+  alignas(SIMD_ALIGN) real_t dx[PACKET_SIZE];
+  alignas(SIMD_ALIGN) real_t dy[PACKET_SIZE];
+  alignas(SIMD_ALIGN) real_t dz[PACKET_SIZE];
+  /* squared length and inverse of the directions */
+  alignas(SIMD_ALIGN) real_t a[PACKET_SIZE];
+  alignas(SIMD_ALIGN) real_t ix[PACKET_SIZE];
+  alignas(SIMD_ALIGN) real_t iy[PACKET_SIZE];
+  alignas(SIMD_ALIGN) real_t iz[PACKET_SIZE];
+  alignas(SIMD_ALIGN) real_t t[PACKET_SIZE];
+  alignas(SIMD_ALIGN) real_t k[PACKET_SIZE];
+  /* number of rays in use */
+  uint32_t n;
+
+  void set(uint32_t i, const c_ray_t &r) {
+    ox[i] = r.o.x; oy[i] = r.o.y; oz[i] = r.o.z;
+    dx[i] = r.d.x; dy[i] = r.d.y; dz[i] = r.d.z;
+    a[i]  = r.d.x * r.d.x + r.d.y * r.d.y + r.d.z * r.d.z;
+    ix[i] = 1 / r.d.x; iy[i] = 1 / r.d.y; iz[i] = 1 / r.d.z;
+  }
+} c_packet_t;
+
+/* packet_trace
+ *
+ * Finds the closest hit in (tmin, 1e20) of every ray of p. Rays are
+ * traversed through the BVH together; nodes are culled for the whole packet
+ * with interval arithmetic and leaves are tested SIMD_WD rays at a time.
+ */
+void packet_trace(c_packet_t *p, const c_scene_t *s, real_t tmin);
+
+#endif // PACKET_H
@@ -23,6 +23,29 @@
 
 #include "carbon.h"
 #include "scene.h"
+#include "film.h"
+#include "stats.h"
+
+/* Edge length in pixels of the tiles distributed over the render threads. */
+#define TILE_SIZE 16
+
+/* Upper bound of the russian roulette survival probability, so that bright
+ * paths still terminate eventually. */
+#define RR_MAX_P 0.95
+
+/* Samples every pixel takes before adaptive sampling may stop it. */
+#define ADAPTIVE_MIN_SPP 8
+
+/* Dimensions of the random streams: the camera takes the first DIM_BLOCK,
+ * then every bounce a block of its own, the BSDF direction, the russian
+ * roulette, the choice of reflection or refraction and two per light. The
+ * draws of a bounce keep their dimensions whatever was drawn before, so
+ * the samples of a pixel stay stratified over the whole path. */
+#define DIM_BLOCK     4
+enum { DIM_BSDF = 0, DIM_ROULETTE = 2, DIM_FRESNEL = 3, DIM_LIGHTS = 4 };
+
+/* Seconds between the checkpoints of -resume, taken at the end of a pass. */
+#define CHECKPOINT_INTERVAL 60
 
 /* Rendering Engine */
 typedef struct c_renderer {
@@ -32,14 +55,108 @@ typedef struct c_renderer {
 } c_renderer_t;
 
 /* stack of rendering functions */
-vec3d random_unit_vec();
-vec3d random_vec_on_hemisphere(vec3d& n);
-vec3d reflect(vec3d &v, vec3d &n);
-vec3d refract(vec3d &d, vec3d &n, double refr);
-double reflect(double cosine, double i);
-int intersect(c_ray_t ray, c_scene_t *scene, double *t, int *id);
+vec3 random_unit_vec(c_rng_t *rng);
+vec3 random_vec_on_hemisphere(vec3& n, c_rng_t *rng);
+vec3 reflect(vec3 &v, vec3 &n);
+vec3 refract(vec3 &d, vec3 &n, real_t refr);
+real_t reflect(real_t cosine, real_t i);
+int closest_mesh(c_ray_t &r, c_scene_t *s, real_t tmin, real_t *t);
+int closest(c_ray_t &r, c_scene_t *s, real_t tmin, real_t *t);
+int intersect(c_ray_t ray, c_scene_t *scene, real_t *t, int *id);
 bool collide(c_ray_t r, c_scene_t *s, c_hit_t *h);
-vec3d ray_color(c_ray_t r, c_scene_t *s, int depth = 0, int max_depth = 50);
-vec3d radiance(c_ray_t &r, c_scene_t *scene, int depth, unsigned short *Xi);
-void pt(uint32_t *img, uint32_t w, uint32_t h, c_scene_t *scene, cam_t *cam);
-void rt(uint32_t *img, uint32_t w, uint32_t h, c_scene_t *scene, cam_t *cam, int maxd);
+vec3 ray_color(c_ray_t r, c_scene_t *s, c_rng_t *rng, int depth = 0, int max_depth = 50, int rr_depth = 5);
+vec3 background();
+bool bounce(c_ray_t &r, c_hit_t *h, c_rng_t *rng, vec3 *nd);
+bool roulette(vec3 *tp, c_rng_t *rng);
+vec3 scatter(c_ray_t &r, c_hit_t *h, c_scene_t *s, c_rng_t *rng, int depth, int max_depth, int rr_depth);
+vec3 cosine_dir(vec3 &w, c_rng_t *rng);
+vec3 radiance(c_ray_t &r, c_scene_t *scene, int depth, c_rng_t *rng, real_t pdf = 0);
+vec3 radiance_hit(c_ray_t &r, real_t t, int id, c_scene_t *scene, int depth, c_rng_t *rng, real_t pdf = 0);
+real_t light_pdf(const c_sphere &l, const vec3 &o);
+vec3 emission_mis(const c_hit_t &h, int id, const c_ray_t &r, real_t pdf, c_scene_t *scene);
+vec3 sample_lights(const c_hit_t &h, int id, c_scene_t *scene, c_rng_t *rng);
+/* Adds the first hit (t, id) of the camera ray r of pixel k to the AOVs
+ * of the film that keep it, id < 0 for a miss. */
+void add_first_hit(c_film_t *film, c_scene_t *scene, uint32_t k, c_ray_t &r, real_t t, int id);
+/* Spreads the render time t evenly over the n pixels pix of the film. */
+void add_cost(c_film_t *film, const uint32_t *pix, uint32_t n, double t);
+void pt(c_state_t *st, c_scene_t *scene, cam_t *cam, uint32_t s0, uint32_t s1);
+void rt(c_state_t *st, c_scene_t *scene, cam_t *cam, uint32_t s0, uint32_t s1);
+
+/* rng_bounce
+ *
+ * Moves rng to the block of dimensions of bounce depth (from 1). Blocks
+ * are a multiple of DIM_BLOCK long, so that the 2D pairs of a bounce fall
+ * into one group of the padded Sobol sequence.
+ */
+inline void rng_bounce(c_rng_t *rng, const c_scene_t *s, uint32_t depth)
+{
+  uint32_t n = (DIM_LIGHTS + 2 * s->num_lights + DIM_BLOCK - 1) / DIM_BLOCK * DIM_BLOCK;
+  rng->base = DIM_BLOCK + (uint64_t) (depth - 1) * n;
+}
+
+/* pixel_active
+ *
+ * True if pixel k takes part in the next pass. Only adaptive sampling
+ * drops pixels, once their own noise is below st->noise.
+ */
+inline bool pixel_active(const c_state_t *st, uint32_t k)
+{
+  return !st->adaptive || film_active(st->film, k, st->noise, ADAPTIVE_MIN_SPP);
+}
+
+/* render
+ *
+ * Renders cam->spp samples per pixel, or the samples [st->s0, st->s1),
+ * into the region of the image covered by st->film in passes of st->pass
+ * samples and resolves the film to st->im_buffer. Sampling continues
+ * after the samples the film already holds. With st->resume the film is
+ * saved there every CHECKPOINT_INTERVAL seconds and at the end; SIGINT or
+ * SIGTERM then end the render after the pass and its checkpoint. As a
+ * checkpoint must hold whole passes, st->resume takes no budget or
+ * adaptive sampling. Stops early once the film noise drops below
+ * st->noise or st->time_ms have passed; a pass cut by the deadline leaves
+ * its remaining tiles with fewer samples. With st->adaptive every pixel
+ * stops on its own noise instead. With st->denoise the film is denoised
+ * (into film->rgb) before it is resolved. Without st->im_buffer the film
+ * is not resolved.
+ */
+void render(c_state_t *st, c_scene_t *scene, cam_t *cam);
+
+/* render_tiles
+ *
+ * Splits the region [x0, x1) x [y0, y1) of the image into TILE_SIZE x
+ * TILE_SIZE tiles which are handed out to the threads dynamically.
+ * render_tile(x0, y0, x1, y1) is called exactly once per tile and must
+ * only write state owned by the pixels of the tile. Tiles not started
+ * before deadline (omp_get_wtime(), 0 for none) are skipped.
+ */
+template <typename F>
+inline void render_tiles(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, int threads, const char *tag,
+                         double deadline, F render_tile)
+{
+  int tx = (x1 - x0 + TILE_SIZE - 1) / TILE_SIZE;
+  int ty = (y1 - y0 + TILE_SIZE - 1) / TILE_SIZE;
+  int nt = tx * ty, done = 0;
+
+  if (threads <= 0) threads = omp_get_max_threads();
+
+#pragma omp parallel num_threads(threads)
+  {
+#pragma omp for schedule(dynamic, 1)
+    for (int t = 0; t < nt; ++t) {
+      uint32_t tx0 = x0 + (t % tx) * TILE_SIZE, tx1 = tx0 + TILE_SIZE < x1 ? tx0 + TILE_SIZE : x1;
+      uint32_t ty0 = y0 + (t / tx) * TILE_SIZE, ty1 = ty0 + TILE_SIZE < y1 ? ty0 + TILE_SIZE : y1;
+
+      if (deadline == 0 || omp_get_wtime() < deadline)
+        render_tile(tx0, ty0, tx1, ty1);
+
+      int d;
+#pragma omp atomic capture
+      d = ++done;
+      if (omp_get_thread_num() == 0)
+        fprintf(stderr,"\r%s Rendering %5.2f%%", tag, 100. * d / nt);
+    }
+    stats_flush();
+  }
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "carbon.h"
+
+/* Edge length of the tiled blue noise mask, a power of two. */
+#define BLUE_NOISE_SIZE     64
+
+/* Samplers of the random streams, see sampler_next(). */
+typedef enum c_sampler_type {
+  SAMPLER_INDEPENDENT = 0,
+  SAMPLER_SOBOL       = 1,
+  SAMPLER_HALTON      = 2,
+  SAMPLER_BLUENOISE   = 3,
+} c_sampler_type_t;
+
+/* c_sampler
+ *
+ * Low discrepancy sequence the streams of c_rng draw from. The renderer
+ * gives every draw of a path a fixed dimension (rng_bounce()), so that the
+ * samples of a pixel read the same dimension of the sequence.
+ */
+typedef struct c_sampler {
+  c_sampler_type_t type;
+  /* width of the image, pixel k lies at (k % w, k / w) */
+  uint32_t w;
+  /* samples per pixel, the digits of Halton that stratify them are exact */
+  uint32_t spp;
+} c_sampler_t;
+
+/* Type of the sampler name (independent, sobol, halton, bluenoise), -1
+ * if unknown. */
+int sampler_type(const char *name);
+
+/* Sets up s for an image of width w with spp samples per pixel. The blue
+ * noise mask is built on the first call with SAMPLER_BLUENOISE. */
+void sampler_init(c_sampler_t *s, c_sampler_type_t type, uint32_t w, uint32_t spp);
+
+#endif // SAMPLER_H
@@ -24,7 +24,10 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include <limits>
+
 #include "carbon.h"
+#include "stats.h"
 
 typedef enum c_material {
   /*  Diffusion */
@@ -36,81 +39,120 @@ typedef enum c_material {
   REFR,
 } c_material_t;
 
+/* Number of materials, values read from files are checked against it. */
+#define NUM_MATERIALS (REFR + 1)
+
+/* Rounding error bound of a hit point in units of the machine epsilon. */
+#define HIT_EPS_ULPS        8
+
 /* c_hit
  *
  * Cache for storing the latest intersected object.
  */
-typedef struct c_hit {
+template <typename T>
+struct c_hit_ {
   /* hit point origin and normal */
-  vec3d o, n;
+  vec3_<T> o, n;
   /* distance */
-  double t;
-  /* color */
-  vec3d col;
+  T t;
+  /* bound of the rounding error of o */
+  T eps;
+  /* color and emission */
+  vec3_<T> col;
+  vec3_<T> e;
   /* idx of refraction */
-  double ir;
+  T ir;
   /* material */
   c_material_t mat;
   /* front face of the hit */
   bool ff;
 
-  void set_ff_n(c_ray& r, vec3d& on) {
+  void set_ff_n(c_ray_<T>& r, vec3_<T>& on) {
     ff = r.d.dot(&on) < 0;
     this->n = ff ? on : on * -1;
   }
-} c_hit_t;
 
-struct c_sphere {
-  double radius;
+  /* Origin of a ray leaving the surface in direction d, moved off the
+   * surface by eps so that it does not hit it again. */
+  vec3_<T> spawn(const vec3_<T> &d) const {
+    return o + n * (n.dot(&d) > 0 ? eps : -eps);
+  }
+};
+typedef c_hit_<real_t> c_hit;
+typedef c_hit c_hit_t;
+
+template <typename T>
+struct c_sphere_ {
+  T radius;
   /* center */
-  vec3d pos;
-  vec3d color;
-  vec3d emission;
-  double ir       = 1.0;
+  vec3_<T> pos;
+  vec3_<T> color;
+  vec3_<T> emission;
+  T ir            = 1.0;
   c_material_t material;
 
-  int hit(c_ray_t r, c_hit_t *ch, double tmin = 0, double tmax = 1e20) {
-    vec3d oc = r.o - this->pos;
-    double a = r.d.dot(&r.d); 
-    double b = (r.d).dot(&oc);
-    double c = oc.dot(&oc) - (this->radius * this->radius);
+  int hit(c_ray_<T> r, c_hit_<T> *ch, T tmin = 0, T tmax = 1e20) {
+    vec3_<T> oc = r.o - this->pos;
+    T a = r.d.dot(&r.d); 
+    T b = (r.d).dot(&oc);
+    T c = oc.dot(&oc) - (this->radius * this->radius);
 
-    double sd = b * b - (a * c);
+    T sd = b * b - (a * c);
     if (sd < 0) return 0;
 
-    double sqrtd = sqrt(sd);
-    double root = (-b - sqrtd) / a;
+    T sqrtd = sqrt(sd);
+    T root = (-b - sqrtd) / a;
     if (root <= tmin || tmax <= root) {
       root = (-b + sqrtd) / a;
       if (root <= tmin || tmax <= root)
         return 0;
     }
 
-    ch->t = root;
-    ch->o = r.o + r.d * root;
-    vec3d on = (ch->o - pos) / radius;
-    ch->set_ff_n(r, on);
-
+    set_hit(r, root, ch);
     return 1;
   }
 
-  double intersect(c_ray r) {
-    vec3d oc = r.o - this->pos;
-    double a = r.d.dot(&r.d); 
-    double b = (r.d * 2.0).dot(&oc);
-    double c = oc.dot(&oc) - (this->radius * this->radius);
+  /* Rounding error bound of the point p on the sphere. The center and the
+   * radius enter the error of the intersection distance, which matters for
+   * large spheres such as the ground. */
+  T hit_eps(const vec3_<T> &p) const {
+    return HIT_EPS_ULPS * std::numeric_limits<T>::epsilon() * (p.amax() + pos.amax() + radius);
+  }
+
+  /* Fills ch for the hit of r at distance t. */
+  void set_hit(c_ray_<T> &r, T t, c_hit_<T> *ch) const {
+    ch->t = t;
+    ch->o = r.o + r.d * t;
+    ch->eps = hit_eps(ch->o);
+    vec3_<T> on = (ch->o - pos) / radius;
+    ch->set_ff_n(r, on);
+    ch->mat = material;
+    ch->col = color;
+    ch->e   = emission;
+    ch->ir  = ir;
+  }
 
-    double sd = b * b - (a * 4.0 * c);
+  T intersect(c_ray_<T> r) {
+    vec3_<T> oc = r.o - this->pos;
+    T a = r.d.dot(&r.d); 
+    T b = (r.d * 2.0).dot(&oc);
+    T c = oc.dot(&oc) - (this->radius * this->radius);
+
+    T sd = b * b - (a * 4.0 * c);
     if (sd < 0) return 0;
-    else return (-b - sqrt(sd)) / (2.0 * a);
+    /* nearest root in front of the origin, 0 if there is none */
+    T t, eps = 1e-4;
+    sd = sqrt(sd);
+    return (t = (-b - sd) / (2.0 * a)) > eps ? t : ((t = (-b + sd) / (2.0 * a)) > eps ? t : 0);
   }
 };
+typedef c_sphere_<real_t> c_sphere;
 
 struct c_plane {
-  vec3d normal;
-  vec3d pos;
-  vec3d color;
-  vec3d emission;
+  vec3 normal;
+  vec3 pos;
+  vec3 color;
+  vec3 emission;
   c_material_t material;
 };
 
@@ -118,65 +160,97 @@ struct c_plane {
 typedef struct c_scene {
   c_sphere *spheres;
   uint32_t num_spheres;
+  /* acceleration structure over spheres, NULL tests every sphere */
+  struct c_bvh *bvh = NULL;
+  /* sphere geometry as structure of arrays, in BVH leaf order */
+  struct c_geom *geom = NULL;
+  /* triangle meshes, their triangles follow the spheres in the scene ids */
+  struct c_mesh *meshes = NULL;
+  uint32_t num_meshes = 0;
+  /* emissive spheres sampled by next event estimation (pt) */
+  uint32_t *lights = NULL;
+  uint32_t num_lights = 0;
+  /* mapping of the binary scene the spheres live in, if map_size > 0 */
+  void *map = NULL;
+  size_t map_size = 0;
 } c_scene_t;
 
+/* Builds the BVHs (if use_bvh), the geometry arrays and the light list of s. */
+void scene_init(c_scene_t *s, int use_bvh);
+/* Updates what scene_init() built after spheres moved, without a rebuild:
+ * the BVH is refit and the geometry arrays are copied again. */
+void scene_refit(c_scene_t *s);
+/* Frees what scene_init() built, the meshes themselves are not freed. */
+void scene_free(c_scene_t *s);
+
+/* scene_set_hit
+ *
+ * Fills h for the hit of r at distance t with primitive id of the scene:
+ * ids below num_spheres are spheres, the rest are mesh triangles.
+ */
+void scene_set_hit(const c_scene_t *s, int id, c_ray_t &r, real_t t, c_hit_t *h);
+c_material_t scene_material(const c_scene_t *s, int id);
+
 /* Camera */
-typedef struct cam {
+template <typename T>
+struct cam_ {
   uint32_t w, h;
   /* Camera origin */
-  vec3d origin   = vec3d(0, 0, 0);
+  vec3_<T> origin   = vec3_<T>(0, 0, 0);
   /* Vertical view angle (field of view) */
-  double vfov    = 90;
+  T vfov    = 90;
   /* Reference or proxy point where the camera looks at. */
-  vec3d refp     = vec3d(0, 0, -1);
+  vec3_<T> refp     = vec3_<T>(0, 0, -1);
   /* Camera-relative "up" direction */
-  vec3d vup      = vec3d(0, 1, 0);
+  vec3_<T> vup      = vec3_<T>(0, 1, 0);
   /* Count of random samples for each pixel */
   uint32_t spp   = 10;
 
-  void init(uint32_t w_, uint32_t h_, uint32_t spp_, double vfov_) {
+  void init(uint32_t w_, uint32_t h_, uint32_t spp_, T vfov_) {
     w = w_;
     h = h_;
     spp = spp_;
     vfov = vfov_;
 
-    double focal_l = (origin - refp).len();
-    double theta = degr_to_rad(vfov);
-    double th = tan(theta / 2);
+    T focal_l = (origin - refp).len();
+    T theta = degr_to_rad(vfov);
+    T th = tan(theta / 2);
 
-    double vp_h = 2 * th * focal_l;
-    double vp_w = vp_h * (static_cast<double>(w) / h);
+    T vp_h = 2 * th * focal_l;
+    T vp_w = vp_h * (static_cast<T>(w) / h);
 
-    cw = vec3d::unit(origin - refp);
-    cu = vec3d::unit(vup.prod(&cw));
+    cw = vec3_<T>::unit(origin - refp);
+    cu = vec3_<T>::unit(vup.prod(&cw));
     cv = cw.prod(&cu);
 
     this->vu = cu * vp_w;
     this->vv = cv * -vp_h;
 
-    vec3d vp_up_left = origin - (cw * focal_l) - (vu / 2) - (vv / 2);
+    vec3_<T> vp_up_left = origin - (cw * focal_l) - (vu / 2) - (vv / 2);
     this->p0 = vp_up_left + (vu / w + vv / h) * 0.5;
   }
 
   /* Sample around each pixel */
-  vec3d sample_pixel_sqr() const {
-    double px = -0.5 + randd();
-    double py = -0.5 + randd();
+  vec3_<T> sample_pixel_sqr(c_rng_t *rng) const {
+    T px = -0.5 + randd(rng);
+    T py = -0.5 + randd(rng);
     return (this->vu / w * px) + (this->vv / h * py);
   }
 
   /* Get ray for pixel at (x_, y_) */
-  c_ray get_ray(int x_, int y_) {
-    vec3d r = this->p0 + (this->vu / w * x_) + (this->vv/ h * y_) - this->origin;
-    vec3d s = sample_pixel_sqr();
-    return c_ray(s - this->origin, r.norm());
+  c_ray_<T> get_ray(int x_, int y_, c_rng_t *rng) {
+    vec3_<T> r = this->p0 + (this->vu / w * x_) + (this->vv/ h * y_) - this->origin;
+    vec3_<T> s = sample_pixel_sqr(rng);
+    STAT_ADD(rays_primary, 1);
+    return c_ray_<T>(this->origin + s, r.norm());
   }
 
 private:
-  vec3d p0;
-  vec3d vu, vv;
+  vec3_<T> p0;
+  vec3_<T> vu, vv;
   /* Camera frame basis vectors */
-  vec3d cu, cv, cw;        
-} cam_t;
+  vec3_<T> cu, cv, cw;        
+};
+typedef cam_<real_t> cam_t;
 
 #endif // SCENE_H
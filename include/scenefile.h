@@ -0,0 +1,99 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include "carbon.h"
+#include "scene.h"
+
+/* Magic ("CSCN") and version of the binary scene format. */
+#define SCENE_MAGIC         0x4e435343
+#define SCENE_VERSION       1
+/* Longest mesh path a binary scene can store. */
+#define SCENE_PATH_MAX      256
+
+/* c_scene_header
+ *
+ * Start of a binary scene file (.cscene). The spheres follow at
+ * sphere_offset as an array of c_sphere in the memory layout of the
+ * writer, so a build with the same real_t uses them in place from the
+ * mapping. The mesh records follow at mesh_offset.
+ */
+typedef struct c_scene_header {
+  uint32_t magic;
+  uint32_t version;
+  /* sizeof(real_t) and sizeof(c_sphere) of the writer */
+  uint32_t real_size;
+  uint32_t sphere_size;
+  uint32_t num_spheres;
+  uint32_t num_meshes;
+  uint64_t sphere_offset;
+  uint64_t mesh_offset;
+  /* camera */
+  double origin[3];
+  double refp[3];
+  double vup[3];
+  double vfov;
+  uint32_t reserved[2];
+} c_scene_header_t;
+
+/* Mesh of a binary scene, its material replaces the one of the file. */
+typedef struct c_scene_mesh {
+  char path[SCENE_PATH_MAX];
+  double color[3];
+  double emission[3];
+  double ir;
+  uint32_t material;
+  uint32_t reserved;
+} c_scene_mesh_t;
+
+/* scene_load
+ *
+ * Fills s and the camera of cam from a scene file: a binary scene if the
+ * name ends in .cscene, else the text format. The text format has one
+ * object per line, '#' starts a comment:
+ *
+ *   camera <origin xyz> <look at xyz> <up xyz> <vfov>
+ *   sphere <radius> <pos xyz> <color rgb> <emission rgb> <ir> <material>
+ *   mesh   <file> [<color rgb> <emission rgb> <ir> <material>]
+ *
+ * Materials are diff, refl, spec and refr. Mesh files are relative to the
+ * working directory, like -mesh.
+ */
+int scene_load(c_scene_t *s, cam_t *cam, const char *path);
+/* Parses a scene in the text format, name is used in error messages. */
+int scene_parse(c_scene_t *s, cam_t *cam, const char *text, size_t len, const char *name);
+/* Writes s and cam in the format given by the name of path. */
+int scene_save(const c_scene_t *s, const cam_t *cam, const char *path);
+
+/* Appends n spheres to s and returns the first of them. */
+c_sphere *scene_add_spheres(c_scene_t *s, uint32_t n);
+/* Loads the mesh at path and adds it to s. */
+int scene_add_mesh(c_scene_t *s, const char *path);
+/* Scatters n small spheres on the ground plane, used to stress test. */
+void random_spheres(c_sphere *sp, uint32_t n, uint32_t seed);
+/* Frees the spheres and meshes of a loaded scene. */
+void scene_unload(c_scene_t *s);
+
+#endif // SCENEFILE_H
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <math.h>
+
+#include "carbon.h"
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/* Alignment of the SIMD arrays in bytes. */
+#define SIMD_ALIGN          64
+
+/* vr_t
+ *
+ * Vector of SIMD_WD real_t and the matching lane mask vm_t. The widest
+ * instruction set enabled at compile time is used (-march), the scalar
+ * fallback has a width of one.
+ */
+#if defined(CARBON_FLOAT) && defined(__AVX512F__)
+#define SIMD_WD             16
+typedef __m512 vr_t;
+typedef __mmask16 vm_t;
+
+inline vr_t vr_set1(float a)                { return _mm512_set1_ps(a); }
+inline vr_t vr_load(const float *p)         { return _mm512_loadu_ps(p); }
+inline void vr_store(float *p, vr_t a)      { _mm512_storeu_ps(p, a); }
+inline vr_t vr_iota()                       { return _mm512_set_ps(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0); }
+inline vr_t vr_add(vr_t a, vr_t b)          { return _mm512_add_ps(a, b); }
+inline vr_t vr_sub(vr_t a, vr_t b)          { return _mm512_sub_ps(a, b); }
+inline vr_t vr_mul(vr_t a, vr_t b)          { return _mm512_mul_ps(a, b); }
+inline vr_t vr_div(vr_t a, vr_t b)          { return _mm512_div_ps(a, b); }
+inline vr_t vr_sqrt(vr_t a)                 { return _mm512_sqrt_ps(a); }
+inline vr_t vr_min(vr_t a, vr_t b)          { return _mm512_min_ps(a, b); }
+inline vr_t vr_max(vr_t a, vr_t b)          { return _mm512_max_ps(a, b); }
+inline vm_t vr_lt(vr_t a, vr_t b)           { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+inline vm_t vr_le(vr_t a, vr_t b)           { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+inline vm_t vm_and(vm_t a, vm_t b)          { return a & b; }
+inline vm_t vm_or(vm_t a, vm_t b)           { return a | b; }
+inline vr_t vr_select(vm_t m, vr_t a, vr_t b) { return _mm512_mask_blend_ps(m, b, a); }
+inline int vm_bits(vm_t m)                  { return m; }
+#elif defined(CARBON_FLOAT) && defined(__AVX2__)
+#define SIMD_WD             8
+typedef __m256 vr_t;
+typedef __m256 vm_t;
+
+inline vr_t vr_set1(float a)                { return _mm256_set1_ps(a); }
+inline vr_t vr_load(const float *p)         { return _mm256_loadu_ps(p); }
+inline void vr_store(float *p, vr_t a)      { _mm256_storeu_ps(p, a); }
+inline vr_t vr_iota()                       { return _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0); }
+inline vr_t vr_add(vr_t a, vr_t b)          { return _mm256_add_ps(a, b); }
+inline vr_t vr_sub(vr_t a, vr_t b)          { return _mm256_sub_ps(a, b); }
+inline vr_t vr_mul(vr_t a, vr_t b)          { return _mm256_mul_ps(a, b); }
+inline vr_t vr_div(vr_t a, vr_t b)          { return _mm256_div_ps(a, b); }
+inline vr_t vr_sqrt(vr_t a)                 { return _mm256_sqrt_ps(a); }
+inline vr_t vr_min(vr_t a, vr_t b)          { return _mm256_min_ps(a, b); }
+inline vr_t vr_max(vr_t a, vr_t b)          { return _mm256_max_ps(a, b); }
+inline vm_t vr_lt(vr_t a, vr_t b)           { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline vm_t vr_le(vr_t a, vr_t b)           { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline vm_t vm_and(vm_t a, vm_t b)          { return _mm256_and_ps(a, b); }
+inline vm_t vm_or(vm_t a, vm_t b)           { return _mm256_or_ps(a, b); }
+inline vr_t vr_select(vm_t m, vr_t a, vr_t b) { return _mm256_blendv_ps(b, a, m); }
+inline int vm_bits(vm_t m)                  { return _mm256_movemask_ps(m); }
+#elif defined(__AVX512F__)
+#define SIMD_WD             8
+typedef __m512d vr_t;
+typedef __mmask8 vm_t;
+
+inline vr_t vr_set1(double a)               { return _mm512_set1_pd(a); }
+inline vr_t vr_load(const double *p)        { return _mm512_loadu_pd(p); }
+inline void vr_store(double *p, vr_t a)     { _mm512_storeu_pd(p, a); }
+inline vr_t vr_iota()                       { return _mm512_set_pd(7, 6, 5, 4, 3, 2, 1, 0); }
+inline vr_t vr_add(vr_t a, vr_t b)          { return _mm512_add_pd(a, b); }
+inline vr_t vr_sub(vr_t a, vr_t b)          { return _mm512_sub_pd(a, b); }
+inline vr_t vr_mul(vr_t a, vr_t b)          { return _mm512_mul_pd(a, b); }
+inline vr_t vr_div(vr_t a, vr_t b)          { return _mm512_div_pd(a, b); }
+inline vr_t vr_sqrt(vr_t a)                 { return _mm512_sqrt_pd(a); }
+inline vr_t vr_min(vr_t a, vr_t b)          { return _mm512_min_pd(a, b); }
+inline vr_t vr_max(vr_t a, vr_t b)          { return _mm512_max_pd(a, b); }
+inline vm_t vr_lt(vr_t a, vr_t b)           { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+inline vm_t vr_le(vr_t a, vr_t b)           { return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ); }
+inline vm_t vm_and(vm_t a, vm_t b)          { return a & b; }
+inline vm_t vm_or(vm_t a, vm_t b)           { return a | b; }
+inline vr_t vr_select(vm_t m, vr_t a, vr_t b) { return _mm512_mask_blend_pd(m, b, a); }
+inline int vm_bits(vm_t m)                  { return m; }
+#elif defined(__AVX2__)
+#define SIMD_WD             4
+typedef __m256d vr_t;
+typedef __m256d vm_t;
+
+inline vr_t vr_set1(double a)               { return _mm256_set1_pd(a); }
+inline vr_t vr_load(const double *p)        { return _mm256_loadu_pd(p); }
+inline void vr_store(double *p, vr_t a)     { _mm256_storeu_pd(p, a); }
+inline vr_t vr_iota()                       { return _mm256_set_pd(3, 2, 1, 0); }
+inline vr_t vr_add(vr_t a, vr_t b)          { return _mm256_add_pd(a, b); }
+inline vr_t vr_sub(vr_t a, vr_t b)          { return _mm256_sub_pd(a, b); }
+inline vr_t vr_mul(vr_t a, vr_t b)          { return _mm256_mul_pd(a, b); }
+inline vr_t vr_div(vr_t a, vr_t b)          { return _mm256_div_pd(a, b); }
+inline vr_t vr_sqrt(vr_t a)                 { return _mm256_sqrt_pd(a); }
+inline vr_t vr_min(vr_t a, vr_t b)          { return _mm256_min_pd(a, b); }
+inline vr_t vr_max(vr_t a, vr_t b)          { return _mm256_max_pd(a, b); }
+inline vm_t vr_lt(vr_t a, vr_t b)           { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+inline vm_t vr_le(vr_t a, vr_t b)           { return _mm256_cmp_pd(a, b, _CMP_LE_OQ); }
+inline vm_t vm_and(vm_t a, vm_t b)          { return _mm256_and_pd(a, b); }
+inline vm_t vm_or(vm_t a, vm_t b)           { return _mm256_or_pd(a, b); }
+inline vr_t vr_select(vm_t m, vr_t a, vr_t b) { return _mm256_blendv_pd(b, a, m); }
+inline int vm_bits(vm_t m)                  { return _mm256_movemask_pd(m); }
+#else
+#define SIMD_WD             1
+typedef real_t vr_t;
+typedef bool vm_t;
+
+inline vr_t vr_set1(real_t a)               { return a; }
+inline vr_t vr_load(const real_t *p)        { return *p; }
+inline void vr_store(real_t *p, vr_t a)     { *p = a; }
+inline vr_t vr_iota()                       { return 0; }
+inline vr_t vr_add(vr_t a, vr_t b)          { return a + b; }
+inline vr_t vr_sub(vr_t a, vr_t b)          { return a - b; }
+inline vr_t vr_mul(vr_t a, vr_t b)          { return a * b; }
+inline vr_t vr_div(vr_t a, vr_t b)          { return a / b; }
+inline vr_t vr_sqrt(vr_t a)                 { return sqrt(a); }
+inline vr_t vr_min(vr_t a, vr_t b)          { return a < b ? a : b; }
+inline vr_t vr_max(vr_t a, vr_t b)          { return a > b ? a : b; }
+inline vm_t vr_lt(vr_t a, vr_t b)           { return a < b; }
+inline vm_t vr_le(vr_t a, vr_t b)           { return a <= b; }
+inline vm_t vm_and(vm_t a, vm_t b)          { return a && b; }
+inline vm_t vm_or(vm_t a, vm_t b)           { return a || b; }
+inline vr_t vr_select(vm_t m, vr_t a, vr_t b) { return m ? a : b; }
+inline int vm_bits(vm_t m)                  { return m; }
+#endif
+
+#endif // SIMD_H
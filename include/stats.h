@@ -0,0 +1,88 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "carbon.h"
+
+/* Longer paths are counted in the last bucket of the depth histogram. */
+#define STATS_MAX_DEPTH     64
+
+/* c_stats
+ *
+ * Render counters. Rays are counted where they are cast, tests per ray
+ * and primitive, paths by their number of segments (1 + secondary rays).
+ */
+typedef struct c_stats {
+  uint64_t rays_primary;
+  uint64_t rays_secondary;
+  uint64_t rays_shadow;
+  uint64_t sphere_tests;
+  uint64_t tri_tests;
+  uint64_t bvh_nodes;
+  /* paths that ended on a miss */
+  uint64_t misses;
+  uint64_t depth[STATS_MAX_DEPTH + 1];
+} c_stats_t;
+
+/* STAT_ADD
+ *
+ * Counters are only compiled in with `scons stats=1` (CARBON_STATS). Each
+ * thread counts into its own copy, stats_flush() adds it to the totals at
+ * the end of every parallel render loop. Without CARBON_STATS the macros
+ * expand to nothing and their arguments are not evaluated.
+ */
+#ifdef CARBON_STATS
+/* __thread: a plain TLS access, without the init wrapper of thread_local */
+extern __thread c_stats_t stats_local;
+
+#define STAT_ADD(field, n)  (stats_local.field += (n))
+/* STAT_PATH_BEGIN() / STAT_PATH_END() bracket one sample of a pixel */
+#define STAT_PATH_BEGIN()   uint64_t stat_path_rays_ = stats_local.rays_secondary
+#define STAT_PATH_END()     stats_path(1 + stats_local.rays_secondary - stat_path_rays_)
+#define STAT_ENABLED        1
+
+inline void stats_path(uint64_t segments)
+{
+  stats_local.depth[segments < STATS_MAX_DEPTH ? segments : STATS_MAX_DEPTH]++;
+}
+void stats_flush();
+#else
+#define STAT_ADD(field, n)  ((void) 0)
+#define STAT_PATH_BEGIN()   ((void) 0)
+#define STAT_PATH_END()     ((void) 0)
+#define STAT_ENABLED        0
+
+inline void stats_path(uint64_t) {}
+inline void stats_flush() {}
+#endif
+
+/* Totals of all threads (including the calling one) and their reset. */
+void stats_get(c_stats_t *s);
+void stats_reset();
+/* Prints s as a table or as JSON, seconds is the render time. */
+void stats_print(const c_stats_t *s, double seconds, FILE *out);
+void stats_json(const c_stats_t *s, double seconds, FILE *out);
+
+#endif // STATS_H
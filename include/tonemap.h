@@ -0,0 +1,57 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+#include "carbon.h"
+
+/* Operators applied to the linear values before the gamma curve. */
+typedef enum c_tonemap_op {
+  TONEMAP_CLAMP     = 0,
+  TONEMAP_REINHARD  = 1,
+  TONEMAP_ACES      = 2,
+} c_tonemap_op_t;
+
+typedef struct c_tonemap {
+  c_tonemap_op_t op = TONEMAP_CLAMP;
+  /* exposure in stops, the values are scaled by 2^exposure first */
+  double exposure   = 0;
+} c_tonemap_t;
+
+/* Operator of name (clamp, reinhard, aces), -1 if unknown. */
+int tonemap_op(const char *name);
+
+/* tonemap_span
+ *
+ * Maps the linear values x[i] / div[i] of a row to gamma corrected 8 bit
+ * codes in out, n of them. Instead of a pow() per value, the code is
+ * looked up in a table of the values where toInt() steps to the next
+ * code: a bucket index from the exponent and top mantissa bits gives the
+ * code up to one, a compare with the next step settles it. The clamp
+ * operator without exposure gives exactly toInt(). Whole rows are done
+ * 4 values at a time with AVX2, if enabled.
+ */
+void tonemap_span(const c_tonemap_t *tm, const double *x, const double *div, size_t n, uint8_t *out);
+
+#endif // TONEMAP_H
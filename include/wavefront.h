@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "carbon.h"
+#include "scene.h"
+
+/* Maximum number of paths in flight per render thread. */
+#define WF_QUEUE_SIZE       (1 << 14)
+
+/* c_paths
+ *
+ * Queue of the paths in flight as structure of arrays. Every path carries
+ * its current ray, throughput, the result of the last intersection, the
+ * pixel it contributes to and its random stream.
+ */
+typedef struct c_paths {
+  real_t *ox, *oy, *oz;
+  real_t *dx, *dy, *dz;
+  /* throughput and radiance gathered so far */
+  real_t *tr, *tg, *tb;
+  real_t *lr, *lg, *lb;
+  /* closest hit distance and sphere, id < 0 for a miss */
+  real_t *t;
+  /* density the BSDF sampled the ray with, 0 for camera rays (pt) */
+  real_t *pdf;
+  int32_t *id;
+  /* pixel index in the image and number of bounces */
+  uint32_t *pix;
+  uint32_t *depth;
+  c_rng_t *rng;
+  uint32_t n;
+} c_paths_t;
+
+/* wavefront
+ *
+ * Streaming variant of rt() / pt() for the samples [s0, s1). Each tile is
+ * rendered by running the generate, extend (intersect), shade (grouped by
+ * material) and accumulate stages over the whole queue until every path
+ * terminated.
+ */
+void wavefront(c_state_t *st, c_scene_t *scene, cam_t *cam, uint32_t s0, uint32_t s1);
+
+#endif // WAVEFRONT_H
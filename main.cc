@@ -21,12 +21,19 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. 
  * */
 
+#include <algorithm>
+#include <unistd.h>
+
 #include "carbon.h"
 #include "scene.h"
 #include "renderer.h"
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
+#include "film.h"
+#include "mesh.h"
+#include "scenefile.h"
+#include "stats.h"
+#include "image.h"
+#include "anim.h"
+#include "sampler.h"
 
 static const char show_help[] =
   "Carbon Rendering Engine "" \n"
@@ -34,17 +41,190 @@ static const char show_help[] =
   "Usage: carbon [options...] [-o outfile] ...\n"
   "General options:\n"
   "  -o <file>           Place the output into <file>.\n"
+  "  -format             Output format: png (default), pfm, exr or exr-rle (float),\n"
+  "                      or raw (rgba8) and raw-float frames streamed to <file> or -.\n"
+  "  -region             Render x0,y0,x1,y1 of the image into a partial <file>.cfilm.\n"
+  "  -sample-range       Render the samples s0,s1 of -s into a partial <file>.cfilm.\n"
+  "  -resume             Continue from the checkpoint <file>, saved to while rendering.\n"
+  "  -anim               Keyframes of the camera and spheres of the animation.\n"
+  "  -frames             Render the frames n or f0,f1 to <file>.<frame>.png.\n"
   "  -help               Display available options (-help-hidden for more).\n"
   "  -pt                 Use the pathtracing algorithm.\n"
   "  -w                  Width of the output image.\n"
   "  -h                  Height of the output image.\n"
-  "  -vfov               Vertical field of view.\n"
+  "  -vfov               Vertical field of view (default: the scene's).\n"
   "  -s                  Number of samples per pixel used in rendering algorithm.\n"
   "  -maxd               Maximum depth of the raytracing algorithm.\n"
+  "  -rrd                Bounces before russian roulette starts (default: 5).\n"
+  "  -time               Time budget in milliseconds, renders progressively.\n"
+  "  -pass               Samples per pixel of a progressive pass.\n"
+  "  -noise              Stop once the mean relative pixel error is below.\n"
+  "  -adaptive           Apply -noise to every pixel, sampling where it is high.\n"
+  "  -mesh               Add a triangle mesh (.obj or binary .cmesh), repeatable.\n"
+  "  -save-mesh          Write the first -mesh as binary .cmesh and exit.\n"
+  "  -scene              Load the scene from a text or binary .cscene file.\n"
+  "  -save-scene         Write the scene (text, or binary if .cscene) and exit.\n"
+  "  -stats              Print render counters (scons stats=1 builds).\n"
+  "  -stats-json         Write the render counters as JSON to <file>.\n"
+  "  -tonemap            Tonemapping operator: clamp (default), reinhard or aces.\n"
+  "  -exposure           Exposure in stops applied before tonemapping.\n"
+  "  -aov                Also write depth,normal,albedo,id,spp,cost or all as .pfm.\n"
+  "  -denoise            Denoise the image guided by albedo, normal and depth.\n"
+  "  -threads            Number of render threads (default: all cores).\n"
+  "  -nobvh              Test every sphere instead of using the BVH.\n"
+  "  -nonee              Path tracing without sampling the lights.\n"
+  "  -nrand              Add <n> random spheres to the scene.\n"
+  "  -packet             Trace primary rays in 8x8 packets.\n"
+  "  -wavefront          Render with the wavefront integrator.\n"
+  "  -seed               Seed of the random number streams.\n"
+  "  -sampler            Sequence of the streams: independent (default), sobol,\n"
+  "                      halton or bluenoise.\n"
   "  -cuda               Use CUDA for rendering.\n"
   "  -v                  Verbose mode.\n"
 ;
 
+/* Row sources of the float image writers. */
+typedef struct aov_rows {
+  const c_film_t *film;
+  uint32_t aov;
+} aov_rows_t;
+
+static void aov_rows(void *ctx, uint32_t y0, uint32_t y1, float *out)
+{
+  aov_rows_t *ar = (aov_rows_t *) ctx;
+  film_aov(ar->film, ar->aov, y0, y1, out);
+}
+
+static void film_rows(void *ctx, uint32_t y0, uint32_t y1, float *out)
+{
+  film_color((const c_film_t *) ctx, y0, y1, out);
+}
+
+static void print_stats(const c_state_t *s, double t)
+{
+  c_stats_t st;
+  stats_get(&st);
+  if (s->stats) stats_print(&st, t, stderr);
+  FILE *f = s->stats_json ? fopen(s->stats_json, "w") : NULL;
+  if (f) {
+    stats_json(&st, t, f);
+    fputc('\n', f);
+    fclose(f);
+  } else if (s->stats_json) {
+    fprintf(stderr, "ERROR: could not write %s\n", s->stats_json);
+  }
+}
+
+/* Waits for the frame written to path by job. */
+static int wait_frame(c_image_job_t *job, const char *path)
+{
+  if (image_wait(job) < 0) {
+    fprintf(stderr, "ERROR: could not write %s\n", path);
+    return -1;
+  }
+  fprintf(stderr, "Wrote %s in %.1f ms\n", path, job->ms);
+  return 0;
+}
+
+/* render_frames
+ *
+ * Renders the frames [s->f0, s->f1) of anim to <outfile>.<frame>, or one
+ * after the other to the raw stream <outfile>, frame f with the seed
+ * s->seed + f. The scene stays loaded and is refit to every frame. A frame
+ * is encoded and written while the next one renders, so the frame buffers
+ * (png, raw) or films (float files) are double buffered.
+ */
+static int render_frames(c_state_t *s, c_scene_t *scene, cam_t *cam, const c_anim_t *anim)
+{
+  c_format_t format = (c_format_t) s->format;
+  /* 8 bit frames are resolved to the image buffer, float frames copied out of the film */
+  bool ldr = format == FORMAT_PNG || format == FORMAT_RAW;
+  size_t n = (size_t) s->w * s->h, size = ldr ? n * sizeof(uint32_t) : n * 3 * sizeof(float);
+  c_film_t films[2];
+  void *bufs[2] = { NULL, NULL };
+  int nf = ldr || format == FORMAT_RAW_FLOAT ? 1 : 2, err = 0;
+
+  for (int b = 0; b < 2; ++b) {
+    if (b < nf && (film_init(&films[b], s->w, s->h) < 0 ||
+                   film_init_aovs(&films[b], s->denoise ? AOV_FEATURES : 0) < 0)) {
+      perror("Unable to allocate memory for the film.");
+      return -1;
+    }
+    if ((ldr || format == FORMAT_RAW_FLOAT) && !(bufs[b] = malloc(size))) {
+      perror("Unable to allocate memory for image buffer.");
+      return -1;
+    }
+  }
+  int fd = image_raw(format) ? raw_open(s->outfile) : -1;
+  if (image_raw(format) && fd < 0) {
+    fprintf(stderr, "ERROR: could not open %s\n", s->outfile);
+    return -1;
+  }
+
+  c_image_job_t job;
+  char paths[2][4096];
+  uint32_t seed = s->seed;
+  /* buffer of the frame being written, -1 for none */
+  int pending = -1;
+  uint32_t done = 0;
+  double t0 = omp_get_wtime();
+  for (uint32_t fr = s->f0; fr < s->f1; ++fr) {
+    int b = (fr - s->f0) & 1;
+    c_film_t *f = &films[b % nf];
+    double t = omp_get_wtime();
+    anim_apply(anim, fr, scene, cam);
+    fprintf(stderr, "Frame %u: scene updated in %.2f ms\n", fr, (omp_get_wtime() - t) * 1e3);
+
+    film_clear(f);
+    s->film = f;
+    s->im_buffer = ldr ? (uint32_t *) bufs[b] : NULL;
+    s->seed = seed + fr;
+    render(s, scene, cam);
+    ++done;
+
+    /* the previous frame was written while this one rendered */
+    if (pending >= 0 && wait_frame(&job, paths[pending]) < 0) {
+      err = -1;
+      /* the reader of a stream went away, it takes no more frames */
+      pending = -1;
+      if (image_raw(format)) break;
+    }
+    if (image_raw(format)) {
+      /* stdout is the stream, nothing else may be printed to it */
+      snprintf(paths[b], sizeof(paths[b]), "frame %u", fr);
+      if (format == FORMAT_RAW_FLOAT) film_color(f, 0, s->h, (float *) bufs[b]);
+      write_raw_async(&job, fd, bufs[b], size);
+    } else {
+      snprintf(paths[b], sizeof(paths[b]), "%s.%04u%s", s->outfile, fr, image_ext(format));
+      printf("Save as : %s\n", paths[b]);
+      if (ldr) write_png_async(&job, paths[b], (uint32_t *) bufs[b], s->w, s->h);
+      else write_float_image_async(&job, format, paths[b], s->w, s->h, 3, film_rows, f);
+    }
+    pending = b;
+  }
+  if (pending >= 0 && wait_frame(&job, paths[pending]) < 0) err = -1;
+  double t = omp_get_wtime() - t0;
+  fprintf(stderr, "%u frames in %.2f s, %.1f ms per frame\n", done, t, t * 1e3 / done);
+
+  for (int b = 0; b < nf; ++b) film_free(&films[b]);
+  free(bufs[0]);
+  free(bufs[1]);
+  if (fd > STDOUT_FILENO) close(fd);
+  s->film = NULL;
+  s->im_buffer = NULL;
+  return err;
+}
+
+/* Scene rendered without -scene, in the format of scene files. */
+static const char default_scene[] =
+  "camera 0 0 0  0 0 -1  0 1 0  90\n"
+  "# radius, pos, color, emission, index of refraction, material\n"
+  "sphere 1000  0 -1000.5 -1  .82 .82 .82  .8 .3 0   1 diff\n"
+  "sphere .5    0 0 -3        .7 .3 .3     .8 .8 .3  1 diff\n"
+  "sphere .5    1 0 -3        .8 .6 .2     .8 .8 .8  1 refl\n"
+  "sphere .5   -1 0 -3        .9 .9 .9     .8 .8 .8  1 refl\n"
+;
+
 int main(int argc, char **argv) 
 {
   c_state_t s = c_state();
@@ -57,45 +237,214 @@ int main(int argc, char **argv)
     return 0;
   }
 
-  s.im_buffer = (uint32_t *)malloc(s.h * s.w * sizeof(uint32_t));
-  if (s.im_buffer == NULL) {
+  /* -region and -sample-range render a partial film for carbon-merge */
+  bool partial = s.x1 || s.s1;
+  /* -anim and -frames render a sequence of images */
+  bool frames = s.anim || s.f1;
+  if (!s.x1) {
+    s.x1 = s.w;
+    s.y1 = s.h;
+  }
+  if (s.x1 > s.w || s.y1 > s.h || s.s1 > s.spp) {
+    fprintf(stderr, "ERROR: -region or -sample-range is outside of the image or its samples.\n");
+    return 1;
+  }
+  if (partial && (s.time_ms || s.noise > 0 || s.adaptive || s.denoise || s.aovs)) {
+    fprintf(stderr, "ERROR: partial renders take all their samples, without -denoise or -aov.\n");
+    return 1;
+  }
+  /* a pass cut by the deadline or by adaptive sampling leaves pixels behind
+   * the sample count of the checkpoint, which a resumed render would skip */
+  if (s.resume && (s.time_ms || s.noise > 0 || s.adaptive || s.denoise || s.aovs)) {
+    fprintf(stderr, "ERROR: checkpoints hold whole passes and no AOVs, -resume works without "
+                    "-time, -noise, -adaptive, -denoise or -aov.\n");
+    return 1;
+  }
+  if (image_raw((c_format_t) s.format) && s.aovs) {
+    fprintf(stderr, "ERROR: raw streams hold the image only, -aov needs a file format.\n");
+    return 1;
+  }
+  if (frames && (partial || s.resume || s.aovs)) {
+    fprintf(stderr, "ERROR: -anim and -frames render whole images, without -region, -sample-range, -resume or -aov.\n");
+    return 1;
+  }
+
+  /* float formats are written from the film, without an 8 bit copy */
+  bool ldr = (s.format == FORMAT_PNG || s.format == FORMAT_RAW) && !partial && !frames;
+  s.im_buffer = ldr ? (uint32_t *)malloc(s.h * s.w * sizeof(uint32_t)) : NULL;
+  if (ldr && s.im_buffer == NULL) {
     perror("Unable to allocate memory for image buffer.");
     return 1;
   }
 
-  c_sphere spheres[] = {
-    /* radius, pos, color, emission, index of refraction, material */
-    { 1000,vec3d(0,-1000.5,-1),vec3d(.82,.82,.82),vec3d(.8,.3, 0),1.,DIFF },
-    { .5,  vec3d(0,0,-3),      vec3d(.7,.3,.3),vec3d(.8,.8,.3),1.,DIFF },
-    { .5,  vec3d(1,0,-3),      vec3d(.8,.6,.2),vec3d(.8,.8,.8),1.,REFL },
-    { .5,  vec3d(-1,0,-3),     vec3d(.9,.9,.9),vec3d(.8,.8,.8),1.,REFL },
-    /* { .5,  vec3d(-1,0,-3),     vec3d(.9,.9,.9),vec3d(.8,.8,.8),1.5,REFR }, */
-  };
-  c_scene_t scene = {
-    .spheres = spheres,
-    .num_spheres = sizeof(spheres) / sizeof(spheres[0]),
-  };
-
-  cam_t cam; cam.init(s.w, s.h, s.spp, s.vfov);
-
-  if (s.rt) {
-    rt(s.im_buffer, s.w, s.h, &scene, &cam, s.maxd);
-  } else if (s.pt) {
-    pt(s.im_buffer, s.w, s.h, &scene, &cam);
-  } else {
+  c_scene_t scene = { .spheres = NULL, .num_spheres = 0 };
+  cam_t cam;
+  double t0 = omp_get_wtime();
+  int err = s.scene ? scene_load(&scene, &cam, s.scene)
+                    : scene_parse(&scene, &cam, default_scene, strlen(default_scene), "built-in scene");
+  if (err < 0) return 1;
+  fprintf(stderr, "Scene: %s, %u spheres, %u meshes, loaded in %.2f ms%s\n", s.scene ? s.scene : "built-in",
+          scene.num_spheres, scene.num_meshes, (omp_get_wtime() - t0) * 1e3, scene.map_size ? " (mapped)" : "");
+
+  if (s.nrand) {
+    c_sphere *sp = scene_add_spheres(&scene, s.nrand);
+    if (!sp) return 1;
+    random_spheres(sp, s.nrand, s.seed);
+  }
+  for (uint32_t i = 0; i < s.num_mesh; ++i)
+    if (scene_add_mesh(&scene, s.mesh[i]) < 0) return 1;
+  if (s.save_mesh) {
+    if (!s.num_mesh) {
+      fprintf(stderr, "ERROR: -save-mesh requires a -mesh.\n");
+      return 1;
+    }
+    return mesh_save_bin(&scene.meshes[scene.num_meshes - s.num_mesh], s.save_mesh) < 0;
+  }
+  if (s.save_scene) {
+    if (s.vfov > 0) cam.vfov = s.vfov;
+    return scene_save(&scene, &cam, s.save_scene) < 0;
+  }
+
+  scene_init(&scene, s.bvh);
+  /* without lights the path tracer only finds emitters by chance */
+  if (!s.nee) scene.num_lights = 0;
+
+  cam.init(s.w, s.h, s.spp, s.vfov > 0 ? s.vfov : cam.vfov);
+
+  c_sampler_t sampler;
+  if (s.sampler_type != SAMPLER_INDEPENDENT) {
+    sampler_init(&sampler, (c_sampler_type_t) s.sampler_type, s.w, s.spp);
+    s.sampler = &sampler;
+  }
+
+  if (!s.rt && !s.pt) {
     fprintf(stderr, "ERROR: no algorithm selected.\n");
     return 1;
   }
+  if ((s.stats || s.stats_json) && !STAT_ENABLED)
+    fprintf(stderr, "WARNING: built without render counters, use `scons stats=1`.\n");
 
+  if (frames) {
+    c_anim_t anim;
+    if (s.anim && anim_load(&anim, &scene, s.anim) < 0) return 1;
+    if (!s.f1) s.f1 = anim.last + 1;
+    stats_reset();
+    t0 = omp_get_wtime();
+    int err = render_frames(&s, &scene, &cam, &anim);
+    if (STAT_ENABLED && (s.stats || s.stats_json)) print_stats(&s, omp_get_wtime() - t0);
+    scene_free(&scene);
+    scene_unload(&scene);
+    return err < 0;
+  }
+  c_film_t film;
+  if (s.resume && access(s.resume, F_OK) == 0) {
+    /* the samples of the checkpoint are used in place */
+    c_film_header_t hd;
+    t0 = omp_get_wtime();
+    if (film_load(&film, &hd, s.resume) < 0) return 1;
+    if (hd.w != s.w || hd.h != s.h || hd.x0 != s.x0 || hd.y0 != s.y0 || hd.fw != s.x1 - s.x0 ||
+        hd.fh != s.y1 - s.y0 || hd.s0 != s.s0 || hd.seed != s.seed) {
+      fprintf(stderr, "ERROR: %s is the checkpoint of another image, region or seed.\n", s.resume);
+      return 1;
+    }
+    fprintf(stderr, "Resumed %s at %u spp in %.2f ms\n", s.resume, film.s1, (omp_get_wtime() - t0) * 1e3);
+  } else {
+    if (film_init(&film, s.x1 - s.x0, s.y1 - s.y0) < 0) {
+      perror("Unable to allocate memory for the film.");
+      return 1;
+    }
+    film.x0 = s.x0;
+    film.y0 = s.y0;
+    film.s0 = film.s1 = s.s0;
+  }
+  if (film_init_aovs(&film, s.aovs | (s.denoise ? AOV_FEATURES : 0)) < 0) {
+    perror("Unable to allocate memory for the AOVs.");
+    return 1;
+  }
+  s.film = &film;
+  stats_reset();
+  t0 = omp_get_wtime();
+  render(&s, &scene, &cam);
+  if (STAT_ENABLED && (s.stats || s.stats_json)) print_stats(&s, omp_get_wtime() - t0);
+  if (partial) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.cfilm", s.outfile);
+    printf("\nSave as : %s\n", path);
+    int err = film_save(&film, s.w, s.h, s.seed, path);
+    film_free(&film);
+    scene_free(&scene);
+    scene_unload(&scene);
+    if (err < 0) {
+      fprintf(stderr, "ERROR: could not write %s\n", path);
+      return 1;
+    }
+    return 0;
+  }
+  if (image_raw((c_format_t) s.format)) {
+    /* written in one piece from the image buffer, or a float copy of the film */
+    size_t n = (size_t) s.w * s.h, size = s.format == FORMAT_RAW ? n * sizeof(uint32_t) : n * 3 * sizeof(float);
+    float *rgb = s.format == FORMAT_RAW_FLOAT ? (float *) malloc(size) : NULL;
+    if (rgb) film_color(&film, 0, s.h, rgb);
+    const void *frame = s.format == FORMAT_RAW ? (const void *) s.im_buffer : rgb;
+    t0 = omp_get_wtime();
+    int fd = raw_open(s.outfile);
+    int err = fd < 0 || !frame ? -1 : write_raw(fd, frame, size);
+    const char *name = strcmp(s.outfile, "-") ? s.outfile : "stdout";
+    fprintf(stderr, "Wrote %s in %.1f ms\n", name, (omp_get_wtime() - t0) * 1e3);
+    if (fd > STDOUT_FILENO) close(fd);
+    free(rgb);
+    film_free(&film);
+    scene_free(&scene);
+    scene_unload(&scene);
+    if (err < 0) {
+      fprintf(stderr, "ERROR: could not write %s\n", name);
+      return 1;
+    }
+    return 0;
+  }
+  /* AOVs are floats, written as .pfm unless the image is an .exr */
+  c_format_t aov_format = s.format == FORMAT_PNG ? FORMAT_PFM : (c_format_t) s.format;
+  for (uint32_t a = 1; a <= AOV_ALL; a <<= 1) {
+    if (!(s.aovs & a)) continue;
+    char path[4096];
+    aov_rows_t ar = { &film, a };
+    snprintf(path, sizeof(path), "%s.%s%s", s.outfile, aov_name(a), image_ext(aov_format));
+    printf("Save as : %s\n", path);
+    if (write_float_image(aov_format, path, s.w, s.h, aov_channels(a), aov_rows, &ar) < 0)
+      fprintf(stderr, "ERROR: could not write %s\n", path);
+  }
+  if (s.format != FORMAT_PNG) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s", s.outfile, image_ext((c_format_t) s.format));
+    printf("\nSave as : %s\n", path);
+    t0 = omp_get_wtime();
+    int err = write_float_image((c_format_t) s.format, path, s.w, s.h, 3, film_rows, &film);
+    fprintf(stderr, "Saved in %.1f ms\n", (omp_get_wtime() - t0) * 1e3);
+    film_free(&film);
+    scene_free(&scene);
+    scene_unload(&scene);
+    if (err < 0) {
+      fprintf(stderr, "ERROR: could not write %s\n", path);
+      return 1;
+    }
+    return 0;
+  }
   char *out_file = concat_strs(s.outfile, (char *) ".png");
   if (out_file == NULL) {
     return 0;
   }
   printf("\nSave as : %s\n", out_file);
 
-  if (!stbi_write_png(out_file, s.w, s.h, 4, s.im_buffer, sizeof(uint32_t)*s.w)) {
+  /* the scene is freed while the image is encoded */
+  c_image_job_t job;
+  write_png_async(&job, out_file, s.im_buffer, s.w, s.h);
+  film_free(&film);
+  scene_free(&scene);
+  scene_unload(&scene);
+  if (image_wait(&job) < 0) {
     fprintf(stderr, "ERROR: could not write %s\n", out_file);
     return 1;
   }
+  fprintf(stderr, "Encoded in %.1f ms\n", job.ms);
   return 0;
 }
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+/* carbon-merge
+ *
+ * Combines the partial films (.cfilm) of `carbon -region` and `carbon
+ * -sample-range` renders, which may come from any number of processes or
+ * machines, into the image. It is the same, bit for bit, as the image of a
+ * single render of all their pixels and samples.
+ */
+
+#include "carbon.h"
+#include "film.h"
+#include "image.h"
+#include "tonemap.h"
+
+static const char show_help[] =
+  "Usage: carbon-merge [-o file] [-format f] [-tonemap op] [-exposure stops] part.cfilm...\n"
+  "  -o         Place the image into <file>, with the extension of the format (default: out).\n"
+  "  -format    Output format: png (default), pfm, exr or exr-rle (float).\n"
+  "  -tonemap   Tonemapping operator: clamp (default), reinhard or aces.\n"
+  "  -exposure  Exposure in stops applied before tonemapping.\n"
+;
+
+static void film_rows(void *ctx, uint32_t y0, uint32_t y1, float *out)
+{
+  film_color((const c_film_t *) ctx, y0, y1, out);
+}
+
+int main(int argc, char **argv)
+{
+  const char *out = "out";
+  int format = FORMAT_PNG, op = TONEMAP_CLAMP;
+  double exposure = 0;
+  c_film_t film = {};
+  uint32_t parts = 0;
+  /* headers of the merged films, to catch overlaps and other seeds */
+  c_film_header_t *hds = (c_film_header_t *) malloc(argc * sizeof(c_film_header_t));
+  if (!hds) {
+    perror("Unable to allocate memory.");
+    return 1;
+  }
+  double t0 = omp_get_wtime();
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) out = argv[++i];
+    else if (!strcmp(argv[i], "-format") && i + 1 < argc) format = image_format(argv[++i]);
+    else if (!strcmp(argv[i], "-tonemap") && i + 1 < argc) op = tonemap_op(argv[++i]);
+    else if (!strcmp(argv[i], "-exposure") && i + 1 < argc) exposure = atof(argv[++i]);
+    else if (argv[i][0] != '-') {
+      if (film_merge(&film, hds, parts, argv[i]) < 0) return 1;
+      ++parts;
+    } else {
+      fputs(show_help, stderr);
+      return 1;
+    }
+    /* the raw streams of carbon are not image files */
+    if (format >= 0 && image_raw((c_format_t) format)) format = -1;
+    if (format < 0 || op < 0) {
+      fprintf(stderr, "ERROR: unknown %s %s\n", format < 0 ? "output format" : "tonemapping operator", argv[i]);
+      return 1;
+    }
+  }
+  if (!parts) {
+    fputs(show_help, stderr);
+    return 1;
+  }
+
+  /* holes and overlaps show as pixels without or with more samples */
+  uint32_t lo = UINT32_MAX, hi = 0, empty = 0;
+  for (size_t k = 0; k < (size_t) film.w * film.h; ++k) {
+    lo = film.spp[k] < lo ? film.spp[k] : lo;
+    hi = film.spp[k] > hi ? film.spp[k] : hi;
+    empty += !film.spp[k];
+  }
+  fprintf(stderr, "Merged %u partial films of a %ux%u image in %.1f ms, %u to %u spp\n",
+          parts, film.w, film.h, (omp_get_wtime() - t0) * 1e3, lo, hi);
+  if (empty) fprintf(stderr, "WARNING: %u pixels have no samples.\n", empty);
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s%s", out, image_ext((c_format_t) format));
+  printf("Save as : %s\n", path);
+  int err;
+  if (format == FORMAT_PNG) {
+    uint32_t *im = (uint32_t *) malloc((size_t) film.w * film.h * sizeof(uint32_t));
+    c_tonemap_t tm;
+    tm.op = (c_tonemap_op_t) op;
+    tm.exposure = exposure;
+    if (im) film_resolve(&film, im, &tm);
+    err = im ? write_png(path, im, film.w, film.h) : -1;
+    free(im);
+  } else {
+    err = write_float_image((c_format_t) format, path, film.w, film.h, 3, film_rows, &film);
+  }
+  film_free(&film);
+  free(hds);
+  if (err < 0) {
+    fprintf(stderr, "ERROR: could not write %s\n", path);
+    return 1;
+  }
+  return 0;
+}
@@ -1,6 +1,5 @@
 #!/bin/bash
 
-# Build and run the render program.
+# Build (incrementally) and run the render program.
 scons > /dev/null 2>&1
 ./carbon $*
-scons -c > /dev/null 2>&1
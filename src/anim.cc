@@ -0,0 +1,131 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include <algorithm>
+#include <sys/mman.h>
+
+#include "anim.h"
+
+/* Longest line of an animation file in tokens. */
+#define ANIM_MAX_TOKENS     10
+
+static c_anim_track_t *track(c_anim_t *a, int32_t target)
+{
+  for (size_t i = 0; i < a->tracks.size(); ++i)
+    if (a->tracks[i].target == target) return &a->tracks[i];
+  a->tracks.push_back(c_anim_track_t());
+  a->tracks.back().target = target;
+  return &a->tracks.back();
+}
+
+static int anim_parse(c_anim_t *a, const c_scene_t *s, const char *text, size_t len, const char *name)
+{
+  const char *p = text, *end = text + len;
+  char line[1024], *t[ANIM_MAX_TOKENS];
+
+  for (uint32_t ln = 1; p < end; ++ln) {
+    int nt = split_line(&p, end, line, sizeof(line), t, ANIM_MAX_TOKENS);
+    if (!nt) continue;
+
+    double frame, id;
+    c_anim_key_t key;
+    int32_t target = ANIM_CAMERA;
+    int ok = nt >= 2 && parse_num(t[0], &frame) && frame >= 0 && frame <= UINT32_MAX && frame == (uint32_t) frame;
+    if (ok && !strcmp(t[1], "camera")) {
+      ok = nt == 8 && parse_vec(t + 2, &key.a) && parse_vec(t + 5, &key.b);
+    } else if (ok && !strcmp(t[1], "sphere")) {
+      ok = nt == 6 && parse_num(t[2], &id) && id >= 0 && id <= UINT32_MAX && id == (uint32_t) id &&
+           parse_vec(t + 3, &key.a);
+      if (ok && id >= s->num_spheres) {
+        fprintf(stderr, "ERROR: %s:%d: the scene has no sphere %.0f.\n", name, ln, id);
+        return -1;
+      }
+      target = (int32_t) id;
+    } else {
+      ok = 0;
+    }
+    if (!ok) {
+      fprintf(stderr, "ERROR: %s:%d: malformed key.\n", name, ln);
+      return -1;
+    }
+    key.frame = (uint32_t) frame;
+    track(a, target)->keys.push_back(key);
+    a->last = std::max(a->last, key.frame);
+  }
+
+  for (size_t i = 0; i < a->tracks.size(); ++i) {
+    std::vector<c_anim_key_t> &k = a->tracks[i].keys;
+    std::stable_sort(k.begin(), k.end(), [](const c_anim_key_t &x, const c_anim_key_t &y) {
+      return x.frame < y.frame;
+    });
+  }
+  return 0;
+}
+
+int anim_load(c_anim_t *a, const c_scene_t *s, const char *path)
+{
+  size_t size = 0;
+  const char *p = (const char *) map_file(path, &size, 0);
+  if (!p) {
+    fprintf(stderr, "ERROR: unable to map %s.\n", path);
+    return -1;
+  }
+  int r = anim_parse(a, s, p, size, path);
+  munmap((void *) p, size);
+  return r;
+}
+
+/* Key of tr at frame, interpolated between its neighbours. */
+static c_anim_key_t key_at(const c_anim_track_t *tr, uint32_t frame)
+{
+  const std::vector<c_anim_key_t> &k = tr->keys;
+  size_t i = 0;
+  while (i < k.size() && k[i].frame < frame) ++i;
+  if (i == k.size()) return k.back();
+  if (i == 0 || k[i].frame == frame) return k[i];
+
+  const c_anim_key_t &k0 = k[i - 1], &k1 = k[i];
+  real_t t = (real_t) (frame - k0.frame) / (k1.frame - k0.frame);
+  c_anim_key_t r = k1;
+  r.a = k0.a + (k1.a - k0.a) * t;
+  r.b = k0.b + (k1.b - k0.b) * t;
+  return r;
+}
+
+void anim_apply(const c_anim_t *a, uint32_t frame, c_scene_t *s, cam_t *cam)
+{
+  bool moved = false;
+  for (size_t i = 0; i < a->tracks.size(); ++i) {
+    const c_anim_track_t *tr = &a->tracks[i];
+    c_anim_key_t k = key_at(tr, frame);
+    if (tr->target == ANIM_CAMERA) {
+      cam->origin = k.a;
+      cam->refp = k.b;
+    } else {
+      s->spheres[tr->target].pos = k.a;
+      moved = true;
+    }
+  }
+  cam->init(cam->w, cam->h, cam->spp, cam->vfov);
+  if (moved) scene_refit(s);
+}
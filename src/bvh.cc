@@ -0,0 +1,246 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include <algorithm>
+
+#include "bvh.h"
+#include "simd.h"
+
+/* SAH cost of a node traversal relative to one primitive test. */
+#define SAH_TRAVERSAL_COST  1.0
+
+/* Leaves are tested width primitives at a time, so cost counts batches. */
+static inline real_t isect_cost(uint32_t n, uint32_t width) { return (n + width - 1) / width; }
+
+/* Subtrees with more primitives than this are built as separate tasks. */
+#define BVH_TASK_MIN        4096
+
+typedef struct build_ctx {
+  /* primitive bounds and centroids */
+  c_aabb_t *pb;
+  vec3 *pc;
+  c_bvh_t *bvh;
+  /* primitives tested together in a leaf */
+  uint32_t width;
+} build_ctx_t;
+
+typedef struct bin {
+  c_aabb_t box;
+  uint32_t count = 0;
+} bin_t;
+
+static inline real_t axis(const vec3 &v, int a) { return a == 0 ? v.x : a == 1 ? v.y : v.z; }
+
+/* find_split
+ *
+ * Evaluates the binned SAH over all three axes for prims [begin, end) and
+ * returns the best axis (or -1 if a leaf is cheaper) together with the bin
+ * index the split happens at.
+ */
+static int find_split(const c_aabb_t *pb, const vec3 *pc, const uint32_t *idx,
+                      uint32_t begin, uint32_t end, const c_aabb_t &cb,
+                      real_t parent_area, uint32_t width, int *split_bin)
+{
+  uint32_t n = end - begin;
+  real_t best = isect_cost(n, width);
+  int best_axis = -1;
+
+  for (int a = 0; a < 3; ++a) {
+    real_t lo = axis(cb.lo, a), ext = axis(cb.hi, a) - lo;
+    if (ext <= 0) continue;
+    real_t scale = BVH_BINS / ext;
+
+    bin_t bins[BVH_BINS];
+    for (uint32_t k = begin; k < end; ++k) {
+      int b = std::min(BVH_BINS - 1, (int)((axis(pc[idx[k]], a) - lo) * scale));
+      bins[b].count++;
+      bins[b].box.grow(pb[idx[k]]);
+    }
+
+    /* sweep from the right to collect the costs of all right halves */
+    real_t right_cost[BVH_BINS];
+    c_aabb_t acc;
+    uint32_t cnt = 0;
+    for (int b = BVH_BINS - 1; b > 0; --b) {
+      acc.grow(bins[b].box);
+      cnt += bins[b].count;
+      right_cost[b] = cnt ? isect_cost(cnt, width) * acc.area() : 0;
+    }
+    acc = c_aabb_t();
+    cnt = 0;
+    for (int b = 0; b < BVH_BINS - 1; ++b) {
+      acc.grow(bins[b].box);
+      cnt += bins[b].count;
+      real_t cost = SAH_TRAVERSAL_COST + ((cnt ? isect_cost(cnt, width) * acc.area() : 0) + right_cost[b + 1]) / parent_area;
+      if (cost < best) {
+        best = cost;
+        best_axis = a;
+        *split_bin = b;
+      }
+    }
+  }
+  return best_axis;
+}
+
+static void build_node(build_ctx_t *c, uint32_t ni, uint32_t begin, uint32_t end, uint32_t depth)
+{
+  c_bvh_t *bvh = c->bvh;
+  c_bvh_node_t *node = &bvh->nodes[ni];
+  c_aabb_t box, cb;
+  for (uint32_t k = begin; k < end; ++k) {
+    box.grow(c->pb[bvh->prims[k]]);
+    cb.grow(c->pc[bvh->prims[k]]);
+  }
+  node->box = box;
+  node->first = begin;
+  node->count = end - begin;
+
+  uint32_t mid = begin;
+  int bin = 0;
+  int a = node->count > 1 ? find_split(c->pb, c->pc, bvh->prims, begin, end, cb, box.area(), c->width, &bin) : -1;
+  if (a >= 0) {
+    real_t lo = axis(cb.lo, a), scale = BVH_BINS / (axis(cb.hi, a) - lo);
+    mid = std::partition(bvh->prims + begin, bvh->prims + end, [&](uint32_t k) {
+      return std::min(BVH_BINS - 1, (int)((axis(c->pc[k], a) - lo) * scale)) <= bin;
+    }) - bvh->prims;
+  } else if (node->count > BVH_MAX_LEAF) {
+    /* SAH prefers a leaf that is too large: median split on the widest axis */
+    vec3 e = cb.hi - cb.lo;
+    int wa = e.x > e.y && e.x > e.z ? 0 : e.y > e.z ? 1 : 2;
+    mid = begin + node->count / 2;
+    std::nth_element(bvh->prims + begin, bvh->prims + mid, bvh->prims + end,
+      [&](uint32_t i, uint32_t j) { return axis(c->pc[i], wa) < axis(c->pc[j], wa); });
+  }
+  if (mid == begin || mid == end || depth >= BVH_MAX_DEPTH) return;
+
+  uint32_t first;
+#pragma omp atomic capture
+  { first = bvh->num_nodes; bvh->num_nodes += 2; }
+  node->first = first;
+  node->count = 0;
+
+  if (end - begin > BVH_TASK_MIN) {
+#pragma omp task
+    build_node(c, first, begin, mid, depth + 1);
+    build_node(c, first + 1, mid, end, depth + 1);
+#pragma omp taskwait
+  } else {
+    build_node(c, first, begin, mid, depth + 1);
+    build_node(c, first + 1, mid, end, depth + 1);
+  }
+}
+
+c_bvh_t *bvh_build(const c_aabb_t *boxes, const vec3 *centroids, uint32_t n, uint32_t width)
+{
+  double t0 = omp_get_wtime();
+
+  build_ctx_t c;
+  c_bvh_t *bvh = c.bvh = (c_bvh_t *) calloc(1, sizeof(c_bvh_t));
+  c.pb = (c_aabb_t *) boxes;
+  c.pc = (vec3 *) centroids;
+  c.width = width;
+  if (bvh) {
+    bvh->prims = (uint32_t *) malloc(n * sizeof(uint32_t));
+    /* a binary tree with at most one primitive per leaf has 2n - 1 nodes */
+    bvh->nodes = (c_bvh_node_t *) malloc((n ? 2 * n - 1 : 1) * sizeof(c_bvh_node_t));
+  }
+  if (!bvh || !bvh->prims || !bvh->nodes) {
+    perror("Unable to allocate memory for the BVH.");
+    exit(1);
+  }
+  bvh->num_prims = n;
+  for (uint32_t k = 0; k < n; ++k) bvh->prims[k] = k;
+
+  if (n) {
+    bvh->num_nodes = 1;
+#pragma omp parallel
+#pragma omp single
+    build_node(&c, 0, 0, n, 0);
+    /* give back the nodes the worst case reserved */
+    c_bvh_node_t *nodes = (c_bvh_node_t *) realloc(bvh->nodes, bvh->num_nodes * sizeof(c_bvh_node_t));
+    if (nodes) bvh->nodes = nodes;
+  }
+  bvh->build_ms = (omp_get_wtime() - t0) * 1000.;
+  return bvh;
+}
+
+/* Bounds of a sphere, padded by the rounding error: a box must never cut
+ * off a hit. */
+static inline c_aabb_t sphere_box(const c_sphere &s)
+{
+  real_t e = s.radius + s.hit_eps(s.pos);
+  vec3 r(e, e, e);
+  c_aabb_t b;
+  b.grow(s.pos - r);
+  b.grow(s.pos + r);
+  return b;
+}
+
+c_bvh_t *bvh_build(const c_sphere *spheres, uint32_t n)
+{
+  c_aabb_t *pb = (c_aabb_t *) malloc(n * sizeof(c_aabb_t));
+  vec3 *pc = (vec3 *) malloc(n * sizeof(vec3));
+  if (!pb || !pc) {
+    perror("Unable to allocate memory for the BVH.");
+    exit(1);
+  }
+
+#pragma omp parallel for
+  for (uint32_t k = 0; k < n; ++k) {
+    pb[k] = sphere_box(spheres[k]);
+    pc[k] = spheres[k].pos;
+  }
+  /* leaves are tested by the SIMD kernel */
+  c_bvh_t *bvh = bvh_build(pb, pc, n, SIMD_WD);
+  free(pb);
+  free(pc);
+  return bvh;
+}
+
+void bvh_refit(c_bvh_t *bvh, const c_sphere *spheres)
+{
+  double t0 = omp_get_wtime();
+
+  /* children are always stored after their parent */
+  for (uint32_t n = bvh->num_nodes; n-- > 0;) {
+    c_bvh_node_t *node = &bvh->nodes[n];
+    c_aabb_t box;
+    if (node->count) {
+      for (uint32_t k = node->first; k < node->first + node->count; ++k)
+        box.grow(sphere_box(spheres[bvh->prims[k]]));
+    } else {
+      box.grow(bvh->nodes[node->first].box);
+      box.grow(bvh->nodes[node->first + 1].box);
+    }
+    node->box = box;
+  }
+  bvh->build_ms = (omp_get_wtime() - t0) * 1000.;
+}
+
+void bvh_free(c_bvh_t *bvh)
+{
+  if (!bvh) return;
+  free(bvh->nodes);
+  free(bvh->prims);
+  free(bvh);
+}
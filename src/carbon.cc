@@ -21,7 +21,15 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. 
  * */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "carbon.h"
+#include "film.h"
+#include "image.h"
+#include "sampler.h"
 
 
 char *concat_strs(char *s1, char *s2)
@@ -36,6 +44,56 @@ char *concat_strs(char *s1, char *s2)
   return con;
 }
 
+void *map_file(const char *path, size_t *size, int writable)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat sb;
+  void *p = NULL;
+  if (fstat(fd, &sb) == 0 && sb.st_size > 0) {
+    /* private: writes are copy on write and never reach the file */
+    p = mmap(NULL, sb.st_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) p = NULL;
+    *size = sb.st_size;
+  }
+  close(fd);
+  return p;
+}
+
+int split_line(const char **p, const char *end, char *line, size_t size, char **t, int max)
+{
+  const char *eol = (const char *) memchr(*p, '\n', end - *p);
+  if (!eol) eol = end;
+  size_t n = (size_t) (eol - *p) < size - 1 ? (size_t) (eol - *p) : size - 1;
+  memcpy(line, *p, n);
+  line[n] = '\0';
+  *p = eol + 1;
+
+  char *hash = strchr(line, '#');
+  if (hash) *hash = '\0';
+  char *save;
+  int nt = 0;
+  for (char *k = strtok_r(line, " \t\r", &save); k && nt < max; k = strtok_r(NULL, " \t\r", &save))
+    t[nt++] = k;
+  return nt;
+}
+
+int parse_num(const char *t, double *d)
+{
+  char *e;
+  *d = strtod(t, &e);
+  return e != t && *e == '\0';
+}
+
+int parse_vec(char **t, vec3 *v)
+{
+  double x, y, z;
+  if (!parse_num(t[0], &x) || !parse_num(t[1], &y) || !parse_num(t[2], &z)) return 0;
+  *v = vec3(x, y, z);
+  return 1;
+}
+
 int get_arg_type(const char* arg) 
 {
   if (!strcmp(arg, "-help")) return ARG_HELP;
@@ -47,6 +105,35 @@ int get_arg_type(const char* arg)
   if (!strcmp(arg, "-maxd")) return ARG_MAXD;
   if (!strcmp(arg, "-o"))    return ARG_O;
   if (!strcmp(arg, "-cuda")) return ARG_CUDA;
+  if (!strcmp(arg, "-threads")) return ARG_THREADS;
+  if (!strcmp(arg, "-seed")) return ARG_SEED;
+  if (!strcmp(arg, "-nobvh")) return ARG_NOBVH;
+  if (!strcmp(arg, "-nrand")) return ARG_NRAND;
+  if (!strcmp(arg, "-packet")) return ARG_PACKET;
+  if (!strcmp(arg, "-wavefront")) return ARG_WAVEFRONT;
+  if (!strcmp(arg, "-rrd")) return ARG_RRD;
+  if (!strcmp(arg, "-time")) return ARG_TIME;
+  if (!strcmp(arg, "-pass")) return ARG_PASS;
+  if (!strcmp(arg, "-noise")) return ARG_NOISE;
+  if (!strcmp(arg, "-adaptive")) return ARG_ADAPTIVE;
+  if (!strcmp(arg, "-mesh")) return ARG_MESH;
+  if (!strcmp(arg, "-save-mesh")) return ARG_SAVE_MESH;
+  if (!strcmp(arg, "-scene")) return ARG_SCENE;
+  if (!strcmp(arg, "-save-scene")) return ARG_SAVE_SCENE;
+  if (!strcmp(arg, "-nonee")) return ARG_NONEE;
+  if (!strcmp(arg, "-stats")) return ARG_STATS;
+  if (!strcmp(arg, "-stats-json")) return ARG_STATS_JSON;
+  if (!strcmp(arg, "-denoise")) return ARG_DENOISE;
+  if (!strcmp(arg, "-aov")) return ARG_AOV;
+  if (!strcmp(arg, "-tonemap")) return ARG_TONEMAP;
+  if (!strcmp(arg, "-exposure")) return ARG_EXPOSURE;
+  if (!strcmp(arg, "-format")) return ARG_FORMAT;
+  if (!strcmp(arg, "-region")) return ARG_REGION;
+  if (!strcmp(arg, "-sample-range")) return ARG_SAMPLE_RANGE;
+  if (!strcmp(arg, "-resume")) return ARG_RESUME;
+  if (!strcmp(arg, "-anim")) return ARG_ANIM;
+  if (!strcmp(arg, "-frames")) return ARG_FRAMES;
+  if (!strcmp(arg, "-sampler")) return ARG_SAMPLER;
   return ARG_UNKNOWN;
 }
 
@@ -87,6 +174,160 @@ int parse_args(c_state_t *s, int *argc, char ***argv)
       case ARG_CUDA:
         s->cuda = 1;
         break;
+      case ARG_THREADS:
+        if (++i >= *argc) goto check_arg_err;
+        s->threads = atoi((*argv)[i]);
+        break;
+      case ARG_SEED:
+        if (++i >= *argc) goto check_arg_err;
+        s->seed = strtoul((*argv)[i], NULL, 10);
+        break;
+      case ARG_NOBVH:
+        s->bvh = 0;
+        break;
+      case ARG_NRAND:
+        if (++i >= *argc) goto check_arg_err;
+        s->nrand = strtoul((*argv)[i], NULL, 10);
+        break;
+      case ARG_PACKET:
+        s->packet = 1;
+        break;
+      case ARG_WAVEFRONT:
+        s->wavefront = 1;
+        break;
+      case ARG_RRD:
+        if (++i >= *argc) goto check_arg_err;
+        s->rrd = strtoul((*argv)[i], NULL, 10);
+        break;
+      case ARG_TIME:
+        if (++i >= *argc) goto check_arg_err;
+        s->time_ms = strtoul((*argv)[i], NULL, 10);
+        break;
+      case ARG_PASS:
+        if (++i >= *argc) goto check_arg_err;
+        s->pass = strtoul((*argv)[i], NULL, 10);
+        break;
+      case ARG_NOISE:
+        if (++i >= *argc) goto check_arg_err;
+        s->noise = atof((*argv)[i]);
+        break;
+      case ARG_ADAPTIVE:
+        s->adaptive = 1;
+        break;
+      case ARG_MESH:
+        if (++i >= *argc) goto check_arg_err;
+        if (s->num_mesh == C_MAX_MESHES) {
+          fprintf(stderr, "ERROR: at most %d meshes are supported.\n", C_MAX_MESHES);
+          return -1;
+        }
+        s->mesh[s->num_mesh++] = (*argv)[i];
+        break;
+      case ARG_SAVE_MESH:
+        if (++i >= *argc) goto check_arg_err;
+        s->save_mesh = (*argv)[i];
+        break;
+      case ARG_SCENE:
+        if (++i >= *argc) goto check_arg_err;
+        s->scene = (*argv)[i];
+        break;
+      case ARG_SAVE_SCENE:
+        if (++i >= *argc) goto check_arg_err;
+        s->save_scene = (*argv)[i];
+        break;
+      case ARG_NONEE:
+        s->nee = 0;
+        break;
+      case ARG_STATS:
+        s->stats = 1;
+        break;
+      case ARG_STATS_JSON:
+        if (++i >= *argc) goto check_arg_err;
+        s->stats_json = (*argv)[i];
+        break;
+      case ARG_DENOISE:
+        s->denoise = 1;
+        break;
+      case ARG_AOV: {
+        if (++i >= *argc) goto check_arg_err;
+        int mask = aov_mask((*argv)[i]);
+        if (mask < 0) {
+          fprintf(stderr, "ERROR: unknown AOV in %s\n", (*argv)[i]);
+          return -1;
+        }
+        s->aovs |= mask;
+        break;
+      }
+      case ARG_TONEMAP: {
+        if (++i >= *argc) goto check_arg_err;
+        int op = tonemap_op((*argv)[i]);
+        if (op < 0) {
+          fprintf(stderr, "ERROR: unknown tonemapping operator %s\n", (*argv)[i]);
+          return -1;
+        }
+        s->tonemap = op;
+        break;
+      }
+      case ARG_EXPOSURE:
+        if (++i >= *argc) goto check_arg_err;
+        s->exposure = atof((*argv)[i]);
+        break;
+      case ARG_FORMAT: {
+        if (++i >= *argc) goto check_arg_err;
+        int format = image_format((*argv)[i]);
+        if (format < 0) {
+          fprintf(stderr, "ERROR: unknown output format %s\n", (*argv)[i]);
+          return -1;
+        }
+        s->format = format;
+        break;
+      }
+      case ARG_REGION:
+        if (++i >= *argc) goto check_arg_err;
+        if (sscanf((*argv)[i], "%u,%u,%u,%u", &s->x0, &s->y0, &s->x1, &s->y1) != 4 ||
+            s->x0 >= s->x1 || s->y0 >= s->y1) {
+          fprintf(stderr, "ERROR: -region takes x0,y0,x1,y1 with x0 < x1 and y0 < y1.\n");
+          return -1;
+        }
+        break;
+      case ARG_SAMPLE_RANGE:
+        if (++i >= *argc) goto check_arg_err;
+        if (sscanf((*argv)[i], "%u,%u", &s->s0, &s->s1) != 2 || s->s0 >= s->s1) {
+          fprintf(stderr, "ERROR: -sample-range takes s0,s1 with s0 < s1.\n");
+          return -1;
+        }
+        break;
+      case ARG_RESUME:
+        if (++i >= *argc) goto check_arg_err;
+        s->resume = (*argv)[i];
+        break;
+      case ARG_ANIM:
+        if (++i >= *argc) goto check_arg_err;
+        s->anim = (*argv)[i];
+        break;
+      case ARG_SAMPLER: {
+        if (++i >= *argc) goto check_arg_err;
+        int type = sampler_type((*argv)[i]);
+        if (type < 0) {
+          fprintf(stderr, "ERROR: unknown sampler %s\n", (*argv)[i]);
+          return -1;
+        }
+        s->sampler_type = type;
+        break;
+      }
+      case ARG_FRAMES: {
+        if (++i >= *argc) goto check_arg_err;
+        /* a single number n renders the frames 0 to n - 1 */
+        int n = sscanf((*argv)[i], "%u,%u", &s->f0, &s->f1);
+        if (n == 1) {
+          s->f1 = s->f0;
+          s->f0 = 0;
+        }
+        if (n < 1 || s->f0 >= s->f1) {
+          fprintf(stderr, "ERROR: -frames takes n or f0,f1 with f0 < f1.\n");
+          return -1;
+        }
+        break;
+      }
       default:
         fprintf(stderr, "ERROR: unknown option %s\n", (*argv)[i-1]);
         return -1;
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include <stdlib.h>
+
+#include "denoise.h"
+
+/* Planes of the filter input, one float per pixel each. */
+enum {
+  DN_R, DN_G, DN_B, DN_VAR,       /* illumination and its variance */
+  DN_R1, DN_G1, DN_B1, DN_VAR1,   /* the same, output of a pass */
+  DN_NX, DN_NY, DN_NZ, DN_Z,      /* normal and depth */
+  DN_ZX, DN_ZY,                   /* depth gradient */
+  DN_AR, DN_AG, DN_AB,            /* albedo divided out of the color */
+  DN_SIG,                         /* inverse luminance tolerance */
+  DN_PLANES
+};
+
+/* B3 spline, the 5 taps of the a-trous kernel */
+static const float kernel[5] = { 1.f/16, 1.f/4, 3.f/8, 1.f/4, 1.f/16 };
+
+static inline float lum(float r, float g, float b) { return .2126f * r + .7152f * g + .0722f * b; }
+
+/* Edge stopping function, (1 + a/16)^-16 ~ exp(-a) without a libm call,
+ * so that the loops over a row vectorize. */
+static inline float falloff(float a)
+{
+  float b = 1 + a * (1.f / 16);
+  b *= b; b *= b; b *= b; b *= b;
+  return 1 / b;
+}
+
+/* Splits the film into illumination, albedo, normal, depth and variance. */
+static void dn_setup(const c_film_t *f, float **p)
+{
+  int64_t n = (int64_t) f->w * f->h;
+
+#pragma omp parallel for schedule(static)
+  for (int64_t k = 0; k < n; ++k) {
+    const float *ft = f->feat + FILM_FEATURES * k;
+    uint32_t spp = f->spp[k];
+    float inv = spp ? 1.f / spp : 0;
+    float a[3], nrm[3], nl = 0;
+
+    for (int c = 0; c < 3; ++c) {
+      /* misses and black surfaces keep their color */
+      a[c] = ft[c] * inv > 1e-3f ? ft[c] * inv : 1;
+      p[DN_AR + c][k] = a[c];
+      p[DN_R + c][k] = f->sum[3*k + c] * inv / a[c];
+      nrm[c] = ft[3 + c] * inv;
+      nl += nrm[c] * nrm[c];
+    }
+    /* averaged normals of edge pixels are shorter, misses are zero */
+    nl = nl > 0 ? 1 / sqrtf(nl) : 0;
+    for (int c = 0; c < 3; ++c) p[DN_NX + c][k] = nrm[c] * nl;
+    p[DN_Z][k] = ft[6] * inv;
+
+    /* variance of the mean luminance, unknown pixels are not trusted */
+    double var = spp > 1 ? f->m2[k] / (spp - 1) / spp : 1e4;
+    float al = lum(a[0], a[1], a[2]);
+    p[DN_VAR][k] = var / (al * al);
+  }
+
+  int w = f->w, h = f->h;
+#pragma omp parallel for schedule(static)
+  for (int y = 0; y < h; ++y) {
+    /* central differences, one sided at the border */
+    int yu = y > 0 ? y - 1 : y, yd = y < h - 1 ? y + 1 : y;
+    const float *z = p[DN_Z] + (int64_t) y * w;
+    const float *zu = p[DN_Z] + (int64_t) yu * w, *zd = p[DN_Z] + (int64_t) yd * w;
+    for (int x = 0; x < w; ++x) {
+      int xl = x > 0 ? x - 1 : x, xr = x < w - 1 ? x + 1 : x;
+      p[DN_ZX][(int64_t) y * w + x] = xr > xl ? (z[xr] - z[xl]) / (xr - xl) : 0;
+      p[DN_ZY][(int64_t) y * w + x] = yd > yu ? (zd[x] - zu[x]) / (yd - yu) : 0;
+    }
+  }
+}
+
+/* Inverse luminance tolerance of every pixel from its 3x3 blurred variance. */
+static void dn_sigma(float **p, int w, int h)
+{
+#pragma omp parallel for schedule(static)
+  for (int y = 0; y < h; ++y) {
+    for (int x = 0; x < w; ++x) {
+      float v = 0, s = 0;
+      for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+          int xx = x + dx, yy = y + dy;
+          if (xx < 0 || yy < 0 || xx >= w || yy >= h) continue;
+          float k = (dx ? .5f : 1) * (dy ? .5f : 1);
+          v += k * p[DN_VAR][(int64_t) yy * w + xx];
+          s += k;
+        }
+      }
+      p[DN_SIG][(int64_t) y * w + x] = 1 / (DENOISE_SIGMA_L * sqrtf(v / s) + 1e-4f);
+    }
+  }
+}
+
+/* dn_pass
+ *
+ * One a-trous pass with taps step pixels apart from DN_R.. to DN_R1..
+ * Every row sums the 25 taps one after the other over the whole row, so
+ * the inner loops are unit stride and free of branches.
+ */
+static void dn_pass(float **p, int w, int h, int step)
+{
+#pragma omp parallel
+  {
+    float *acc = (float *) malloc(5 * (size_t) w * sizeof(float));
+    if (!acc) {
+      perror("Unable to allocate memory for the denoiser.");
+      exit(1);
+    }
+    float *sw = acc, *sr = acc + w, *sg = acc + 2*w, *sb = acc + 3*w, *sv = acc + 4*w;
+
+#pragma omp for schedule(static)
+    for (int y = 0; y < h; ++y) {
+      int64_t row = (int64_t) y * w;
+      const float *pr = p[DN_R] + row, *pg = p[DN_G] + row, *pb = p[DN_B] + row;
+      const float *pnx = p[DN_NX] + row, *pny = p[DN_NY] + row, *pnz = p[DN_NZ] + row;
+      const float *pz = p[DN_Z] + row, *pzx = p[DN_ZX] + row, *pzy = p[DN_ZY] + row;
+      const float *psig = p[DN_SIG] + row;
+
+      for (int x = 0; x < w; ++x) sw[x] = sr[x] = sg[x] = sb[x] = sv[x] = 0;
+      for (int dy = -2; dy <= 2; ++dy) {
+        int yq = y + dy * step;
+        if (yq < 0 || yq >= h) continue;
+        for (int dx = -2; dx <= 2; ++dx) {
+          int o = dx * step;
+          /* taps outside of the image are left out */
+          int x0 = o < 0 ? -o : 0, x1 = o > 0 ? w - o : w;
+          int64_t q = (int64_t) yq * w + o;
+          const float *qr = p[DN_R] + q, *qg = p[DN_G] + q, *qb = p[DN_B] + q, *qv = p[DN_VAR] + q;
+          const float *qnx = p[DN_NX] + q, *qny = p[DN_NY] + q, *qnz = p[DN_NZ] + q, *qz = p[DN_Z] + q;
+          float k = kernel[dx + 2] * kernel[dy + 2];
+          float ox = (float) o, oy = (float) (dy * step);
+
+#pragma omp simd
+          for (int x = x0; x < x1; ++x) {
+            float dn = pnx[x] * qnx[x] + pny[x] * qny[x] + pnz[x] * qnz[x];
+            dn = dn > 0 ? dn : 0;
+            /* dn^16 */
+            dn *= dn; dn *= dn; dn *= dn; dn *= dn;
+            float dz = fabsf(pz[x] - qz[x]) / (DENOISE_SIGMA_Z * fabsf(pzx[x] * ox + pzy[x] * oy) + 1e-3f);
+            float dl = fabsf(lum(pr[x], pg[x], pb[x]) - lum(qr[x], qg[x], qb[x])) * psig[x];
+            float wq = k * dn * falloff(dz + dl);
+            sw[x] += wq;
+            sr[x] += wq * qr[x]; sg[x] += wq * qg[x]; sb[x] += wq * qb[x];
+            sv[x] += wq * wq * qv[x];
+          }
+        }
+      }
+      for (int x = 0; x < w; ++x) {
+        /* pixels without a normal (misses) are not filtered */
+        float iw = sw[x] > 0 ? 1 / sw[x] : 0;
+        p[DN_R1][row + x] = iw ? sr[x] * iw : pr[x];
+        p[DN_G1][row + x] = iw ? sg[x] * iw : pg[x];
+        p[DN_B1][row + x] = iw ? sb[x] * iw : pb[x];
+        p[DN_VAR1][row + x] = iw ? sv[x] * iw * iw : p[DN_VAR][row + x];
+      }
+    }
+    free(acc);
+  }
+}
+
+int film_denoise(const c_film_t *f, int iterations, float *out)
+{
+  int w = f->w, h = f->h;
+  int64_t n = (int64_t) w * h;
+  float *mem = (float *) malloc(DN_PLANES * n * sizeof(float));
+  float *p[DN_PLANES];
+
+  if (!mem || !f->feat) {
+    free(mem);
+    return -1;
+  }
+  for (int i = 0; i < DN_PLANES; ++i) p[i] = mem + i * n;
+
+  dn_setup(f, p);
+  for (int i = 0; i < iterations; ++i) {
+    dn_sigma(p, w, h);
+    dn_pass(p, w, h, 1 << i);
+    for (int c = 0; c < 4; ++c) {
+      float *t = p[DN_R + c];
+      p[DN_R + c] = p[DN_R1 + c];
+      p[DN_R1 + c] = t;
+    }
+  }
+
+#pragma omp parallel for schedule(static)
+  for (int64_t k = 0; k < n; ++k)
+    for (int c = 0; c < 3; ++c) out[3*k + c] = p[DN_R + c][k] * p[DN_AR + c][k];
+  free(mem);
+  return 0;
+}
@@ -0,0 +1,379 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "film.h"
+
+int film_init(c_film_t *f, uint32_t w, uint32_t h)
+{
+  size_t n = (size_t) w * h;
+
+  f->w = w; f->h = h;
+  f->x0 = f->y0 = 0;
+  f->s0 = f->s1 = 0;
+  f->map = NULL;
+  f->map_size = 0;
+  f->sum  = (double *) calloc(3 * n, sizeof(double));
+  f->mean = (double *) calloc(n, sizeof(double));
+  f->m2   = (double *) calloc(n, sizeof(double));
+  f->spp  = (uint32_t *) calloc(n, sizeof(uint32_t));
+  f->feat = NULL;
+  f->id = NULL;
+  f->cost = NULL;
+  f->rgb = NULL;
+  if (!f->sum || !f->mean || !f->m2 || !f->spp) {
+    film_free(f);
+    return -1;
+  }
+  return 0;
+}
+
+int film_init_aovs(c_film_t *f, uint32_t mask)
+{
+  size_t n = (size_t) f->w * f->h;
+
+  if ((mask & AOV_FEATURES) && !f->feat) {
+    f->feat = (float *) calloc(FILM_FEATURES * n, sizeof(float));
+    if (!f->feat) return -1;
+  }
+  if ((mask & AOV_ID) && !f->id) {
+    f->id = (int32_t *) malloc(n * sizeof(int32_t));
+    if (!f->id) return -1;
+    for (size_t k = 0; k < n; ++k) f->id[k] = AOV_NO_ID;
+  }
+  if ((mask & AOV_COST) && !f->cost) {
+    f->cost = (float *) calloc(n, sizeof(float));
+    if (!f->cost) return -1;
+  }
+  return 0;
+}
+
+void film_clear(c_film_t *f)
+{
+  size_t n = (size_t) f->w * f->h;
+
+  f->s1 = f->s0;
+  memset(f->sum, 0, 3 * n * sizeof(double));
+  memset(f->mean, 0, n * sizeof(double));
+  memset(f->m2, 0, n * sizeof(double));
+  memset(f->spp, 0, n * sizeof(uint32_t));
+  if (f->feat) memset(f->feat, 0, FILM_FEATURES * n * sizeof(float));
+  if (f->id) for (size_t k = 0; k < n; ++k) f->id[k] = AOV_NO_ID;
+  if (f->cost) memset(f->cost, 0, n * sizeof(float));
+  free(f->rgb);
+  f->rgb = NULL;
+}
+
+void film_free(c_film_t *f)
+{
+  if (f->map) {
+    munmap(f->map, f->map_size);
+    f->map = NULL;
+  } else {
+    free(f->sum); free(f->mean); free(f->m2); free(f->spp);
+  }
+  free(f->feat); free(f->id); free(f->cost); free(f->rgb);
+  f->sum = f->mean = f->m2 = NULL;
+  f->spp = NULL;
+  f->feat = f->cost = f->rgb = NULL;
+  f->id = NULL;
+}
+
+static const char *aov_names[] = { "depth", "normal", "albedo", "id", "spp", "cost" };
+
+int aov_mask(const char *list)
+{
+  int mask = 0;
+
+  while (*list) {
+    size_t len = strcspn(list, ",");
+    int bit = -1;
+    if (len == 3 && !strncmp(list, "all", 3)) mask |= AOV_ALL, bit = 0;
+    for (int i = 0; i < 6; ++i)
+      if (strlen(aov_names[i]) == len && !strncmp(list, aov_names[i], len)) mask |= 1 << i, bit = i;
+    if (bit < 0) return -1;
+    list += len + (list[len] == ',');
+  }
+  return mask;
+}
+
+const char *aov_name(uint32_t aov)
+{
+  for (int i = 0; i < 6; ++i)
+    if (aov == 1u << i) return aov_names[i];
+  return NULL;
+}
+
+int aov_channels(uint32_t aov)
+{
+  return aov == AOV_ALBEDO || aov == AOV_NORMAL || aov == AOV_ID ? 3 : 1;
+}
+
+void film_aov(const c_film_t *f, uint32_t aov, uint32_t y0, uint32_t y1, float *out)
+{
+  int64_t k0 = (int64_t) y0 * f->w, n = (int64_t) (y1 - y0) * f->w;
+  /* offset in the feature buffer */
+  int o = aov == AOV_ALBEDO ? 0 : aov == AOV_NORMAL ? 3 : 6;
+  int c = aov_channels(aov);
+
+#pragma omp parallel for schedule(static)
+  for (int64_t i = 0; i < n; ++i) {
+    int64_t k = k0 + i;
+    float inv = f->spp[k] ? 1.f / f->spp[k] : 0;
+    if (aov & AOV_FEATURES) {
+      for (int j = 0; j < c; ++j) out[c*i + j] = f->feat[FILM_FEATURES*k + o + j] * inv;
+    } else if (aov == AOV_ID) {
+      /* floats hold integers up to 2^24 only, so the id is split in halves */
+      int32_t id = f->id[k];
+      out[3*i] = id < 0 ? -1 : id >> 16;
+      out[3*i + 1] = id < 0 ? -1 : id & 0xFFFF;
+      out[3*i + 2] = 0;
+    } else if (aov == AOV_SPP) {
+      out[i] = f->spp[k];
+    } else {
+      out[i] = f->cost[k] * 1e6f;
+    }
+  }
+}
+
+void film_color(const c_film_t *f, uint32_t y0, uint32_t y1, float *out)
+{
+  int64_t k0 = (int64_t) y0 * f->w, n = (int64_t) (y1 - y0) * f->w;
+
+#pragma omp parallel for schedule(static)
+  for (int64_t i = 0; i < n; ++i) {
+    int64_t k = k0 + i;
+    double s = f->spp[k] ? f->spp[k] : 1;
+    for (int c = 0; c < 3; ++c)
+      out[3*i + c] = f->rgb ? f->rgb[3*k + c] : f->sum[3*k + c] / s;
+  }
+}
+
+double film_noise(const c_film_t *f)
+{
+  size_t n = (size_t) f->w * f->h;
+  double e = 0;
+
+  for (size_t k = 0; k < n; ++k) e += film_error(f, k);
+  return e / n;
+}
+
+uint32_t film_active_count(const c_film_t *f, double noise, uint32_t min_spp)
+{
+  size_t n = (size_t) f->w * f->h;
+  uint32_t c = 0;
+
+  for (size_t k = 0; k < n; ++k) c += film_active(f, k, noise, min_spp);
+  return c;
+}
+
+void film_report(const c_film_t *f, FILE *out)
+{
+  size_t n = (size_t) f->w * f->h;
+  uint32_t lo = UINT32_MAX, hi = 0, hist[33] = {};
+  uint64_t total = 0;
+
+  for (size_t k = 0; k < n; ++k) {
+    uint32_t s = f->spp[k], b = 0;
+    while (s >> b) ++b;
+    hist[b]++;
+    total += s;
+    lo = s < lo ? s : lo;
+    hi = s > hi ? s : hi;
+  }
+  fprintf(out, "spp: min %u, mean %.2f, max %u\n", lo, (double) total / n, hi);
+  for (int b = 0; b < 33; ++b) {
+    if (!hist[b]) continue;
+    uint32_t a = b ? 1u << (b - 1) : 0, e = b ? (1u << b) - 1 : 0;
+    fprintf(out, "  %6u - %-6u %6.2f%%\n", a, e, 100. * hist[b] / n);
+  }
+  uint64_t full = (uint64_t) hi * n;
+  fprintf(out, "samples: %llu of %llu, %.1f%% saved\n", (unsigned long long) total,
+          (unsigned long long) full, full ? 100. * (full - total) / full : 0.);
+}
+
+int film_save(const c_film_t *f, uint32_t w, uint32_t h, uint32_t seed, const char *path)
+{
+  size_t n = (size_t) f->w * f->h;
+  c_film_header_t hd = { FILM_MAGIC, FILM_VERSION, w, h, f->x0, f->y0, f->w, f->h, f->s0, f->s1, seed, 0 };
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *out = fopen(tmp, "wb");
+  if (!out) return -1;
+
+  bool ok = fwrite(&hd, sizeof(hd), 1, out) == 1 &&
+            fwrite(f->sum, sizeof(double), 3 * n, out) == 3 * n &&
+            fwrite(f->mean, sizeof(double), n, out) == n &&
+            fwrite(f->m2, sizeof(double), n, out) == n &&
+            fwrite(f->spp, sizeof(uint32_t), n, out) == n &&
+            fflush(out) == 0 && fsync(fileno(out)) == 0;
+  if (fclose(out) != 0 || !ok || rename(tmp, path) != 0) {
+    remove(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* film_map
+ *
+ * Maps the film file at path (copy on write if writable), NULL with a
+ * message if it is none.
+ */
+static const c_film_header_t *film_map(const char *path, int writable, size_t *size)
+{
+  const c_film_header_t *hd = (const c_film_header_t *) map_file(path, size, writable);
+  if (!hd) {
+    fprintf(stderr, "ERROR: unable to map %s.\n", path);
+    return NULL;
+  }
+  size_t n = *size >= sizeof(*hd) ? (size_t) hd->fw * hd->fh : 0;
+  bool ok = *size >= sizeof(*hd) && hd->magic == FILM_MAGIC && hd->version == FILM_VERSION &&
+            *size == sizeof(*hd) + n * (5 * sizeof(double) + sizeof(uint32_t)) &&
+            hd->fw <= hd->w && hd->x0 <= hd->w - hd->fw && hd->fh <= hd->h && hd->y0 <= hd->h - hd->fh;
+  if (!ok) {
+    fprintf(stderr, "ERROR: %s is not a film file (version %d).\n", path, FILM_VERSION);
+    munmap((void *) hd, *size);
+    return NULL;
+  }
+  return hd;
+}
+
+int film_load(c_film_t *f, c_film_header_t *hd, const char *path)
+{
+  size_t size = 0;
+  c_film_header_t *p = (c_film_header_t *) film_map(path, 1, &size);
+  if (!p) return -1;
+
+  size_t n = (size_t) p->fw * p->fh;
+  *hd = *p;
+  f->w = p->fw; f->h = p->fh;
+  f->x0 = p->x0; f->y0 = p->y0;
+  f->s0 = p->s0; f->s1 = p->s1;
+  f->sum = (double *) (p + 1);
+  f->mean = f->sum + 3 * n;
+  f->m2 = f->mean + n;
+  f->spp = (uint32_t *) (f->m2 + n);
+  f->feat = NULL;
+  f->id = NULL;
+  f->cost = NULL;
+  f->rgb = NULL;
+  f->map = p;
+  f->map_size = size;
+  return 0;
+}
+
+/* True if the films of a and b share pixels and samples. */
+static bool film_overlap(const c_film_header_t *a, const c_film_header_t *b)
+{
+  return a->x0 < b->x0 + b->fw && b->x0 < a->x0 + a->fw && a->y0 < b->y0 + b->fh && b->y0 < a->y0 + a->fh &&
+         a->s0 < b->s1 && b->s0 < a->s1;
+}
+
+int film_merge(c_film_t *f, c_film_header_t *parts, uint32_t n_parts, const char *path)
+{
+  size_t size = 0;
+  const c_film_header_t *hd = film_map(path, 0, &size);
+  if (!hd) return -1;
+  if (!f->sum && film_init(f, hd->w, hd->h) < 0) {
+    munmap((void *) hd, size);
+    return -1;
+  }
+  if (hd->w != f->w || hd->h != f->h) {
+    fprintf(stderr, "ERROR: %s is part of a %ux%u image, not %ux%u.\n", path, hd->w, hd->h, f->w, f->h);
+    munmap((void *) hd, size);
+    return -1;
+  }
+  /* samples of other seeds are correlated, shared samples counted twice */
+  for (uint32_t p = 0; p < n_parts; ++p) {
+    if (hd->seed != parts[p].seed) {
+      fprintf(stderr, "ERROR: %s is rendered with seed %u, not %u.\n", path, hd->seed, parts[p].seed);
+      munmap((void *) hd, size);
+      return -1;
+    }
+    if (film_overlap(hd, &parts[p])) {
+      fprintf(stderr, "ERROR: %s holds samples of pixels that are already merged.\n", path);
+      munmap((void *) hd, size);
+      return -1;
+    }
+  }
+  parts[n_parts] = *hd;
+
+  size_t n = (size_t) hd->fw * hd->fh;
+  const double *sum = (const double *) (hd + 1), *mean = sum + 3 * n, *m2 = mean + n;
+  const uint32_t *spp = (const uint32_t *) (m2 + n);
+#pragma omp parallel for schedule(static)
+  for (uint32_t j = 0; j < hd->fh; ++j) {
+    for (uint32_t i = 0; i < hd->fw; ++i) {
+      size_t q = (size_t) j * hd->fw + i, k = (size_t) (hd->y0 + j) * f->w + hd->x0 + i;
+      uint32_t na = f->spp[k], nb = spp[q], nt = na + nb;
+      if (!nb) continue;
+      f->sum[3*k] += sum[3*q]; f->sum[3*k+1] += sum[3*q+1]; f->sum[3*k+2] += sum[3*q+2];
+      double d = mean[q] - f->mean[k];
+      f->mean[k] += d * nb / nt;
+      f->m2[k] += m2[q] + d * d * na * nb / nt;
+      f->spp[k] = nt;
+    }
+  }
+  munmap((void *) hd, size);
+  return 0;
+}
+
+void film_resolve(const c_film_t *f, uint32_t *im, const c_tonemap_t *tm)
+{
+  const float *rgb = f->rgb;
+  int w = f->w, h = f->h;
+
+#pragma omp parallel
+  {
+    /* values, divisors and codes of a row */
+    double *x = (double *) malloc(6 * (size_t) w * sizeof(double));
+    double *div = x + 3 * w;
+    uint8_t *code = (uint8_t *) malloc(3 * (size_t) w);
+    if (!x || !code) {
+      perror("Unable to allocate memory to resolve the film.");
+      exit(1);
+    }
+
+#pragma omp for schedule(static)
+    for (int y = 0; y < h; ++y) {
+      size_t row = (size_t) y * w;
+      const double *v = rgb ? x : f->sum + 3 * row;
+      for (int i = 0; i < w; ++i) {
+        /* pixels skipped because of a deadline stay black */
+        double n = rgb || !f->spp[row + i] ? 1 : f->spp[row + i];
+        div[3*i] = div[3*i+1] = div[3*i+2] = n;
+      }
+      if (rgb)
+        for (int i = 0; i < 3 * w; ++i) x[i] = rgb[3 * row + i];
+      tonemap_span(tm, v, div, 3 * (size_t) w, code);
+      for (int i = 0; i < w; ++i)
+        im[row + i] = C_RGBA(code[3*i], code[3*i+1], code[3*i+2], 255);
+    }
+    free(x);
+    free(code);
+  }
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include "geom.h"
+
+static real_t *alloc_lanes(uint32_t n)
+{
+  size_t sz = (n * sizeof(real_t) + SIMD_ALIGN - 1) / SIMD_ALIGN * SIMD_ALIGN;
+  return (real_t *) aligned_alloc(SIMD_ALIGN, sz);
+}
+
+c_geom_t *geom_build(const c_sphere *spheres, const uint32_t *order, uint32_t n)
+{
+  c_geom_t *g = (c_geom_t *) calloc(1, sizeof(c_geom_t));
+  uint32_t np = n + SIMD_WD;
+  if (g) {
+    g->cx = alloc_lanes(np);
+    g->cy = alloc_lanes(np);
+    g->cz = alloc_lanes(np);
+    g->r2 = alloc_lanes(np);
+    g->id = (uint32_t *) malloc(np * sizeof(uint32_t));
+  }
+  if (!g || !g->cx || !g->cy || !g->cz || !g->r2 || !g->id) {
+    perror("Unable to allocate memory for the sphere arrays.");
+    exit(1);
+  }
+  g->n = n;
+
+#pragma omp parallel for
+  for (uint32_t k = 0; k < np; ++k) {
+    if (k < n) {
+      const c_sphere *s = &spheres[order ? order[k] : k];
+      g->cx[k] = s->pos.x;
+      g->cy[k] = s->pos.y;
+      g->cz[k] = s->pos.z;
+      g->r2[k] = s->radius * s->radius;
+      g->id[k] = order ? order[k] : k;
+    } else {
+      /* padding: a sphere of negative squared radius is never hit */
+      g->cx[k] = g->cy[k] = g->cz[k] = 0;
+      g->r2[k] = -1;
+      g->id[k] = 0;
+    }
+  }
+  return g;
+}
+
+void geom_update(c_geom_t *g, const c_sphere *spheres)
+{
+#pragma omp parallel for
+  for (uint32_t k = 0; k < g->n; ++k) {
+    const c_sphere *s = &spheres[g->id[k]];
+    g->cx[k] = s->pos.x;
+    g->cy[k] = s->pos.y;
+    g->cz[k] = s->pos.z;
+    g->r2[k] = s->radius * s->radius;
+  }
+}
+
+void geom_free(c_geom_t *g)
+{
+  if (!g) return;
+  free(g->cx);
+  free(g->cy);
+  free(g->cz);
+  free(g->r2);
+  free(g->id);
+  free(g);
+}
@@ -0,0 +1,571 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "image.h"
+
+int image_format(const char *name)
+{
+  if (!strcmp(name, "png"))     return FORMAT_PNG;
+  if (!strcmp(name, "pfm"))     return FORMAT_PFM;
+  if (!strcmp(name, "exr"))     return FORMAT_EXR;
+  if (!strcmp(name, "exr-rle")) return FORMAT_EXR_RLE;
+  if (!strcmp(name, "raw"))     return FORMAT_RAW;
+  if (!strcmp(name, "raw-float")) return FORMAT_RAW_FLOAT;
+  return -1;
+}
+
+const char *image_ext(c_format_t format)
+{
+  if (image_raw(format)) return "";
+  return format == FORMAT_PFM ? ".pfm" : format == FORMAT_PNG ? ".png" : ".exr";
+}
+
+int write_pfm(const char *path, uint32_t w, uint32_t h, int channels, c_rows_fn rows, void *ctx)
+{
+  size_t row = (size_t) w * channels;
+  float *band = (float *) malloc(IMAGE_BAND * row * sizeof(float));
+  FILE *f = fopen(path, "wb");
+  if (!f || !band) {
+    if (f) fclose(f);
+    free(band);
+    return -1;
+  }
+
+  /* a negative scale marks little endian data */
+  int ok = fprintf(f, "%s\n%u %u\n-1.0\n", channels == 3 ? "PF" : "Pf", w, h) > 0;
+  for (uint32_t y1 = h; ok && y1 > 0;) {
+    uint32_t y0 = y1 > IMAGE_BAND ? y1 - IMAGE_BAND : 0;
+    rows(ctx, y0, y1, band);
+    for (uint32_t y = y1; ok && y-- > y0;)
+      ok = fwrite(band + (y - y0) * row, sizeof(float), row, f) == row;
+    y1 = y0;
+  }
+  free(band);
+  return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+/* Attribute of the EXR header: name, type, size and value. */
+static void exr_attr(FILE *f, const char *name, const char *type, uint32_t size, const void *value)
+{
+  fwrite(name, 1, strlen(name) + 1, f);
+  fwrite(type, 1, strlen(type) + 1, f);
+  fwrite(&size, 4, 1, f);
+  fwrite(value, 1, size, f);
+}
+
+/* exr_rle
+ *
+ * RLE compression of a chunk as OpenEXR does it: the bytes are split into
+ * even and odd halves, replaced by their differences (+128) and run length
+ * encoded, runs of 3 to 128 equal bytes as (n-1, byte), anything else as
+ * (-n, n bytes). Returns the size of the result in out (2n bytes).
+ */
+static size_t exr_rle(const uint8_t *in, size_t n, uint8_t *tmp, uint8_t *out)
+{
+  uint8_t *t1 = tmp, *t2 = tmp + (n + 1) / 2;
+  for (size_t i = 0; i < n; ++i) *(i & 1 ? t2++ : t1++) = in[i];
+  for (size_t i = n; i-- > 1;) tmp[i] = (uint8_t) (tmp[i] - tmp[i - 1] + 128);
+
+  size_t o = 0, s = 0;
+  while (s < n) {
+    size_t e = s + 1;
+    while (e < n && tmp[e] == tmp[s] && e - s < 128) ++e;
+    if (e - s >= 3) {
+      out[o++] = (uint8_t) (e - s - 1);
+      out[o++] = tmp[s];
+    } else {
+      /* literal run up to the next run of 3 equal bytes */
+      e = s;
+      while (e < n && e - s < 127 && !(e + 2 < n && tmp[e] == tmp[e + 1] && tmp[e] == tmp[e + 2])) ++e;
+      if (e == s) e = s + 1;
+      out[o++] = (uint8_t) -(int) (e - s);
+      memcpy(out + o, tmp + s, e - s);
+      o += e - s;
+    }
+    s = e;
+  }
+  return o;
+}
+
+int write_exr(const char *path, uint32_t w, uint32_t h, int channels, int rle, c_rows_fn rows, void *ctx)
+{
+  size_t row = (size_t) w * channels, bytes = row * sizeof(float);
+  float *band = (float *) malloc(IMAGE_BAND * row * sizeof(float));
+  /* one chunk: planar line, RLE scratch and output */
+  uint8_t *line = (uint8_t *) malloc(4 * bytes);
+  uint64_t *offsets = (uint64_t *) malloc(h * sizeof(uint64_t));
+  FILE *f = fopen(path, "wb");
+  int ok = f && band && line && offsets;
+
+  if (ok) {
+    const uint32_t magic = 20000630, version = 2;
+    fwrite(&magic, 4, 1, f);
+    fwrite(&version, 4, 1, f);
+
+    /* channels in alphabetical order: name, FLOAT, linear, reserved, sampling */
+    const char *names = channels == 3 ? "BGR" : "Y";
+    uint8_t chl[3 * 18 + 1], *p = chl;
+    for (int c = 0; c < channels; ++c) {
+      const int32_t type = 2, sampling[2] = { 1, 1 };
+      *p++ = names[c]; *p++ = 0;
+      memcpy(p, &type, 4); p += 4;
+      memset(p, 0, 4); p += 4;
+      memcpy(p, sampling, 8); p += 8;
+    }
+    *p++ = 0;
+    const int32_t window[4] = { 0, 0, (int32_t) w - 1, (int32_t) h - 1 };
+    const float one = 1, center[2] = { 0, 0 };
+    const uint8_t comp = rle ? 1 : 0, order = 0;
+    exr_attr(f, "channels", "chlist", p - chl, chl);
+    exr_attr(f, "compression", "compression", 1, &comp);
+    exr_attr(f, "dataWindow", "box2i", 16, window);
+    exr_attr(f, "displayWindow", "box2i", 16, window);
+    exr_attr(f, "lineOrder", "lineOrder", 1, &order);
+    exr_attr(f, "pixelAspectRatio", "float", 4, &one);
+    exr_attr(f, "screenWindowCenter", "v2f", 8, center);
+    exr_attr(f, "screenWindowWidth", "float", 4, &one);
+    fputc(0, f);
+
+    /* the offsets of uncompressed chunks are known ahead */
+    long table = ftell(f);
+    uint64_t pos = table + (uint64_t) h * 8;
+    for (uint32_t y = 0; y < h; ++y) offsets[y] = pos + y * (8 + bytes);
+    ok = fwrite(offsets, 8, h, f) == h;
+
+    for (uint32_t y0 = 0; ok && y0 < h; y0 += IMAGE_BAND) {
+      uint32_t y1 = y0 + IMAGE_BAND < h ? y0 + IMAGE_BAND : h;
+      rows(ctx, y0, y1, band);
+      for (uint32_t y = y0; ok && y < y1; ++y) {
+        /* a chunk holds the line of every channel in turn */
+        const float *src = band + (y - y0) * row;
+        float *dst = (float *) line;
+        for (int c = 0; c < channels; ++c)
+          for (uint32_t x = 0; x < w; ++x) dst[c * w + x] = src[x * channels + (channels - 1 - c)];
+
+        uint8_t *data = line;
+        uint32_t size = bytes;
+        if (rle) {
+          size_t n = exr_rle(data, bytes, line + bytes, line + 2 * bytes);
+          /* chunks that do not shrink are stored as they are */
+          if (n < bytes) {
+            data = line + 2 * bytes;
+            size = n;
+          }
+          offsets[y] = pos;
+        }
+        int32_t head[2] = { (int32_t) y, (int32_t) size };
+        ok = fwrite(head, 4, 2, f) == 2 && fwrite(data, 1, size, f) == size;
+        pos += 8 + size;
+      }
+    }
+    if (ok && rle)
+      ok = fseek(f, table, SEEK_SET) == 0 && fwrite(offsets, 8, h, f) == h;
+  }
+  free(band); free(line); free(offsets);
+  if (f && fclose(f) != 0) ok = 0;
+  return ok ? 0 : -1;
+}
+
+int write_float_image(c_format_t format, const char *path, uint32_t w, uint32_t h, int channels,
+                      c_rows_fn rows, void *ctx)
+{
+  if (format == FORMAT_EXR || format == FORMAT_EXR_RLE)
+    return write_exr(path, w, h, channels, format == FORMAT_EXR_RLE, rows, ctx);
+  return write_pfm(path, w, h, channels, rows, ctx);
+}
+
+/* Positions of the hash chain tried per match by deflate_band(). */
+#define PNG_CHAIN           16
+#define PNG_HASH_BITS       15
+#define PNG_WINDOW          32768
+
+static inline void put32be(uint8_t *p, uint32_t v)
+{
+  p[0] = (uint8_t) (v >> 24); p[1] = (uint8_t) (v >> 16); p[2] = (uint8_t) (v >> 8); p[3] = (uint8_t) v;
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *p, size_t n)
+{
+  static const struct crc_table {
+    uint32_t t[256];
+    crc_table() {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        t[i] = c;
+      }
+    }
+  } table;
+  crc = ~crc;
+  for (size_t i = 0; i < n; ++i) crc = table.t[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+static uint32_t adler32(const uint8_t *p, size_t n)
+{
+  uint32_t a = 1, b = 0;
+  while (n) {
+    /* 5552 bytes are summed before b can overflow */
+    size_t k = n < 5552 ? n : 5552;
+    n -= k;
+    while (k--) { a += *p++; b += a; }
+    a %= 65521; b %= 65521;
+  }
+  return b << 16 | a;
+}
+
+/* Adler-32 of two blocks from theirs, n2 the size of the second. */
+static uint32_t adler32_combine(uint32_t a1, uint32_t a2, size_t n2)
+{
+  const uint32_t base = 65521;
+  uint32_t r = n2 % base;
+  uint32_t s1 = a1 & 0xffff, s2 = (uint32_t) ((uint64_t) r * s1 % base);
+  s1 += (a2 & 0xffff) + base - 1;
+  s2 += (a1 >> 16) + (a2 >> 16) + base - r;
+  if (s1 >= base) s1 -= base;
+  if (s1 >= base) s1 -= base;
+  if (s2 >= 2 * base) s2 -= 2 * base;
+  if (s2 >= base) s2 -= base;
+  return s2 << 16 | s1;
+}
+
+/* Bit writer of deflate, least significant bit first. */
+typedef struct c_bits {
+  uint8_t *p;
+  uint64_t acc;
+  int n;
+} c_bits_t;
+
+static inline void bits_put(c_bits_t *b, uint32_t v, int n)
+{
+  b->acc |= (uint64_t) v << b->n;
+  b->n += n;
+  if (b->n >= 32) {
+    memcpy(b->p, &b->acc, 4);
+    b->p += 4;
+    b->acc >>= 32;
+    b->n -= 32;
+  }
+}
+
+static inline void bits_align(c_bits_t *b)
+{
+  for (; b->n > 0; b->n -= 8) {
+    *b->p++ = (uint8_t) b->acc;
+    b->acc >>= 8;
+  }
+  b->n = 0;
+}
+
+/* Fixed Huffman codes of deflate, bit reversed to be written as they are. */
+typedef struct c_fixed_codes {
+  /* literals and end of block */
+  uint16_t lit[257];
+  uint8_t lit_bits[257];
+  /* lengths 3 to 258 with their extra bits */
+  uint32_t len[259];
+  uint8_t len_bits[259];
+
+  c_fixed_codes() {
+    for (int s = 0; s < 286; ++s) {
+      uint32_t c = s < 144 ? 0x30 + s : s < 256 ? 0x190 + s - 144 : s < 280 ? s - 256 : 0xc0 + s - 280;
+      int n = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+      uint32_t r = 0;
+      for (int k = 0; k < n; ++k) r |= (c >> k & 1) << (n - 1 - k);
+      if (s <= 256) {
+        lit[s] = (uint16_t) r;
+        lit_bits[s] = (uint8_t) n;
+        continue;
+      }
+      /* first length and extra bits of the length symbol */
+      int e = s < 265 || s == 285 ? 0 : (s - 261) / 4;
+      int l0 = s == 285 ? 258 : s < 265 ? s - 254 : 3 + ((4 + (s - 261) % 4) << e);
+      for (int l = l0; l < l0 + (1 << e) && l <= 258; ++l) {
+        if (s == 284 && l == 258) break;
+        len[l] = r | (uint32_t) (l - l0) << n;
+        len_bits[l] = (uint8_t) (n + e);
+      }
+    }
+  }
+} c_fixed_codes_t;
+
+/* deflate_band
+ *
+ * Compresses the n bytes of in into out as a single deflate block with the
+ * fixed Huffman codes, greedy matches found on hash chains of 4 bytes. The
+ * last band closes the stream, any other ends in an empty stored block (a
+ * sync flush) so that the next band starts on a byte of its own. head and
+ * prev are scratch of 2^PNG_HASH_BITS and PNG_WINDOW entries, out holds up
+ * to n * 9 / 8 + 16 bytes. Returns the size of the output.
+ */
+static size_t deflate_band(const uint8_t *in, size_t n, int last, int32_t *head, int32_t *prev, uint8_t *out)
+{
+  static const c_fixed_codes_t fc;
+  c_bits_t b = { out, 0, 0 };
+  bits_put(&b, last ? 3 : 2, 3);
+  for (int k = 0; k < 1 << PNG_HASH_BITS; ++k) head[k] = -1;
+
+  size_t i = 0;
+  while (i < n) {
+    size_t best = 0, dist = 0;
+    if (i + 4 <= n) {
+      uint32_t v;
+      memcpy(&v, in + i, 4);
+      uint32_t hs = v * 2654435761u >> (32 - PNG_HASH_BITS);
+      size_t max = n - i < 258 ? n - i : 258;
+      int32_t c = head[hs];
+      for (int d = PNG_CHAIN; c >= 0 && i - c <= PNG_WINDOW && d--; c = prev[c & (PNG_WINDOW - 1)]) {
+        if (in[c + best] != in[i + best]) continue;
+        /* compare 8 bytes at a time, the first difference from the lowest */
+        size_t l = 0;
+        for (; l + 8 <= max; l += 8) {
+          uint64_t x, y;
+          memcpy(&x, in + c + l, 8);
+          memcpy(&y, in + i + l, 8);
+          if (x != y) {
+            l += __builtin_ctzll(x ^ y) >> 3;
+            goto done;
+          }
+        }
+        while (l < max && in[c + l] == in[i + l]) ++l;
+      done:
+        if (l > best) {
+          best = l;
+          dist = i - c;
+          if (l == max) break;
+        }
+      }
+      prev[i & (PNG_WINDOW - 1)] = head[hs];
+      head[hs] = (int32_t) i;
+    }
+    if (best < 4) {
+      bits_put(&b, fc.lit[in[i]], fc.lit_bits[in[i]]);
+      ++i;
+      continue;
+    }
+    bits_put(&b, fc.len[best], fc.len_bits[best]);
+    /* distance code: 5 bits reversed, then the extra bits */
+    uint32_t d = (uint32_t) dist - 1;
+    int e = d < 4 ? 0 : 30 - __builtin_clz(d);
+    uint32_t code = d < 4 ? d : 2 * e + 2 + (d >> e & 1);
+    uint32_t r = 0;
+    for (int k = 0; k < 5; ++k) r |= (code >> k & 1) << (4 - k);
+    bits_put(&b, r | (d & ((1u << e) - 1)) << 5, 5 + e);
+
+    /* the rest of the match goes into the chains too */
+    size_t end = i + best;
+    for (++i; i < end; ++i) {
+      if (i + 4 > n) continue;
+      uint32_t v;
+      memcpy(&v, in + i, 4);
+      uint32_t hs = v * 2654435761u >> (32 - PNG_HASH_BITS);
+      prev[i & (PNG_WINDOW - 1)] = head[hs];
+      head[hs] = (int32_t) i;
+    }
+  }
+  bits_put(&b, fc.lit[256], fc.lit_bits[256]);
+  if (!last) {
+    bits_put(&b, 0, 3);
+    bits_align(&b);
+    memcpy(b.p, "\x00\x00\xff\xff", 4);
+    b.p += 4;
+  }
+  bits_align(&b);
+  return b.p - out;
+}
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+  int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  return (uint8_t) (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+}
+
+/* png_filter
+ *
+ * Filters the n bytes of the RGBA row cur against up, the row above (zeros
+ * for the first), into out[1..n] with the filter of the smallest sum of
+ * absolute values, as stb_image_write chooses. out[0] is the filter, tmp
+ * scratch of n bytes.
+ */
+static void png_filter(const uint8_t *cur, const uint8_t *up, size_t n, uint8_t *tmp, uint8_t *out)
+{
+  uint32_t best = UINT32_MAX;
+  for (int type = 0; type < 5; ++type) {
+    uint8_t *f = type ? tmp : out + 1;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+      int a = i >= 4 ? cur[i - 4] : 0, b = up[i], c = i >= 4 ? up[i - 4] : 0;
+      uint8_t p = type == 0 ? 0 : type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) >> 1 : paeth(a, b, c);
+      f[i] = (uint8_t) (cur[i] - p);
+      sum += abs((int8_t) f[i]);
+    }
+    if (sum < best) {
+      best = sum;
+      out[0] = (uint8_t) type;
+      if (type) memcpy(out + 1, tmp, n);
+    }
+  }
+}
+
+/* Writes the PNG chunk of type and data at p[8..8+n) in place. */
+static size_t png_chunk(uint8_t *p, const char *type, size_t n)
+{
+  put32be(p, (uint32_t) n);
+  memcpy(p + 4, type, 4);
+  put32be(p + 8 + n, crc32(0, p + 4, n + 4));
+  return n + 12;
+}
+
+int write_png(const char *path, const uint32_t *im, uint32_t w, uint32_t h)
+{
+  size_t stride = (size_t) w * 4, row = stride + 1;
+  uint32_t rows = PNG_BAND_BYTES / row ? PNG_BAND_BYTES / row : 1, bands = (h + rows - 1) / rows;
+  FILE *f = fopen(path, "wb");
+  if (!f) return -1;
+
+  uint8_t hd[8 + 25];
+  memcpy(hd, "\x89PNG\r\n\x1a\n", 8);
+  put32be(hd + 16, w);
+  put32be(hd + 20, h);
+  /* 8 bit RGBA, deflate, adaptive filters, not interlaced */
+  memcpy(hd + 24, "\x08\x06\x00\x00\x00", 5);
+  int ok = fwrite(hd, 1, 8 + png_chunk(hd + 8, "IHDR", 13), f) == sizeof(hd);
+  uint32_t adler = 1;
+
+  #pragma omp parallel
+  {
+    /* filtered band, a spare row and the deflated chunk */
+    size_t n = (size_t) rows * row;
+    uint8_t *buf = (uint8_t *) malloc(n + stride);
+    uint8_t *out = (uint8_t *) malloc(n + n / 8 + 64);
+    int32_t *head = (int32_t *) malloc(((1 << PNG_HASH_BITS) + PNG_WINDOW) * sizeof(int32_t));
+    uint8_t *zero = (uint8_t *) calloc(stride, 1);
+    int mine = buf && out && head && zero;
+
+    #pragma omp for ordered schedule(dynamic, 1)
+    for (uint32_t k = 0; k < bands; ++k) {
+      uint32_t y0 = k * rows, y1 = y0 + rows < h ? y0 + rows : h;
+      size_t size = 0, len = 0;
+      uint32_t a = 1;
+      if (mine) {
+        const uint8_t *px = (const uint8_t *) im;
+        for (uint32_t y = y0; y < y1; ++y)
+          png_filter(px + y * stride, y ? px + (y - 1) * stride : zero, stride, buf + n, buf + (y - y0) * row);
+        size = (size_t) (y1 - y0) * row;
+        a = adler32(buf, size);
+
+        /* the first band starts the zlib stream: deflate, 32K window */
+        uint8_t *data = out + 8;
+        if (!k) {
+          data[len++] = 0x78;
+          data[len++] = 0x01;
+        }
+        len += deflate_band(buf, size, k == bands - 1, head, head + (1 << PNG_HASH_BITS), data + len);
+        len = png_chunk(out, "IDAT", len);
+      }
+      #pragma omp ordered
+      {
+        adler = adler32_combine(adler, a, size);
+        if (!mine) ok = 0;
+        if (ok) ok = fwrite(out, 1, len, f) == len;
+      }
+    }
+    free(buf); free(out); free(head); free(zero);
+  }
+
+  /* the Adler-32 closing the zlib stream and the end */
+  uint8_t tail[16 + 12];
+  put32be(tail + 8, adler);
+  size_t n = png_chunk(tail, "IDAT", 4);
+  n += png_chunk(tail + n, "IEND", 0);
+  if (ok) ok = fwrite(tail, 1, n, f) == n;
+  if (fclose(f) != 0) ok = 0;
+  return ok ? 0 : -1;
+}
+
+void write_png_async(c_image_job_t *job, const char *path, const uint32_t *im, uint32_t w, uint32_t h)
+{
+  job->err = 0;
+  job->ms = 0;
+  job->thread = std::thread([=]() {
+    double t0 = omp_get_wtime();
+    job->err = write_png(path, im, w, h);
+    job->ms = (omp_get_wtime() - t0) * 1e3;
+  });
+}
+
+void write_float_image_async(c_image_job_t *job, c_format_t format, const char *path, uint32_t w, uint32_t h,
+                             int channels, c_rows_fn rows, void *ctx)
+{
+  job->err = 0;
+  job->ms = 0;
+  job->thread = std::thread([=]() {
+    double t0 = omp_get_wtime();
+    job->err = write_float_image(format, path, w, h, channels, rows, ctx);
+    job->ms = (omp_get_wtime() - t0) * 1e3;
+  });
+}
+
+int raw_open(const char *path)
+{
+  signal(SIGPIPE, SIG_IGN);
+  if (!strcmp(path, "-")) return STDOUT_FILENO;
+  return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+int write_raw(int fd, const void *buf, size_t n)
+{
+  const char *p = (const char *) buf;
+  while (n) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return -1;
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+void write_raw_async(c_image_job_t *job, int fd, const void *buf, size_t n)
+{
+  job->err = 0;
+  job->ms = 0;
+  job->thread = std::thread([=]() {
+    double t0 = omp_get_wtime();
+    job->err = write_raw(fd, buf, n);
+    job->ms = (omp_get_wtime() - t0) * 1e3;
+  });
+}
+
+int image_wait(c_image_job_t *job)
+{
+  if (job->thread.joinable()) job->thread.join();
+  return job->err;
+}
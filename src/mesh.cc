@@ -0,0 +1,232 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include <sys/mman.h>
+#include <vector>
+
+#include "mesh.h"
+#include "bvh.h"
+
+static void mesh_defaults(c_mesh_t *m)
+{
+  *m = c_mesh_t();
+  m->color = vec3(.7, .7, .7);
+  m->emission = vec3(0, 0, 0);
+}
+
+int mesh_load_bin(c_mesh_t *m, const char *path)
+{
+  size_t size = 0;
+  void *p = map_file(path, &size, 0);
+
+  mesh_defaults(m);
+  if (!p) {
+    fprintf(stderr, "ERROR: unable to map %s.\n", path);
+    return -1;
+  }
+  const c_mesh_header_t *h = (const c_mesh_header_t *) p;
+  if (size < sizeof(*h) || h->magic != MESH_MAGIC || h->version != MESH_VERSION ||
+      size < sizeof(*h) + (size_t) h->nv * 12 + (size_t) h->nt * 12) {
+    fprintf(stderr, "ERROR: %s is not a binary mesh (version %d).\n", path, MESH_VERSION);
+    munmap(p, size);
+    return -1;
+  }
+  /* the BVH build and the intersection follow the indices unchecked */
+  const uint32_t *idx = (const uint32_t *) ((const float *) (h + 1) + 3 * (size_t) h->nv);
+  bool ok = h->material < (uint32_t) NUM_MATERIALS;
+  for (size_t k = 0; ok && k < 3 * (size_t) h->nt; ++k) ok = idx[k] < h->nv;
+  if (!ok) {
+    fprintf(stderr, "ERROR: %s has an unknown material or a vertex index out of range.\n", path);
+    munmap(p, size);
+    return -1;
+  }
+  m->nv = h->nv;
+  m->nt = h->nt;
+  m->v = (const float *) (h + 1);
+  m->idx = idx;
+  m->color = vec3(h->color[0], h->color[1], h->color[2]);
+  m->emission = vec3(h->emission[0], h->emission[1], h->emission[2]);
+  m->ir = h->ir;
+  m->material = (c_material_t) h->material;
+  m->map = p;
+  m->map_size = size;
+  return 0;
+}
+
+/* Parses the next number of a line ending at end into f, false if there is
+ * none. The number is copied out, as the mapping is not NUL terminated. */
+static bool obj_float(const char **s, const char *end, float *f)
+{
+  char buf[64], *e;
+  const char *b = *s;
+  while (b < end && (*b == ' ' || *b == '\t')) ++b;
+  size_t n = 0;
+  while (b + n < end && n < sizeof(buf) - 1 && b[n] != ' ' && b[n] != '\t' && b[n] != '\r') {
+    buf[n] = b[n];
+    ++n;
+  }
+  buf[n] = 0;
+  *f = strtof(buf, &e);
+  *s = b + (e - buf);
+  return n && e == buf + n;
+}
+
+/* Parses a (possibly negative, 1 based) OBJ index, -1 if invalid. The
+ * digits are read up to end, as the mapping is not NUL terminated. */
+static long obj_index(const char **s, const char *end, long n)
+{
+  const char *e = *s;
+  bool neg = e < end && *e == '-';
+  if (e < end && (*e == '-' || *e == '+')) ++e;
+  const char *d = e;
+  long i = 0;
+  /* stops growing once out of range, which is all that matters then */
+  for (; e < end && *e >= '0' && *e <= '9'; ++e)
+    if (i <= n) i = 10 * i + (*e - '0');
+  if (e == d) return -1;
+  /* skip the texture and normal indices of v/vt/vn */
+  while (e < end && *e != ' ' && *e != '\t' && *e != '\n' && *e != '\r') ++e;
+  *s = e;
+  i = neg ? n - i : i - 1;
+  return i >= 0 && i < n ? i : -1;
+}
+
+int mesh_load_obj(c_mesh_t *m, const char *path)
+{
+  size_t size = 0;
+  const char *p = (const char *) map_file(path, &size, 0);
+
+  mesh_defaults(m);
+  if (!p) {
+    fprintf(stderr, "ERROR: unable to map %s.\n", path);
+    return -1;
+  }
+  std::vector<float> v;
+  std::vector<uint32_t> idx;
+  const char *s = p, *end = p + size;
+  int err = 0;
+
+  for (uint32_t line = 1; s < end && !err; ++line) {
+    const char *eol = (const char *) memchr(s, '\n', end - s);
+    if (!eol) eol = end;
+    while (s < eol && (*s == ' ' || *s == '\t')) ++s;
+
+    if (eol - s > 2 && s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+      const char *e = s + 1;
+      for (int k = 0; k < 3 && !err; ++k) {
+        float x = 0;
+        if (!obj_float(&e, eol, &x)) err = line;
+        v.push_back(x);
+      }
+    } else if (eol - s > 2 && s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+      /* polygons are split into a fan of triangles */
+      long first = -1, prev = -1, n = v.size() / 3;
+      int nf = 0;
+      s += 2;
+      while (!err) {
+        while (s < eol && (*s == ' ' || *s == '\t' || *s == '\r')) ++s;
+        if (s >= eol) break;
+        long i = obj_index(&s, eol, n);
+        nf++;
+        if (i < 0) err = line;
+        else if (first < 0) first = i;
+        else if (prev < 0) prev = i;
+        else {
+          idx.push_back(first); idx.push_back(prev); idx.push_back(i);
+          prev = i;
+        }
+      }
+      if (nf < 3) err = line;
+    }
+    s = eol + 1;
+  }
+  munmap((void *) p, size);
+  if (err) {
+    fprintf(stderr, "ERROR: %s:%d: malformed vertex or face.\n", path, err);
+    return -1;
+  }
+
+  /* one block for both arrays, freed by mesh_free() */
+  size_t vb = v.size() * sizeof(float), ib = idx.size() * sizeof(uint32_t);
+  char *mem = (char *) malloc(vb + ib + 1);
+  if (!mem) {
+    perror("Unable to allocate memory for the mesh.");
+    return -1;
+  }
+  memcpy(mem, v.data(), vb);
+  memcpy(mem + vb, idx.data(), ib);
+  m->v = (const float *) mem;
+  m->idx = (const uint32_t *) (mem + vb);
+  m->nv = v.size() / 3;
+  m->nt = idx.size() / 3;
+  m->map = mem;
+  return 0;
+}
+
+int mesh_load(c_mesh_t *m, const char *path)
+{
+  size_t n = strlen(path);
+  int r = n > 4 && !strcmp(path + n - 4, ".obj") ? mesh_load_obj(m, path) : mesh_load_bin(m, path);
+  m->path = strdup(path);
+  return r;
+}
+
+int mesh_save_bin(const c_mesh_t *m, const char *path)
+{
+  c_mesh_header_t h = {
+    .magic = MESH_MAGIC, .version = MESH_VERSION, .nv = m->nv, .nt = m->nt,
+    .color = { (float) m->color.x, (float) m->color.y, (float) m->color.z },
+    .emission = { (float) m->emission.x, (float) m->emission.y, (float) m->emission.z },
+    .ir = (float) m->ir, .material = (uint32_t) m->material,
+  };
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    perror("Unable to write the mesh");
+    return -1;
+  }
+  bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+            fwrite(m->v, 12, m->nv, f) == m->nv &&
+            fwrite(m->idx, 12, m->nt, f) == m->nt;
+  ok = fclose(f) == 0 && ok;
+  if (!ok) fprintf(stderr, "ERROR: unable to write %s.\n", path);
+  return ok ? 0 : -1;
+}
+
+void mesh_free(c_mesh_t *m)
+{
+  if (m->map_size) munmap(m->map, m->map_size);
+  else free(m->map);
+  bvh_free(m->bvh);
+  free(m->path);
+  m->map = NULL;
+  m->bvh = NULL;
+  m->path = NULL;
+}
+
+size_t mesh_bytes(const c_mesh_t *m)
+{
+  size_t b = (size_t) m->nv * 12 + (size_t) m->nt * 12;
+  if (m->bvh)
+    b += m->bvh->num_nodes * sizeof(c_bvh_node_t) + m->bvh->num_prims * sizeof(uint32_t);
+  return b;
+}
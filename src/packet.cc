@@ -0,0 +1,204 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include "packet.h"
+#include "bvh.h"
+#include "geom.h"
+
+/* c_frustum
+ *
+ * Interval bounds of the origins and inverse directions of a packet. The
+ * bounds are only usable (coherent) if the directions of all rays have the
+ * same, nonzero sign on every axis.
+ */
+typedef struct c_frustum {
+  real_t olo[3], ohi[3];
+  real_t ilo[3], ihi[3];
+  bool coherent;
+} c_frustum_t;
+
+static void frustum_init(c_frustum_t *f, const c_packet_t *p)
+{
+  const real_t *o[3] = { p->ox, p->oy, p->oz };
+  const real_t *d[3] = { p->dx, p->dy, p->dz };
+  const real_t *id[3] = { p->ix, p->iy, p->iz };
+
+  f->coherent = true;
+  for (int a = 0; a < 3; ++a) {
+    f->olo[a] = f->ilo[a] = 1e300;
+    f->ohi[a] = f->ihi[a] = -1e300;
+    bool pos = d[a][0] > 0;
+    for (uint32_t i = 0; i < p->n; ++i) {
+      if (d[a][i] == 0 || (d[a][i] > 0) != pos) f->coherent = false;
+      f->olo[a] = minr(f->olo[a], o[a][i]); f->ohi[a] = maxr(f->ohi[a], o[a][i]);
+      f->ilo[a] = minr(f->ilo[a], id[a][i]); f->ihi[a] = maxr(f->ihi[a], id[a][i]);
+    }
+  }
+}
+
+/* Lower or upper bound of the interval product [x0, x1] * [y0, y1]. */
+static inline real_t imul_lo(real_t x0, real_t x1, real_t y0, real_t y1)
+{
+  return minr(minr(x0 * y0, x0 * y1), minr(x1 * y0, x1 * y1));
+}
+
+static inline real_t imul_hi(real_t x0, real_t x1, real_t y0, real_t y1)
+{
+  return maxr(maxr(x0 * y0, x0 * y1), maxr(x1 * y0, x1 * y1));
+}
+
+/* True if no ray of the packet can hit b within (tmin, tmax). */
+static bool frustum_miss(const c_frustum_t *f, const c_aabb_t &b, real_t tmin, real_t tmax)
+{
+  real_t lo[3] = { b.lo.x, b.lo.y, b.lo.z }, hi[3] = { b.hi.x, b.hi.y, b.hi.z };
+  real_t tn = tmin, tf = tmax;
+
+  for (int a = 0; a < 3; ++a) {
+    /* rays with negative direction enter through the upper plane */
+    real_t pn = f->ilo[a] > 0 ? lo[a] : hi[a], pf = f->ilo[a] > 0 ? hi[a] : lo[a];
+    tn = maxr(tn, imul_lo(pn - f->ohi[a], pn - f->olo[a], f->ilo[a], f->ihi[a]));
+    tf = minr(tf, imul_hi(pf - f->ohi[a], pf - f->olo[a], f->ilo[a], f->ihi[a]));
+  }
+  return tn > tf;
+}
+
+/* True if at least one ray of the packet hits b before its closest hit. */
+static bool packet_hit_box(const c_packet_t *p, const c_aabb_t &b)
+{
+  vr_t lx = vr_set1(b.lo.x), ly = vr_set1(b.lo.y), lz = vr_set1(b.lo.z);
+  vr_t hx = vr_set1(b.hi.x), hy = vr_set1(b.hi.y), hz = vr_set1(b.hi.z);
+  vr_t zero = vr_set1(0);
+
+  for (uint32_t i = 0; i < p->n; i += SIMD_WD) {
+    vr_t ox = vr_load(p->ox + i), oy = vr_load(p->oy + i), oz = vr_load(p->oz + i);
+    vr_t ix = vr_load(p->ix + i), iy = vr_load(p->iy + i), iz = vr_load(p->iz + i);
+    vr_t t0 = vr_mul(vr_sub(lx, ox), ix), t1 = vr_mul(vr_sub(hx, ox), ix);
+    vr_t tn = vr_min(t0, t1), tf = vr_max(t0, t1);
+    t0 = vr_mul(vr_sub(ly, oy), iy); t1 = vr_mul(vr_sub(hy, oy), iy);
+    tn = vr_max(tn, vr_min(t0, t1)); tf = vr_min(tf, vr_max(t0, t1));
+    t0 = vr_mul(vr_sub(lz, oz), iz); t1 = vr_mul(vr_sub(hz, oz), iz);
+    tn = vr_max(tn, vr_min(t0, t1)); tf = vr_min(tf, vr_max(t0, t1));
+    vm_t m = vm_and(vr_le(vr_max(tn, zero), tf), vr_lt(tn, vr_load(p->t + i)));
+    if (vm_bits(m)) return true;
+  }
+  return false;
+}
+
+/* Tests every ray of p against the spheres [first, first + count) of g. */
+static void packet_leaf(c_packet_t *p, const c_geom_t *g, uint32_t first, uint32_t count, real_t tmin)
+{
+  vr_t vtmin = vr_set1(tmin), zero = vr_set1(0);
+
+  STAT_ADD(sphere_tests, (uint64_t) count * p->n);
+  /* same arithmetic as geom_closest, so both report identical distances */
+  for (uint32_t j = first; j < first + count; ++j) {
+    vr_t cx = vr_set1(g->cx[j]), cy = vr_set1(g->cy[j]), cz = vr_set1(g->cz[j]);
+    vr_t r2 = vr_set1(g->r2[j]), vj = vr_set1(j);
+
+    for (uint32_t i = 0; i < p->n; i += SIMD_WD) {
+      vr_t dx = vr_load(p->dx + i), dy = vr_load(p->dy + i), dz = vr_load(p->dz + i);
+      vr_t a = vr_load(p->a + i);
+      vr_t ocx = vr_sub(vr_load(p->ox + i), cx);
+      vr_t ocy = vr_sub(vr_load(p->oy + i), cy);
+      vr_t ocz = vr_sub(vr_load(p->oz + i), cz);
+      vr_t b = vr_add(vr_add(vr_mul(dx, ocx), vr_mul(dy, ocy)), vr_mul(dz, ocz));
+      vr_t c = vr_sub(vr_add(vr_add(vr_mul(ocx, ocx), vr_mul(ocy, ocy)), vr_mul(ocz, ocz)), r2);
+      vr_t sd = vr_sub(vr_mul(b, b), vr_mul(a, c));
+      vm_t m = vr_le(zero, sd);
+      if (!vm_bits(m)) continue;
+
+      vr_t sq = vr_sqrt(vr_max(sd, zero));
+      vr_t t0 = vr_div(vr_sub(vr_sub(zero, b), sq), a);
+      vr_t t1 = vr_div(vr_add(vr_sub(zero, b), sq), a);
+      vr_t t = vr_select(vr_lt(vtmin, t0), t0, t1);
+      vr_t best = vr_load(p->t + i);
+      m = vm_and(m, vm_and(vr_lt(vtmin, t), vr_lt(t, best)));
+      if (!vm_bits(m)) continue;
+
+      vr_store(p->t + i, vr_select(m, t, best));
+      vr_store(p->k + i, vr_select(m, vj, vr_load(p->k + i)));
+    }
+  }
+}
+
+void packet_trace(c_packet_t *p, const c_scene_t *s, real_t tmin)
+{
+  /* unused lanes get a degenerate ray that cannot hit anything */
+  for (uint32_t i = 0; i < PACKET_SIZE; ++i) {
+    p->t[i] = i < p->n ? 1e20 : -1;
+    p->k[i] = -1;
+    if (i >= p->n) {
+      p->ox[i] = p->oy[i] = p->oz[i] = 0;
+      p->dx[i] = p->dy[i] = p->dz[i] = p->a[i] = 1;
+      p->ix[i] = p->iy[i] = p->iz[i] = 1;
+    }
+  }
+  /* whole vectors are processed, the tail lanes are inert */
+  uint32_t n = p->n;
+  p->n = (n + SIMD_WD - 1) / SIMD_WD * SIMD_WD;
+
+  if (!s->bvh) {
+    packet_leaf(p, s->geom, 0, s->num_spheres, tmin);
+    p->n = n;
+    return;
+  }
+
+  c_frustum_t f;
+  frustum_init(&f, p);
+  /* the middle ray decides the order in which children are visited */
+  uint32_t c = n / 2;
+  vec3 co(p->ox[c], p->oy[c], p->oz[c]);
+  vec3 ci(p->ix[c], p->iy[c], p->iz[c]);
+
+  const c_bvh_t *bvh = s->bvh;
+  uint32_t stack[BVH_MAX_DEPTH + 2];
+  int sp = 0;
+  stack[sp++] = 0;
+
+  while (sp) {
+    const c_bvh_node_t *node = &bvh->nodes[stack[--sp]];
+    /* counted per ray, like the single ray traversal */
+    STAT_ADD(bvh_nodes, n);
+    real_t tmax = 0;
+    for (uint32_t i = 0; i < n; ++i) tmax = maxr(tmax, p->t[i]);
+
+    if (f.coherent && frustum_miss(&f, node->box, tmin, tmax)) continue;
+    if (!packet_hit_box(p, node->box)) continue;
+
+    if (node->count) {
+      packet_leaf(p, s->geom, node->first, node->count, tmin);
+      continue;
+    }
+    real_t tl, tr;
+    uint32_t l = node->first, r = node->first + 1;
+    bool hl = bvh->nodes[l].box.hit(co, ci, 1e20, &tl);
+    bool hr = bvh->nodes[r].box.hit(co, ci, 1e20, &tr);
+    /* near child on top of the stack */
+    if ((hr && !hl) || (hl && hr && tr < tl)) {
+      uint32_t x = l; l = r; r = x;
+    }
+    stack[sp++] = r;
+    stack[sp++] = l;
+  }
+  p->n = n;
+}
@@ -22,214 +22,575 @@
  * */
 
 #include "renderer.h"
+#include "bvh.h"
+#include "geom.h"
+#include "packet.h"
+#include "film.h"
+#include "mesh.h"
+#include "wavefront.h"
+#include "denoise.h"
 
+#include <signal.h>
 
-vec3d random_unit_vec() 
+
+/* Uniform direction from two draws in closed form, a rejection loop would
+ * take a varying number of dimensions. */
+vec3 random_unit_vec(c_rng_t *rng) 
 {
-  vec3d p;
-  while (true) {
-    p = vec3d::rand(-1, 1);
-    if (p.len() < 1)
-      return vec3d::unit(p);
-  }
+  real_t z = 1 - 2 * randd(rng), phi = 2 * M_PI * randd(rng);
+  real_t r = sqrt(fmax(0., 1 - z * z));
+  return vec3(r * cos(phi), r * sin(phi), z);
 }
 
-vec3d random_vec_on_hemisphere(vec3d& n) 
+vec3 random_vec_on_hemisphere(vec3& n, c_rng_t *rng) 
 {
-  vec3d p = random_unit_vec();
+  vec3 p = random_unit_vec(rng);
   if (p.dot(&n) > 0.0)
     return p;
   else
     return p * -1;
 }
 
-vec3d reflect(vec3d &v, vec3d &n) 
+vec3 reflect(vec3 &v, vec3 &n) 
 {
   return v - n * (2 * v.dot(&n));
 }
 
-vec3d refract(vec3d &d, vec3d &n, double refr) 
+vec3 refract(vec3 &d, vec3 &n, real_t refr) 
 {
-  double cosa = fmin((d * -1.).dot(&n), 1.0);
-  vec3d rpe = (d + (n * cosa)) * refr;
-  vec3d rpa = n * -sqrt(fabs(1 - rpe.dot(&rpe)));
+  real_t cosa = fmin((d * -1.).dot(&n), 1.0);
+  vec3 rpe = (d + (n * cosa)) * refr;
+  vec3 rpa = n * -sqrt(fabs(1 - rpe.dot(&rpe)));
   return rpe + rpa;
 }
 
-double reflect(double cosine, double i) 
+real_t reflect(real_t cosine, real_t i) 
 {
   /* Schlick's approximation for reflectance. */
-  double r0 = (1 - i) / (1 + i);
+  real_t r0 = (1 - i) / (1 + i);
   r0 = r0 * r0;
   return r0 + (1 - r0) * pow((1 - cosine), 5);
 }
 
-int intersect(c_ray_t ray, c_scene_t *scene, double *t, int *id)
+int closest_mesh(c_ray_t &r, c_scene_t *s, real_t tmin, real_t *t)
 {
-  double dt;
-  double inf=*t=1e20;
+  int id = -1;
+  if (!s->num_meshes) return -1;
 
-  for (int k = 0; k < scene->num_spheres; ++k) {
-    if ((dt = scene->spheres[k].intersect(ray)) && dt < *t) {
-      *t = dt;
-      *id = k;
-    }
+  c_ray_shear_t rs(r);
+  for (uint32_t i = 0; i < s->num_meshes; ++i) {
+    const c_mesh_t *m = &s->meshes[i];
+    auto visit = [&](uint32_t first, uint32_t count) {
+      STAT_ADD(tri_tests, count);
+      for (uint32_t k = first; k < first + count; ++k) {
+        uint32_t tri = m->bvh ? m->bvh->prims[k] : k;
+        if (tri_hit(rs, m, tri, tmin, *t, t)) id = m->first_id + tri;
+      }
+    };
+    if (m->bvh)
+      bvh_traverse(m->bvh, r, t, visit);
+    else
+      visit(0, m->nt);
   }
-  return *t < inf;
+  return id;
+}
+
+/* closest
+ *
+ * Scene id of the primitive closest to the origin of r within (tmin, *t),
+ * or -1. Both the BVH leaves and the flat scan of the spheres go through
+ * the SIMD kernel.
+ */
+int closest(c_ray_t &r, c_scene_t *s, real_t tmin, real_t *t)
+{
+  int k = -1;
+  c_ray_lanes_t rl(r);
+  auto visit = [&](uint32_t first, uint32_t count) {
+    int j = geom_closest(s->geom, rl, first, count, tmin, t);
+    if (j >= 0) k = j;
+  };
+
+  if (s->bvh)
+    bvh_traverse(s->bvh, r, t, visit);
+  else
+    visit(0, s->num_spheres);
+  int id = k < 0 ? -1 : (int) s->geom->id[k];
+  int m = closest_mesh(r, s, tmin, t);
+  return m < 0 ? id : m;
+}
+
+int intersect(c_ray_t ray, c_scene_t *scene, real_t *t, int *id)
+{
+  int k;
+  *t = 1e20;
+  if ((k = closest(ray, scene, 1e-4, t)) < 0) return 0;
+  *id = k;
+  return 1;
 }
 
 bool collide(c_ray_t r, c_scene_t *s, c_hit_t *h)
 {
-  c_hit_t dh;
-  bool found_hit = false;
-  double dt = 1e20;
-
-  for (int k = 0; k < s->num_spheres; ++k) {
-    if (s->spheres[k].hit(r, &dh, 0.001, dt)) {
-      found_hit = true;
-      dt     = dh.t;
-      dh.mat = s->spheres[k].material;
-      dh.col = s->spheres[k].color;
-      dh.ir  = s->spheres[k].ir;
-      *h     = dh;
-    }
-  }
-  return found_hit;
+  real_t t = 1e20;
+  int k = closest(r, s, 0.001, &t);
+  if (k < 0) return false;
+  /* material data is only fetched for the final hit */
+  scene_set_hit(s, k, r, t, h);
+  return true;
 }
 
-vec3d ray_color(c_ray_t r, c_scene_t *s, int depth, int max_depth)
+vec3 ray_color(c_ray_t r, c_scene_t *s, c_rng_t *rng, int depth, int max_depth, int rr_depth)
 {
   c_hit h;
-  vec3d nd;
-
-  if (++depth >= max_depth) return vec3d(0, 0, 0);
-
-  if (collide(r, s, &h)) {
-    if (h.mat == DIFF) {
-      nd = h.n + random_unit_vec();
-      if (nd.zero())
-        nd = h.n;
-    } else if (h.mat == REFL) {
-      vec3d urd = vec3d::unit(r.d);
-      nd = reflect(urd, h.n);
-    } else if (h.mat == REFR) {
-      double rr = h.ff ? (1.0/h.ir) : h.ir;
-      vec3d urd = vec3d::unit(r.d);
-
-      double c = fmin((urd * -1).dot(&h.n), 1.0);
-      double s = sqrt(1.0 - (c * c));
-
-      if ((rr * s > 1.0) || reflect(c, rr) > randd()) 
-        nd = reflect(urd, h.n);
-      else 
-        nd = refract(r.d, h.n, rr);
-    } else {
-      return vec3d(0, 0, 0);
+
+  if (++depth >= max_depth) return vec3(0, 0, 0);
+
+  if (collide(r, s, &h))
+    return scatter(r, &h, s, rng, depth, max_depth, rr_depth);
+  STAT_ADD(misses, 1);
+  return background();
+}
+
+vec3 background()
+{
+  /* vec3 ud = vec3::unit(r.d); */
+  /* double a = (ud.y + 1.0) * 0.5; */
+  /* return vec3(1.0, 1.0, 1.0) * (1.0 - a) + vec3(0.5, 0.7, 1.0) * a; */
+  return vec3(.15, .15, .15);
+}
+
+bool bounce(c_ray_t &r, c_hit_t *h, c_rng_t *rng, vec3 *nd)
+{
+  if (h->mat == DIFF) {
+    rng->seek(DIM_BSDF);
+    *nd = h->n + random_unit_vec(rng);
+    if (nd->zero())
+      *nd = h->n;
+  } else if (h->mat == REFL) {
+    vec3 urd = vec3::unit(r.d);
+    *nd = reflect(urd, h->n);
+  } else if (h->mat == REFR) {
+    real_t rr = h->ff ? (1.0/h->ir) : h->ir;
+    vec3 urd = vec3::unit(r.d);
+
+    real_t c = fmin((urd * -1).dot(&h->n), 1.0);
+    real_t s = sqrt(1.0 - (c * c));
+
+    rng->seek(DIM_FRESNEL);
+    if ((rr * s > 1.0) || reflect(c, rr) > randd(rng)) 
+      *nd = reflect(urd, h->n);
+    else 
+      *nd = refract(r.d, h->n, rr);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool roulette(vec3 *tp, c_rng_t *rng)
+{
+  real_t p = tp->x > tp->y && tp->x > tp->z ? tp->x : tp->y > tp->z ? tp->y : tp->z;
+
+  if (p >= RR_MAX_P) p = RR_MAX_P;
+  rng->seek(DIM_ROULETTE);
+  if (!(randd(rng) < p)) return false;
+  *tp = *tp / p;
+  return true;
+}
+
+vec3 scatter(c_ray_t &r, c_hit_t *h, c_scene_t *s, c_rng_t *rng, int depth, int max_depth, int rr_depth)
+{
+  c_ray_t ray = r;
+  c_hit_t hit = *h;
+  vec3 tp(1, 1, 1), nd;
+
+  /* iterative, the path throughput replaces the recursion */
+  for (;;) {
+    rng_bounce(rng, s, depth);
+    if (!bounce(ray, &hit, rng, &nd)) return vec3(0, 0, 0);
+    tp = tp.mul(&hit.col);
+    if (depth >= rr_depth && !roulette(&tp, rng)) return vec3(0, 0, 0);
+    if (++depth >= max_depth) return vec3(0, 0, 0);
+
+    ray = c_ray(hit.spawn(nd), nd);
+    STAT_ADD(rays_secondary, 1);
+    if (!collide(ray, s, &hit)) {
+      STAT_ADD(misses, 1);
+      vec3 bg = background();
+      return tp.mul(&bg);
     }
-    return ray_color(c_ray(h.o, nd), s, depth).mul(&h.col);
   }
-  /* vec3d ud = vec3d::unit(r.d); */
-  /* double a = (ud.y + 1.0) * 0.5; */
-  /* return vec3d(1.0, 1.0, 1.0) * (1.0 - a) + vec3d(0.5, 0.7, 1.0) * a; */
-  return vec3d(.15, .15, .15);
 }
 
-vec3d radiance(c_ray_t &r, c_scene_t *scene, int depth, unsigned short *Xi)
+vec3 cosine_dir(vec3 &w, c_rng_t *rng)
 {
-  int id = 0;
-  double t;
+  rng->seek(DIM_BSDF);
+  real_t r1  = 2 * M_PI * randd(rng), r2  = randd(rng), r2s = sqrt(r2); 
 
-  if (!intersect(r, scene, &t, &id)) return vec3d(0, 0, 0);
+  vec3 u = ((fabs(w.x) > .1 ? vec3(0,1) : vec3(1)).prod(&w)).norm(); 
+  vec3 v = w.prod(&u); 
 
-  c_sphere obj = scene->spheres[id]; 
-  vec3d c = obj.color;
-  double p = c.x > c.y && c.x > c.z ? c.x : c.y > c.z ? c.y : c.z;
+  return (u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1-r2)).norm(); 
+}
 
-  if (++depth > 5) {
-    if (erand48(Xi) < p)
-      c = c * (1 / p); 
-    else 
-      return obj.emission;
+/* Power heuristic weight of a sample with density a against density b. */
+static inline real_t mis_weight(real_t a, real_t b) { return a * a / (a * a + b * b); }
+
+/* light_pdf
+ *
+ * Solid angle density of a direction sampled uniformly in the cone that
+ * the light sphere l subtends from o, 0 if o is inside of it.
+ */
+real_t light_pdf(const c_sphere &l, const vec3 &o)
+{
+  vec3 wc = l.pos - o;
+  real_t d2 = wc.dot(&wc), s2 = l.radius * l.radius / d2;
+  if (s2 >= 1) return 0;
+  /* 1 - cos(max), without the cancellation for distant lights */
+  real_t omc = s2 / (1 + sqrt(1 - s2));
+  return 1 / (2 * M_PI * omc);
+}
+
+/* emission_mis
+ *
+ * Emission of h (hit by r) reached by sampling the BSDF with density pdf.
+ * Lights sampled by sample_lights() are weighted against that strategy,
+ * camera rays and other emitters (pdf 0) are not.
+ */
+vec3 emission_mis(const c_hit_t &h, int id, const c_ray_t &r, real_t pdf, c_scene_t *scene)
+{
+  if (pdf <= 0 || (uint32_t) id >= scene->num_spheres || !scene->num_lights) return h.e;
+  real_t lp = light_pdf(scene->spheres[id], r.o);
+  return lp > 0 ? h.e * mis_weight(pdf, lp) : h.e;
+}
+
+/* sample_lights
+ *
+ * Next event estimation at the diffuse hit h of primitive id: one
+ * direction in the cone of every light, a shadow ray, and the result
+ * weighted against cosine sampling of the BSDF.
+ */
+vec3 sample_lights(const c_hit_t &h, int id, c_scene_t *scene, c_rng_t *rng)
+{
+  vec3 l(0, 0, 0);
+  for (uint32_t i = 0; i < scene->num_lights; ++i) {
+    uint32_t li = scene->lights[i];
+    const c_sphere &ls = scene->spheres[li];
+    rng->seek(DIM_LIGHTS + 2 * i);
+    real_t u1 = randd(rng), u2 = randd(rng);
+    /* a sphere does not light itself, nor points inside of it */
+    real_t lp = light_pdf(ls, h.o);
+    if ((int) li == id || lp <= 0) continue;
+
+    vec3 wc = ls.pos - h.o;
+    real_t d = wc.len(), s2 = ls.radius * ls.radius / (d * d);
+    real_t omc = s2 / (1 + sqrt(1 - s2));
+    real_t ct = 1 - u1 * omc, st = sqrt(fmax(0., 1 - ct * ct)), phi = 2 * M_PI * u2;
+    vec3 w = wc / d;
+    vec3 u = ((fabs(w.x) > .1 ? vec3(0,1) : vec3(1)).prod(&w)).norm();
+    vec3 v = w.prod(&u);
+    vec3 nd = (u * (cos(phi) * st) + v * (sin(phi) * st) + w * ct).norm();
+    real_t cos_n = h.n.dot(&nd);
+    if (cos_n <= 0) continue;
+
+    c_ray_t sr(h.spawn(nd), nd);
+    real_t t = d;
+    STAT_ADD(rays_shadow, 1);
+    if (closest(sr, scene, 1e-4, &t) != (int) li) continue;
+    /* Le * (col / pi) * cos / pdf, weighted against the pdf cos / pi */
+    real_t bp = cos_n / M_PI;
+    vec3 f = h.col * (cos_n / M_PI / lp * mis_weight(lp, bp));
+    l = l + ls.emission.mul(&f);
   }
-  vec3d no = r.o + r.d * t; 
-  vec3d nn = (no - obj.pos).norm(); 
-  vec3d nl = nn.dot(&r.d) < 0 ? nn : nn * -1; 
+  return l;
+}
 
-  if (obj.material == DIFF) { 
-    /* DIFFUSE reflection */
-    double r1  = 2 * M_PI * erand48(Xi), r2  = erand48(Xi), r2s = sqrt(r2); 
+vec3 radiance(c_ray_t &r, c_scene_t *scene, int depth, c_rng_t *rng, real_t pdf)
+{
+  int id = 0;
+  real_t t;
 
-    vec3d w = nl; 
-    vec3d u = ((fabs(w.x) > .1 ? vec3d(0,1) : vec3d(1)).prod(&w)).norm(); 
-    vec3d v = w.prod(&u); 
+  if (!intersect(r, scene, &t, &id)) {
+    STAT_ADD(misses, 1);
+    return vec3(0, 0, 0);
+  }
+  return radiance_hit(r, t, id, scene, depth, rng, pdf);
+}
+
+vec3 radiance_hit(c_ray_t &r, real_t t, int id, c_scene_t *scene, int depth, c_rng_t *rng, real_t pdf)
+{
+  c_hit_t h;
+  scene_set_hit(scene, id, r, t, &h);
+  vec3 c = h.col;
+  real_t p = c.x > c.y && c.x > c.z ? c.x : c.y > c.z ? c.y : c.z;
+  vec3 e = emission_mis(h, id, r, pdf, scene);
 
-    vec3d nd = (u * cos(r1) * r2s + v * sin(r1) * r2s + w * sqrt(1-r2)).norm(); 
+  rng_bounce(rng, scene, ++depth);
+  if (depth > 5) {
+    rng->seek(DIM_ROULETTE);
+    if (randd(rng) < p)
+      c = c * (1 / p); 
+    else 
+      return e;
+  }
 
-    c_ray nray = c_ray(nl, nd);
+  if (h.mat == DIFF) { 
+    /* DIFFUSE reflection, h.n faces the incoming ray */
+    vec3 ld = scene->num_lights ? sample_lights(h, id, scene, rng) : vec3(0, 0, 0);
+    vec3 nd = cosine_dir(h.n, rng);
+    c_ray nray = c_ray(h.spawn(nd), nd);
+    STAT_ADD(rays_secondary, 1);
 
-    vec3d li = radiance(nray, scene, depth, Xi);
-    return obj.emission + obj.color.mul(&li);
-  } else if (obj.material == SPEC) 
+    vec3 li = radiance(nray, scene, depth, rng, h.n.dot(&nd) / M_PI);
+    return e + ld + h.col.mul(&li);
+  } else if (h.mat == SPEC) 
   { 
     /* SPECULAR reflection */
   } 
   /* dielectric REFRACTION */
-  bool into = nn.dot(&nl) > 0; // ray from outside going in?
-  return obj.emission;
+  return e;
 }
 
-void pt(uint32_t *img, uint32_t w, uint32_t h, c_scene_t *scene, cam_t *cam)
+void add_first_hit(c_film_t *film, c_scene_t *scene, uint32_t k, c_ray_t &r, real_t t, int id)
 {
-  int id = 0;
-  vec3d c;
-  double t;
-
-  for (int j = 0; j < h; ++j) {
-    fprintf(stderr,"\r(pt) Rendering (%d spp) %5.2f%%", cam->spp*4, 100.* j / (h-1));
-    for (int i = 0; i < w; ++i, c=vec3d(0, 0, 0)) {
-      for (int s= 0; s < cam->spp; ++s) {
-        unsigned short Xi[3]={0,0, 5*5*5};
-        c_ray r = cam->get_ray(i, j);
-        c = c + radiance(r, scene, 0, Xi);
-      }
-      c = c / cam->spp;
-      img[j*w + i] = C_RGBA(toInt(c.x), toInt(c.y), toInt(c.z), 255);
-    }
+  c_hit_t h;
+  if (film->id) film_set_id(film, k, id);
+  if (!film->feat) return;
+  if (id < 0) {
+    film_add_features(film, k, vec3(0, 0, 0), vec3(0, 0, 0), 0);
+    return;
   }
+  scene_set_hit(scene, id, r, t, &h);
+  film_add_features(film, k, h.col, h.n, t);
 }
 
-void rt(uint32_t *img, uint32_t w, uint32_t h, c_scene_t *scene, cam_t *cam, int maxd)
+void add_cost(c_film_t *film, const uint32_t *pix, uint32_t n, double t)
 {
-  vec3d c;
-  c_ray_t r = c_ray(vec3d(0, 0, 0), vec3d(0, 0, 0));
+  for (uint32_t k = 0; k < n; ++k) film->cost[pix[k]] += t / n;
+}
 
-#if MT
-  std::vector<uint32_t> hi(h);
-  std::iota(hi.begin(), hi.end(), 0);
+/* render_packets
+ *
+ * Renders the samples [s0, s1) of the tile [x0, x1) x [y0, y1) in
+ * PACKET_DIM x PACKET_DIM blocks: the primary rays of a block are traced
+ * together for every sample and shade(r, t, id, rng) continues each path
+ * from its first hit (id < 0 for a miss) with single rays. Samples reach
+ * the film in the same order as in the per pixel loop, so both produce the
+ * same image.
+ */
+template <typename F>
+static void render_packets(c_state_t *st, c_scene_t *scene, cam_t *cam, real_t tmin, uint32_t s0, uint32_t s1,
+                           uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, F shade)
+{
+  c_packet_t p;
+  const c_film_t *f = st->film;
+  uint32_t w = st->w;
+
+  for (uint32_t py = y0; py < y1; py += PACKET_DIM) {
+    for (uint32_t px = x0; px < x1; px += PACKET_DIM) {
+      uint32_t pw = px + PACKET_DIM < x1 ? PACKET_DIM : x1 - px;
+      uint32_t ph = py + PACKET_DIM < y1 ? PACKET_DIM : y1 - py;
+      uint32_t pix[PACKET_SIZE];
 
-  std::for_each(std::execution::par, std::begin(hi), std::end(hi), 
-    [&](uint32_t j) 
-    {
-      for (int i = 0; i < w; ++i, c=vec3d(0, 0, 0)) {
-        for (int s = 0; s < cam->spp; ++s) {
-          r = cam->get_ray(i, j);
-          c = c + ray_color(r, scene, 0, maxd);
+      p.n = 0;
+      for (uint32_t k = 0; k < pw * ph; ++k) {
+        uint32_t i = px + k % pw, j = py + k / pw;
+        if (pixel_active(st, film_index(f, i, j))) pix[p.n++] = film_index(f, i, j);
+      }
+      if (!p.n) continue;
+
+      double t0 = st->film->cost ? omp_get_wtime() : 0;
+      for (uint32_t s = s0; s < s1; ++s) {
+        /* the streams are consumed by the camera first, then by shading */
+        c_rng_t rng[PACKET_SIZE];
+        c_ray_t r[PACKET_SIZE];
+        for (uint32_t k = 0; k < p.n; ++k) {
+          uint32_t i = f->x0 + pix[k] % f->w, j = f->y0 + pix[k] / f->w;
+          rng[k] = c_rng_t(st->seed, j*w + i, s, st->sampler);
+          r[k] = cam->get_ray(i, j, &rng[k]);
+          p.set(k, r[k]);
+        }
+        packet_trace(&p, scene, tmin);
+        for (uint32_t k = 0; k < p.n; ++k) {
+          int id = p.k[k] < 0 ? -1 : (int) scene->geom->id[(int) p.k[k]];
+          /* packets only cover the spheres */
+          real_t t = p.t[k];
+          int m = closest_mesh(r[k], scene, tmin, &t);
+          if (m >= 0) id = m;
+          if (id < 0) STAT_ADD(misses, 1);
+          if (st->film->feat || st->film->id) add_first_hit(st->film, scene, pix[k], r[k], t, id);
+          STAT_PATH_BEGIN();
+          film_add(st->film, pix[k], shade(r[k], t, id, &rng[k]));
+          STAT_PATH_END();
         }
-        c = c / cam->spp;
-        img[j*w + i] = C_RGBA(toInt(c.x), toInt(c.y), toInt(c.z), 255);
       }
-    });
-#else
-  for (int j = 0; j < h; ++j) {
-    fprintf(stderr,"\r(rt) Rendering %5.2f%%", 100.* j / (h-1));
-    for (int i = 0; i < w; ++i, c=vec3d(0, 0, 0)) {
-      for (int s = 0; s < cam->spp; ++s) {
-        r = cam->get_ray(i, j);
-        c = c + ray_color(r, scene, 0, maxd);
+      /* the pixels of a packet share its time */
+      if (st->film->cost) add_cost(st->film, pix, p.n, omp_get_wtime() - t0);
+    }
+  }
+}
+
+/* render_pixels
+ *
+ * Scalar counterpart of render_packets(): traces the camera ray of every
+ * pixel and sample on its own and hands its first hit to shade().
+ */
+template <typename F>
+static void render_pixels(c_state_t *st, c_scene_t *scene, cam_t *cam, real_t tmin, uint32_t s0, uint32_t s1,
+                          uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1, F shade)
+{
+  uint32_t w = st->w;
+
+  for (uint32_t j = y0; j < y1; ++j) {
+    for (uint32_t i = x0; i < x1; ++i) {
+      uint32_t k = film_index(st->film, i, j);
+      if (!pixel_active(st, k)) continue;
+      double t0 = st->film->cost ? omp_get_wtime() : 0;
+      for (uint32_t s = s0; s < s1; ++s) {
+        c_rng_t rng(st->seed, j*w + i, s, st->sampler);
+        c_ray_t r = cam->get_ray(i, j, &rng);
+        real_t t = 1e20;
+        int id = closest(r, scene, tmin, &t);
+        if (id < 0) STAT_ADD(misses, 1);
+        if (st->film->feat || st->film->id) add_first_hit(st->film, scene, k, r, t, id);
+        STAT_PATH_BEGIN();
+        film_add(st->film, k, shade(r, t, id, &rng));
+        STAT_PATH_END();
+      }
+      if (st->film->cost) st->film->cost[k] += omp_get_wtime() - t0;
+    }
+  }
+}
+
+void pt(c_state_t *st, c_scene_t *scene, cam_t *cam, uint32_t s0, uint32_t s1)
+{
+  auto shade = [&](c_ray_t &r, real_t t, int id, c_rng_t *rng) {
+    return id < 0 ? vec3(0, 0, 0) : radiance_hit(r, t, id, scene, 0, rng);
+  };
+
+  const c_film_t *f = st->film;
+  render_tiles(f->x0, f->y0, f->x0 + f->w, f->y0 + f->h, st->threads, "(pt)", st->deadline,
+               [&](uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    if (st->packet)
+      render_packets(st, scene, cam, 1e-4, s0, s1, x0, y0, x1, y1, shade);
+    else
+      render_pixels(st, scene, cam, 1e-4, s0, s1, x0, y0, x1, y1, shade);
+  });
+}
+
+void rt(c_state_t *st, c_scene_t *scene, cam_t *cam, uint32_t s0, uint32_t s1)
+{
+  auto shade = [&](c_ray_t &r, real_t t, int id, c_rng_t *rng) {
+    c_hit_t h;
+    /* ray_color() gives up before the first hit if maxd <= 1 */
+    if (st->maxd <= 1) return vec3(0, 0, 0);
+    if (id < 0) return background();
+    scene_set_hit(scene, id, r, t, &h);
+    return scatter(r, &h, scene, rng, 1, st->maxd, st->rrd);
+  };
+
+  const c_film_t *f = st->film;
+  render_tiles(f->x0, f->y0, f->x0 + f->w, f->y0 + f->h, st->threads, "(rt)", st->deadline,
+               [&](uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    if (st->packet)
+      render_packets(st, scene, cam, 0.001, s0, s1, x0, y0, x1, y1, shade);
+    else
+      render_pixels(st, scene, cam, 0.001, s0, s1, x0, y0, x1, y1, shade);
+  });
+}
+
+/* Set by SIGINT and SIGTERM while a render keeps checkpoints. */
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int)
+{
+  stop_requested = 1;
+}
+
+static void checkpoint(c_state_t *st)
+{
+  double t = omp_get_wtime();
+  if (film_save(st->film, st->w, st->h, st->seed, st->resume) < 0)
+    fprintf(stderr, "\nWARNING: could not write the checkpoint %s\n", st->resume);
+  else
+    fprintf(stderr, "\nCheckpoint of %u spp saved in %.1f ms\n", st->film->s1, (omp_get_wtime() - t) * 1e3);
+}
+
+void render(c_state_t *st, c_scene_t *scene, cam_t *cam)
+{
+  c_film_t *f = st->film;
+  /* -sample-range renders the samples [s0, s1) only, a resumed film has some */
+  uint32_t spp = st->s1 ? st->s1 : cam->spp, s = f->s1;
+  bool budget = st->time_ms || st->noise > 0;
+  /* checkpoints are taken between passes */
+  uint32_t pass = st->pass ? st->pass : budget || st->resume ? 4 : spp;
+  double t0 = omp_get_wtime(), saved = t0;
+  uint32_t saved_s = s;
+
+  if (st->resume) {
+    stop_requested = 0;
+    signal(SIGINT, request_stop);
+    signal(SIGTERM, request_stop);
+  }
+
+  if (st->pt) fprintf(stderr, "(pt) %d spp\n", spp*4);
+
+  st->deadline = 0;
+  while (s < spp) {
+    /* a first single sample pass ignores the deadline, so there always is an image */
+    uint32_t n = st->time_ms && s == f->s0 ? 1 : pass;
+    if (n > spp - s) n = spp - s;
+
+    if (st->wavefront) wavefront(st, scene, cam, s, s + n);
+    else if (st->pt) pt(st, scene, cam, s, s + n);
+    else rt(st, scene, cam, s, s + n);
+    s += n;
+    f->s1 = s;
+    if (st->resume && (stop_requested || omp_get_wtime() - saved >= CHECKPOINT_INTERVAL)) {
+      checkpoint(st);
+      saved = omp_get_wtime();
+      saved_s = s;
+    }
+    if (stop_requested) break;
+
+    if (budget) {
+      double noise = film_noise(st->film), t = omp_get_wtime() - t0;
+      fprintf(stderr, "\n%u spp, noise %.4f, %.0f ms", s, noise, t * 1e3);
+      if (st->adaptive) {
+        uint32_t active = film_active_count(st->film, st->noise, ADAPTIVE_MIN_SPP);
+        fprintf(stderr, ", %u pixels active", active);
+        if (!active) break;
+      } else if (st->noise > 0 && noise <= st->noise) {
+        break;
       }
-      c = c / cam->spp;
-      img[j*w + i] = C_RGBA(toInt(c.x), toInt(c.y), toInt(c.z), 255);
+      fputc('\n', stderr);
+      if (st->time_ms && t * 1e3 >= st->time_ms) break;
+    }
+    if (st->time_ms) st->deadline = t0 + st->time_ms * 1e-3;
+  }
+  if (st->resume) {
+    if (saved_s != s) checkpoint(st);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+  }
+  fprintf(stderr, "\nRendered in %.1f ms\n", (omp_get_wtime() - t0) * 1e3);
+  if (st->adaptive) film_report(st->film, stderr);
+
+  if (st->denoise) {
+    double t = omp_get_wtime();
+    free(f->rgb);
+    f->rgb = (float *) malloc(3 * (size_t) st->w * st->h * sizeof(float));
+    if (!f->rgb || film_denoise(f, DENOISE_ITERATIONS, f->rgb) < 0) {
+      fprintf(stderr, "WARNING: not enough memory to denoise.\n");
+      free(f->rgb);
+      f->rgb = NULL;
+    } else {
+      fprintf(stderr, "Denoised in %.1f ms\n", (omp_get_wtime() - t) * 1e3);
     }
   }
-#endif
+  /* float outputs are written from the film itself */
+  if (!st->im_buffer) return;
+  c_tonemap_t tm;
+  tm.op = (c_tonemap_op_t) st->tonemap;
+  tm.exposure = st->exposure;
+  film_resolve(st->film, st->im_buffer, &tm);
 }
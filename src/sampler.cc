@@ -0,0 +1,316 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include <algorithm>
+
+#include "sampler.h"
+
+/* Halton dimensions before the bases repeat (with other scrambles). */
+#define HALTON_DIMS         64
+
+int sampler_type(const char *name)
+{
+  if (!strcmp(name, "independent")) return SAMPLER_INDEPENDENT;
+  if (!strcmp(name, "sobol"))       return SAMPLER_SOBOL;
+  if (!strcmp(name, "halton"))      return SAMPLER_HALTON;
+  if (!strcmp(name, "bluenoise"))   return SAMPLER_BLUENOISE;
+  return -1;
+}
+
+static inline uint32_t hash2(uint32_t a, uint32_t b) { return (uint32_t) mix64(((uint64_t) a << 32) | b); }
+
+/* Cheap 32 bit hash (lowbias32 of Wellons), for the seeds derived from an
+ * already random one. */
+static inline uint32_t hash32(uint32_t x)
+{
+  x ^= x >> 16; x *= 0x7feb352du;
+  x ^= x >> 15; x *= 0x846ca68bu;
+  return x ^ (x >> 16);
+}
+
+static inline uint32_t reverse_bits(uint32_t x)
+{
+  x = (x << 16) | (x >> 16);
+  x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+  x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+  x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+  x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+  return x;
+}
+
+/* Generator matrices of the first four Sobol dimensions (Joe and Kuo),
+ * as the direction numbers of the 32 index bits, and the xor of the
+ * directions of every byte of the index. The tables take and give the
+ * bits reversed, as the scrambling works on them, and the shuffled index
+ * has all its bits set, so sobol4 takes four lookups instead of 32 steps. */
+static const struct sobol_dirs {
+  uint32_t v[4][32];
+  uint32_t bytes[4][4][256];
+  sobol_dirs() {
+    /* degree s, coefficients a and initial m of the primitive polynomials */
+    static const uint32_t deg[3] = { 1, 2, 3 }, coef[3] = { 0, 1, 1 };
+    static const uint32_t m[3][3] = { { 1 }, { 1, 3 }, { 1, 3, 1 } };
+    for (int i = 0; i < 32; ++i) v[0][i] = 1u << (31 - i);
+    for (int d = 1; d < 4; ++d) {
+      uint32_t s = deg[d - 1], a = coef[d - 1], *x = v[d];
+      for (uint32_t i = 0; i < 32; ++i) {
+        if (i < s) {
+          x[i] = m[d - 1][i] << (31 - i);
+          continue;
+        }
+        x[i] = x[i - s] ^ (x[i - s] >> s);
+        for (uint32_t k = 1; k < s; ++k)
+          if ((a >> (s - 1 - k)) & 1) x[i] ^= x[i - k];
+      }
+    }
+    /* bit i of byte k of the reversed index is bit 31 - 8k - i of it */
+    for (int d = 0; d < 4; ++d)
+      for (int k = 0; k < 4; ++k)
+        for (uint32_t b = 0; b < 256; ++b) {
+          uint32_t x = 0;
+          for (int i = 0; i < 8; ++i)
+            if ((b >> i) & 1) x ^= v[d][31 - 8 * k - i];
+          bytes[d][k][b] = reverse_bits(x);
+        }
+  }
+} sobol;
+
+/* Dimension d of the Sobol point of the index with reversed bits r, with
+ * its bits reversed. */
+static inline uint32_t sobol4(uint32_t r, uint32_t d)
+{
+  const uint32_t (*t)[256] = sobol.bytes[d];
+  return t[0][r & 0xFF] ^ t[1][(r >> 8) & 0xFF] ^ t[2][(r >> 16) & 0xFF] ^ t[3][r >> 24];
+}
+
+/* laine_karras
+ *
+ * Owen scrambling of the reversed bits x with the hash of Laine and
+ * Karras, as improved by Burley: every bit is flipped depending on the
+ * bits below it, which are the ones above it unreversed.
+ */
+static inline uint32_t laine_karras(uint32_t x, uint32_t seed)
+{
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+/* Dimension dim of sample of the Owen scrambled Sobol sequence of seed. The
+ * sample order is shuffled for every group of four dimensions, which
+ * decorrelates the groups. Between the scrambles the bits stay reversed. */
+static inline uint32_t sobol_owen(uint32_t sample, uint32_t dim, uint32_t seed)
+{
+  uint32_t gs = hash2(seed, dim >> 2);
+  uint32_t index = laine_karras(reverse_bits(sample), gs);
+  return reverse_bits(laine_karras(sobol4(index, dim & 3), hash32(gs + (dim & 3))));
+}
+
+static const struct primes {
+  uint32_t p[HALTON_DIMS];
+  primes() {
+    uint32_t n = 0;
+    for (uint32_t c = 2; n < HALTON_DIMS; ++c) {
+      bool prime = true;
+      for (uint32_t k = 0; k < n && p[k] * p[k] <= c; ++k) prime &= c % p[k] != 0;
+      if (prime) p[n++] = c;
+    }
+  }
+} halton_bases;
+
+/* Random permutation p of [0, l) applied to i (Kensler 2013), cycle
+ * walking over the next power of two. */
+static inline uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+{
+  uint32_t w = l - 1;
+  w |= w >> 1; w |= w >> 2; w |= w >> 4; w |= w >> 8; w |= w >> 16;
+  do {
+    i ^= p; i *= 0xe170893d; i ^= p >> 16; i ^= (i & w) >> 4;
+    i ^= p >> 8; i *= 0x0929eb3f; i ^= p >> 23; i ^= (i & w) >> 1;
+    i *= 1 | p >> 27; i *= 0x6935fa69; i ^= (i & w) >> 11; i *= 0x74dcb303;
+    i ^= (i & w) >> 2; i *= 0x9e501cc3; i ^= (i & w) >> 2; i *= 0xc860a3df;
+    i &= w; i ^= i >> 5;
+  } while (i >= l);
+  return (i + p) % l;
+}
+
+/* halton
+ *
+ * Radical inverse of index in base with nested random digit permutations:
+ * the permutation of a digit is a hash of seed and the digits before it,
+ * an Owen scramble in base b. A shift would keep the first samples in
+ * neighbouring strata of the large bases. The digits are exact as long as
+ * index or last, the largest index, has digits left, which stratifies all
+ * the samples. Beyond them only permuted zeros are left, which add up to
+ * a uniform offset within the last interval.
+ */
+static inline uint32_t halton(uint32_t index, uint32_t base, uint32_t seed, uint32_t last)
+{
+  double inv = 1. / base, f = inv, r = 0;
+  uint32_t h = seed;
+  for (; (index || last) && f > 0x1p-32; last /= base) {
+    uint32_t d = index % base;
+    index /= base;
+    r += permute(d, base, h) * f;
+    h = hash32(h + d);
+    f *= inv;
+  }
+  r += h * 0x1p-32 * f * base;
+  return (uint32_t) std::min(r * 0x1p32, 0xFFFFFFFF.p0);
+}
+
+/* c_blue_noise
+ *
+ * Ranks of the pixels of a tileable BLUE_NOISE_SIZE^2 blue noise mask,
+ * made by the void and cluster method (Ulichney 1993) with a toroidal
+ * Gaussian filter.
+ */
+typedef struct c_blue_noise {
+  uint16_t rank[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+} c_blue_noise_t;
+
+#define BN_N                (BLUE_NOISE_SIZE * BLUE_NOISE_SIZE)
+#define BN_SIGMA            1.5
+
+static void bn_toggle(const double *kernel, double *energy, bool *on, uint32_t p)
+{
+  double sign = on[p] ? -1 : 1;
+  on[p] = !on[p];
+  uint32_t px = p % BLUE_NOISE_SIZE, py = p / BLUE_NOISE_SIZE;
+  for (uint32_t q = 0; q < BN_N; ++q) {
+    uint32_t dx = (q % BLUE_NOISE_SIZE - px) & (BLUE_NOISE_SIZE - 1);
+    uint32_t dy = (q / BLUE_NOISE_SIZE - py) & (BLUE_NOISE_SIZE - 1);
+    energy[q] += sign * kernel[dy * BLUE_NOISE_SIZE + dx];
+  }
+}
+
+/* Pixel of highest energy that is on (tightest cluster), or of lowest
+ * energy that is off (largest void). */
+static uint32_t bn_find(const double *energy, const bool *on, bool cluster)
+{
+  uint32_t best = 0;
+  double e = cluster ? -1e30 : 1e30;
+  for (uint32_t q = 0; q < BN_N; ++q) {
+    if (on[q] != cluster) continue;
+    if (cluster ? energy[q] > e : energy[q] < e) {
+      e = energy[q];
+      best = q;
+    }
+  }
+  return best;
+}
+
+static const c_blue_noise_t *blue_noise()
+{
+  static c_blue_noise_t *bn = []() {
+    c_blue_noise_t *b = (c_blue_noise_t *) malloc(sizeof(c_blue_noise_t));
+    double *kernel = (double *) malloc(3 * BN_N * sizeof(double));
+    bool *on = (bool *) calloc(2 * BN_N, sizeof(bool));
+    if (!b || !kernel || !on) {
+      perror("Unable to allocate memory for the blue noise mask.");
+      exit(1);
+    }
+    double *energy = kernel + BN_N, *energy0 = kernel + 2 * BN_N;
+    bool *on0 = on + BN_N;
+    for (uint32_t q = 0; q < BN_N; ++q) {
+      int dx = q % BLUE_NOISE_SIZE, dy = q / BLUE_NOISE_SIZE;
+      dx = std::min(dx, BLUE_NOISE_SIZE - dx);
+      dy = std::min(dy, BLUE_NOISE_SIZE - dy);
+      kernel[q] = exp(-(dx * dx + dy * dy) / (2 * BN_SIGMA * BN_SIGMA));
+      energy[q] = 0;
+    }
+
+    /* initial pattern of a tenth of the pixels, relaxed until moving the
+     * tightest cluster to the largest void does not change it */
+    c_rng_t rng(0, 0xFFFFFFFF, 1);
+    uint32_t ones = 0;
+    while (ones < BN_N / 10) {
+      uint32_t p = rng.next() % BN_N;
+      if (!on[p]) bn_toggle(kernel, energy, on, p), ++ones;
+    }
+    for (uint32_t it = 0; it < BN_N; ++it) {
+      uint32_t c = bn_find(energy, on, true);
+      bn_toggle(kernel, energy, on, c);
+      uint32_t v = bn_find(energy, on, false);
+      bn_toggle(kernel, energy, on, v);
+      if (v == c) break;
+    }
+    memcpy(on0, on, BN_N * sizeof(bool));
+    memcpy(energy0, energy, BN_N * sizeof(double));
+
+    /* the initial pixels are ranked by removing the tightest clusters, the
+     * others by filling the largest voids */
+    for (uint32_t r = ones; r-- > 0;) {
+      uint32_t c = bn_find(energy, on, true);
+      bn_toggle(kernel, energy, on, c);
+      b->rank[c] = r;
+    }
+    for (uint32_t r = ones; r < BN_N; ++r) {
+      uint32_t v = bn_find(energy0, on0, false);
+      bn_toggle(kernel, energy0, on0, v);
+      b->rank[v] = r;
+    }
+    free(kernel);
+    free(on);
+    return b;
+  }();
+  return bn;
+}
+
+void sampler_init(c_sampler_t *s, c_sampler_type_t type, uint32_t w, uint32_t spp)
+{
+  s->type = type;
+  s->w = w;
+  s->spp = spp;
+  if (type == SAMPLER_BLUENOISE) blue_noise();
+}
+
+uint64_t sampler_next(const struct c_rng *rng, uint64_t r)
+{
+  const c_sampler_t *s = rng->sampler;
+  uint32_t seed = rng->seed, pixel = rng->pixel, sample = rng->sample, dim = rng->dim - 1, u;
+  switch (s->type) {
+    case SAMPLER_SOBOL:
+      u = sobol_owen(sample, dim, rng->scramble);
+      break;
+    case SAMPLER_HALTON:
+      u = halton(sample, halton_bases.p[dim % HALTON_DIMS], hash2(rng->scramble, dim), s->spp - 1);
+      break;
+    case SAMPLER_BLUENOISE: {
+      /* the mask is shifted by a hash of the dimension, a toroidal offset
+       * of 2^32 rotates the sequence */
+      uint32_t o = hash2(seed, dim), x = pixel % s->w, y = pixel / s->w;
+      x = (x + o) & (BLUE_NOISE_SIZE - 1);
+      y = (y + (o >> 16)) & (BLUE_NOISE_SIZE - 1);
+      uint32_t rank = blue_noise()->rank[y * BLUE_NOISE_SIZE + x];
+      u = sobol_owen(sample, dim, hash2(seed, 0xFFFFFFFF)) + (uint32_t) ((rank + .5) * (0x1p32 / BN_N));
+      break;
+    }
+    default:
+      return r;
+  }
+  return (uint64_t) u << 32 | (r & 0xFFFFFFFF);
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include "scene.h"
+#include "bvh.h"
+#include "geom.h"
+#include "mesh.h"
+
+
+/* Builds the BVH over the triangles of m, boxes are padded by the rounding
+ * error like the spheres. */
+static c_bvh_t *mesh_bvh(const c_mesh_t *m)
+{
+  c_aabb_t *pb = (c_aabb_t *) malloc(m->nt * sizeof(c_aabb_t));
+  vec3 *pc = (vec3 *) malloc(m->nt * sizeof(vec3));
+  if (!pb || !pc) {
+    perror("Unable to allocate memory for the BVH.");
+    exit(1);
+  }
+
+#pragma omp parallel for
+  for (uint32_t k = 0; k < m->nt; ++k) {
+    c_aabb_t b;
+    for (int i = 0; i < 3; ++i) {
+      const float *p = m->v + 3 * m->idx[3*k + i];
+      b.grow(vec3(p[0], p[1], p[2]));
+    }
+    real_t e = HIT_EPS_ULPS * std::numeric_limits<real_t>::epsilon() * maxr(b.lo.amax(), b.hi.amax());
+    pb[k].lo = b.lo - vec3(e, e, e);
+    pb[k].hi = b.hi + vec3(e, e, e);
+    pc[k] = (b.lo + b.hi) * 0.5;
+  }
+  /* triangles are tested one at a time */
+  c_bvh_t *bvh = bvh_build(pb, pc, m->nt, 1);
+  free(pb);
+  free(pc);
+  return bvh;
+}
+
+void scene_init(c_scene_t *s, int use_bvh)
+{
+#ifdef CARBON_FLOAT
+  /* the SIMD tests carry sphere indices in float lanes, exact up to 2^24 */
+  if (s->num_spheres > 1u << 24) {
+    fprintf(stderr, "ERROR: %u spheres, a float build renders at most %u.\n", s->num_spheres, 1u << 24);
+    exit(1);
+  }
+#endif
+  if (use_bvh) {
+    s->bvh = bvh_build(s->spheres, s->num_spheres);
+    fprintf(stderr, "BVH: %u spheres, %u nodes, built in %.2f ms\n",
+            s->num_spheres, s->bvh->num_nodes, s->bvh->build_ms);
+  }
+  /* leaves reference contiguous ranges of the arrays */
+  s->geom = geom_build(s->spheres, s->bvh ? s->bvh->prims : NULL, s->num_spheres);
+
+  s->num_lights = 0;
+  for (uint32_t k = 0; k < s->num_spheres; ++k) s->num_lights += s->spheres[k].emission.amax() > 0;
+  s->lights = (uint32_t *) malloc((s->num_lights + 1) * sizeof(uint32_t));
+  if (!s->lights) {
+    perror("Unable to allocate memory for the lights.");
+    exit(1);
+  }
+  for (uint32_t k = 0, n = 0; k < s->num_spheres; ++k)
+    if (s->spheres[k].emission.amax() > 0) s->lights[n++] = k;
+
+  uint32_t id = s->num_spheres;
+  for (uint32_t i = 0; i < s->num_meshes; ++i) {
+    c_mesh_t *m = &s->meshes[i];
+    m->first_id = id;
+    id += m->nt;
+    if (!use_bvh) continue;
+    m->bvh = mesh_bvh(m);
+    double mb = mesh_bytes(m) / (1024. * 1024.);
+    fprintf(stderr, "BVH: %u triangles, %u nodes, built in %.2f ms, %.1f MB (%.1f MB per 1M triangles)\n",
+            m->nt, m->bvh->num_nodes, m->bvh->build_ms, mb, m->nt ? mb * 1e6 / m->nt : 0.);
+  }
+}
+
+void scene_refit(c_scene_t *s)
+{
+  if (s->bvh) bvh_refit(s->bvh, s->spheres);
+  geom_update(s->geom, s->spheres);
+}
+
+void scene_free(c_scene_t *s)
+{
+  bvh_free(s->bvh);
+  geom_free(s->geom);
+  free(s->lights);
+  s->bvh = NULL;
+  s->geom = NULL;
+  s->lights = NULL;
+  s->num_lights = 0;
+  for (uint32_t i = 0; i < s->num_meshes; ++i) {
+    bvh_free(s->meshes[i].bvh);
+    s->meshes[i].bvh = NULL;
+  }
+}
+
+/* Mesh owning scene id, which must be a triangle. */
+static const c_mesh_t *id_mesh(const c_scene_t *s, int id)
+{
+  uint32_t i = 0;
+  while (i + 1 < s->num_meshes && (uint32_t) id >= s->meshes[i + 1].first_id) ++i;
+  return &s->meshes[i];
+}
+
+void scene_set_hit(const c_scene_t *s, int id, c_ray_t &r, real_t t, c_hit_t *h)
+{
+  if ((uint32_t) id < s->num_spheres) {
+    s->spheres[id].set_hit(r, t, h);
+    return;
+  }
+  const c_mesh_t *m = id_mesh(s, id);
+  vec3 on = tri_normal(m, id - m->first_id).norm();
+
+  h->t = t;
+  h->o = r.o + r.d * t;
+  h->eps = HIT_EPS_ULPS * std::numeric_limits<real_t>::epsilon() * (h->o.amax() + r.o.amax());
+  h->set_ff_n(r, on);
+  h->mat = m->material;
+  h->col = m->color;
+  h->e   = m->emission;
+  h->ir  = m->ir;
+}
+
+c_material_t scene_material(const c_scene_t *s, int id)
+{
+  if ((uint32_t) id < s->num_spheres) return s->spheres[id].material;
+  return id_mesh(s, id)->material;
+}
@@ -0,0 +1,395 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include <sys/mman.h>
+#include <vector>
+
+#include "scenefile.h"
+#include "mesh.h"
+
+static const char *material_names[] = { "diff", "refl", "spec", "refr" };
+static_assert(sizeof(material_names) / sizeof(material_names[0]) == NUM_MATERIALS, "material names");
+
+/* Longest line of the text format in tokens. */
+#define SCENE_MAX_TOKENS    24
+
+static int parse_material(const char *t, c_material_t *m)
+{
+  for (int k = 0; k < NUM_MATERIALS; ++k) {
+    if (!strcmp(t, material_names[k])) {
+      *m = (c_material_t) k;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Shortest number that reads back as the same real_t. */
+static void put_num(FILE *f, real_t d)
+{
+  char b[32];
+  for (int p = 6; p <= 17; ++p) {
+    snprintf(b, sizeof(b), "%.*g", p, (double) d);
+    if ((real_t) strtod(b, NULL) == d) break;
+  }
+  fprintf(f, " %s", b);
+}
+
+static void put_vec(FILE *f, const vec3 &v) { put_num(f, v.x); put_num(f, v.y); put_num(f, v.z); }
+
+int scene_parse(c_scene_t *s, cam_t *cam, const char *text, size_t len, const char *name)
+{
+  std::vector<c_sphere> spheres;
+  const char *p = text, *end = text + len;
+  char line[1024], *t[SCENE_MAX_TOKENS];
+
+  for (uint32_t ln = 1; p < end; ++ln) {
+    int nt = split_line(&p, end, line, sizeof(line), t, SCENE_MAX_TOKENS);
+    if (!nt) continue;
+
+    double r, ir = 1, vfov;
+    vec3 col, em;
+    c_material_t mat = DIFF;
+    int ok;
+    if (!strcmp(t[0], "camera")) {
+      ok = nt == 11 && parse_vec(t + 1, &cam->origin) && parse_vec(t + 4, &cam->refp) &&
+           parse_vec(t + 7, &cam->vup) && parse_num(t[10], &vfov);
+      if (ok) cam->vfov = vfov;
+    } else if (!strcmp(t[0], "sphere")) {
+      c_sphere sp;
+      ok = nt == 13 && parse_num(t[1], &r) && parse_vec(t + 2, &sp.pos) && parse_vec(t + 5, &sp.color) &&
+           parse_vec(t + 8, &sp.emission) && parse_num(t[11], &ir) && parse_material(t[12], &sp.material);
+      sp.radius = r;
+      sp.ir = ir;
+      if (ok) spheres.push_back(sp);
+    } else if (!strcmp(t[0], "mesh")) {
+      /* the material is optional and replaces the one of the file */
+      ok = nt == 2 || (nt == 10 && parse_vec(t + 2, &col) && parse_vec(t + 5, &em) &&
+                       parse_num(t[8], &ir) && parse_material(t[9], &mat));
+      if (ok) {
+        if (scene_add_mesh(s, t[1]) < 0) return -1;
+        if (nt == 10) {
+          c_mesh_t *m = &s->meshes[s->num_meshes - 1];
+          m->color = col;
+          m->emission = em;
+          m->ir = ir;
+          m->material = mat;
+        }
+      }
+    } else {
+      ok = 0;
+    }
+    if (!ok) {
+      fprintf(stderr, "ERROR: %s:%d: malformed %s line.\n", name, ln, t[0]);
+      return -1;
+    }
+  }
+
+  c_sphere *sp = scene_add_spheres(s, spheres.size());
+  if (!sp) return -1;
+  std::copy(spheres.begin(), spheres.end(), sp);
+  return 0;
+}
+
+/* True if all n spheres of a binary scene have a known material. */
+template <typename T>
+static bool check_spheres(const void *src, uint32_t n)
+{
+  const c_sphere_<T> *sp = (const c_sphere_<T> *) src;
+  for (uint32_t k = 0; k < n; ++k)
+    if ((uint32_t) sp[k].material >= (uint32_t) NUM_MATERIALS) return false;
+  return true;
+}
+
+/* Converts the spheres of a binary scene written with another real_t. */
+template <typename T>
+static void convert_spheres(c_sphere *dst, const void *src, uint32_t n)
+{
+  const c_sphere_<T> *sp = (const c_sphere_<T> *) src;
+  for (uint32_t k = 0; k < n; ++k) {
+    dst[k].radius   = sp[k].radius;
+    dst[k].pos      = vec3(sp[k].pos);
+    dst[k].color    = vec3(sp[k].color);
+    dst[k].emission = vec3(sp[k].emission);
+    dst[k].ir       = sp[k].ir;
+    dst[k].material = sp[k].material;
+  }
+}
+
+static int scene_load_bin(c_scene_t *s, cam_t *cam, const char *path)
+{
+  size_t size = 0;
+  /* writable (copy on write) as the scene owns its spheres */
+  void *p = map_file(path, &size, 1);
+  if (!p) {
+    fprintf(stderr, "ERROR: unable to map %s.\n", path);
+    return -1;
+  }
+  const c_scene_header_t *h = (const c_scene_header_t *) p;
+  bool ok = size >= sizeof(*h) && h->magic == SCENE_MAGIC && h->version == SCENE_VERSION &&
+            ((h->real_size == 8 && h->sphere_size == sizeof(c_sphere_<double>)) ||
+             (h->real_size == 4 && h->sphere_size == sizeof(c_sphere_<float>))) &&
+            h->sphere_offset % alignof(c_sphere) == 0 &&
+            h->sphere_offset + (uint64_t) h->num_spheres * h->sphere_size <= size &&
+            h->mesh_offset + (uint64_t) h->num_meshes * sizeof(c_scene_mesh_t) <= size;
+  /* materials index tables and select the shading, none may be out of range,
+   * and the mesh paths are copied as strings */
+  const char *sp = (const char *) p + h->sphere_offset;
+  const c_scene_mesh_t *mr = (const c_scene_mesh_t *) ((const char *) p + h->mesh_offset);
+  if (ok) ok = h->real_size == 8 ? check_spheres<double>(sp, h->num_spheres) : check_spheres<float>(sp, h->num_spheres);
+  for (uint32_t i = 0; ok && i < h->num_meshes; ++i)
+    ok = mr[i].material < (uint32_t) NUM_MATERIALS && memchr(mr[i].path, 0, SCENE_PATH_MAX);
+  if (!ok) {
+    fprintf(stderr, "ERROR: %s is not a binary scene (version %d).\n", path, SCENE_VERSION);
+    munmap(p, size);
+    return -1;
+  }
+
+  cam->origin = vec3(h->origin[0], h->origin[1], h->origin[2]);
+  cam->refp = vec3(h->refp[0], h->refp[1], h->refp[2]);
+  cam->vup = vec3(h->vup[0], h->vup[1], h->vup[2]);
+  cam->vfov = h->vfov;
+
+  if (h->real_size == sizeof(real_t) && !s->num_spheres) {
+    /* same layout: the spheres are used in place */
+    s->spheres = (c_sphere *) sp;
+    s->num_spheres = h->num_spheres;
+    s->map = p;
+    s->map_size = size;
+  } else {
+    c_sphere *dst = scene_add_spheres(s, h->num_spheres);
+    if (!dst) ok = false;
+    else if (h->real_size == 8) convert_spheres<double>(dst, sp, h->num_spheres);
+    else convert_spheres<float>(dst, sp, h->num_spheres);
+  }
+
+  for (uint32_t i = 0; ok && i < h->num_meshes; ++i) {
+    char file[SCENE_PATH_MAX];
+    snprintf(file, sizeof(file), "%s", mr[i].path);
+    if (scene_add_mesh(s, file) < 0) ok = false;
+    else {
+      c_mesh_t *m = &s->meshes[s->num_meshes - 1];
+      m->color = vec3(mr[i].color[0], mr[i].color[1], mr[i].color[2]);
+      m->emission = vec3(mr[i].emission[0], mr[i].emission[1], mr[i].emission[2]);
+      m->ir = mr[i].ir;
+      m->material = (c_material_t) mr[i].material;
+    }
+  }
+  if (s->map != p) munmap(p, size);
+  return ok ? 0 : -1;
+}
+
+static int is_bin(const char *path)
+{
+  size_t n = strlen(path);
+  return n > 7 && !strcmp(path + n - 7, ".cscene");
+}
+
+int scene_load(c_scene_t *s, cam_t *cam, const char *path)
+{
+  if (is_bin(path)) return scene_load_bin(s, cam, path);
+
+  size_t size = 0;
+  const char *p = (const char *) map_file(path, &size, 0);
+  if (!p) {
+    fprintf(stderr, "ERROR: unable to map %s.\n", path);
+    return -1;
+  }
+  int r = scene_parse(s, cam, p, size, path);
+  munmap((void *) p, size);
+  return r;
+}
+
+static int scene_save_bin(const c_scene_t *s, const cam_t *cam, FILE *f)
+{
+  c_scene_header_t h;
+  memset(&h, 0, sizeof(h));
+  h.magic = SCENE_MAGIC;
+  h.version = SCENE_VERSION;
+  h.real_size = sizeof(real_t);
+  h.sphere_size = sizeof(c_sphere);
+  h.num_spheres = s->num_spheres;
+  h.num_meshes = s->num_meshes;
+  h.sphere_offset = sizeof(h);
+  h.mesh_offset = sizeof(h) + (uint64_t) s->num_spheres * sizeof(c_sphere);
+  const vec3 *cv[] = { &cam->origin, &cam->refp, &cam->vup };
+  double *hv[] = { h.origin, h.refp, h.vup };
+  for (int k = 0; k < 3; ++k) {
+    hv[k][0] = cv[k]->x; hv[k][1] = cv[k]->y; hv[k][2] = cv[k]->z;
+  }
+  h.vfov = cam->vfov;
+  if (fwrite(&h, sizeof(h), 1, f) != 1) return -1;
+
+  /* field by field into zeroed records, the padding is written as zeros */
+  const uint32_t chunk = 4096;
+  c_sphere *buf = (c_sphere *) calloc(chunk, sizeof(c_sphere));
+  if (!buf) return -1;
+  for (uint32_t k = 0; k < s->num_spheres; k += chunk) {
+    uint32_t n = std::min(chunk, s->num_spheres - k);
+    for (uint32_t i = 0; i < n; ++i) {
+      const c_sphere &sp = s->spheres[k + i];
+      buf[i].radius   = sp.radius;
+      buf[i].pos      = sp.pos;
+      buf[i].color    = sp.color;
+      buf[i].emission = sp.emission;
+      buf[i].ir       = sp.ir;
+      buf[i].material = sp.material;
+    }
+    if (fwrite(buf, sizeof(c_sphere), n, f) != n) {
+      free(buf);
+      return -1;
+    }
+  }
+  free(buf);
+
+  for (uint32_t i = 0; i < s->num_meshes; ++i) {
+    const c_mesh_t *m = &s->meshes[i];
+    c_scene_mesh_t mr;
+    memset(&mr, 0, sizeof(mr));
+    if (strlen(m->path) >= SCENE_PATH_MAX) {
+      fprintf(stderr, "ERROR: mesh path %s is too long.\n", m->path);
+      return -1;
+    }
+    strcpy(mr.path, m->path);
+    mr.color[0] = m->color.x; mr.color[1] = m->color.y; mr.color[2] = m->color.z;
+    mr.emission[0] = m->emission.x; mr.emission[1] = m->emission.y; mr.emission[2] = m->emission.z;
+    mr.ir = m->ir;
+    mr.material = m->material;
+    if (fwrite(&mr, sizeof(mr), 1, f) != 1) return -1;
+  }
+  return 0;
+}
+
+static int scene_save_text(const c_scene_t *s, const cam_t *cam, FILE *f)
+{
+  fprintf(f, "# carbon scene\n");
+  fprintf(f, "camera");
+  put_vec(f, cam->origin);
+  put_vec(f, cam->refp);
+  put_vec(f, cam->vup);
+  put_num(f, cam->vfov);
+  fprintf(f, "\n");
+  for (uint32_t k = 0; k < s->num_spheres; ++k) {
+    const c_sphere &sp = s->spheres[k];
+    fprintf(f, "sphere");
+    put_num(f, sp.radius);
+    put_vec(f, sp.pos);
+    put_vec(f, sp.color);
+    put_vec(f, sp.emission);
+    put_num(f, sp.ir);
+    fprintf(f, " %s\n", material_names[sp.material]);
+  }
+  for (uint32_t i = 0; i < s->num_meshes; ++i) {
+    const c_mesh_t *m = &s->meshes[i];
+    fprintf(f, "mesh %s", m->path);
+    put_vec(f, m->color);
+    put_vec(f, m->emission);
+    put_num(f, m->ir);
+    fprintf(f, " %s\n", material_names[m->material]);
+  }
+  return ferror(f) ? -1 : 0;
+}
+
+int scene_save(const c_scene_t *s, const cam_t *cam, const char *path)
+{
+  FILE *f = fopen(path, is_bin(path) ? "wb" : "w");
+  if (!f) {
+    perror("Unable to write the scene");
+    return -1;
+  }
+  int r = is_bin(path) ? scene_save_bin(s, cam, f) : scene_save_text(s, cam, f);
+  r = fclose(f) == 0 && r == 0 ? 0 : -1;
+  if (r < 0) fprintf(stderr, "ERROR: unable to write %s.\n", path);
+  return r;
+}
+
+c_sphere *scene_add_spheres(c_scene_t *s, uint32_t n)
+{
+  size_t bytes = ((size_t) s->num_spheres + n) * sizeof(c_sphere);
+  c_sphere *sp;
+  if (s->map_size) {
+    /* leave the mapping, it cannot grow */
+    sp = (c_sphere *) malloc(bytes ? bytes : 1);
+    if (sp) {
+      memcpy((void *) sp, s->spheres, s->num_spheres * sizeof(c_sphere));
+      munmap(s->map, s->map_size);
+      s->map = NULL;
+      s->map_size = 0;
+    }
+  } else {
+    sp = (c_sphere *) realloc((void *) s->spheres, bytes ? bytes : 1);
+  }
+  if (!sp) {
+    perror("Unable to allocate memory for the spheres.");
+    return NULL;
+  }
+  s->spheres = sp;
+  s->num_spheres += n;
+  return sp + s->num_spheres - n;
+}
+
+int scene_add_mesh(c_scene_t *s, const char *path)
+{
+  if (!s->meshes) s->meshes = new c_mesh_t[C_MAX_MESHES];
+  if (s->num_meshes == C_MAX_MESHES) {
+    fprintf(stderr, "ERROR: at most %d meshes are supported.\n", C_MAX_MESHES);
+    return -1;
+  }
+  double t0 = omp_get_wtime();
+  c_mesh_t *m = &s->meshes[s->num_meshes];
+  if (mesh_load(m, path) < 0) return -1;
+  s->num_meshes++;
+  double mb = mesh_bytes(m) / (1024. * 1024.);
+  fprintf(stderr, "Mesh: %s, %u triangles, %u vertices, loaded in %.2f ms, %.1f MB (%.1f MB per 1M triangles)\n",
+          path, m->nt, m->nv, (omp_get_wtime() - t0) * 1e3, mb, m->nt ? mb * 1e6 / m->nt : 0.);
+  return 0;
+}
+
+void random_spheres(c_sphere *sp, uint32_t n, uint32_t seed)
+{
+  c_rng_t rng(seed, 0xFFFFFFFF, 0);
+  double l = 0.5 * sqrt(n) + 2;
+
+  for (uint32_t k = 0; k < n; ++k) {
+    double r = randd(&rng, .05, .15);
+    sp[k].radius   = r;
+    sp[k].pos      = vec3(randd(&rng, -l, l), -.5 + r, randd(&rng, -2 * l, -1));
+    sp[k].color    = vec3::rand(&rng, .2, .9);
+    sp[k].emission = vec3(0, 0, 0);
+    sp[k].ir       = 1.;
+    sp[k].material = randd(&rng) < .8 ? DIFF : REFL;
+  }
+}
+
+void scene_unload(c_scene_t *s)
+{
+  if (s->map_size) munmap(s->map, s->map_size);
+  else free((void *) s->spheres);
+  for (uint32_t i = 0; i < s->num_meshes; ++i) mesh_free(&s->meshes[i]);
+  delete[] s->meshes;
+  s->spheres = NULL;
+  s->meshes = NULL;
+  s->map = NULL;
+  s->num_spheres = s->num_meshes = 0;
+  s->map_size = 0;
+}
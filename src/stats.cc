@@ -0,0 +1,90 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include "stats.h"
+
+static c_stats_t stats_total;
+
+#ifdef CARBON_STATS
+__thread c_stats_t stats_local;
+
+void stats_flush()
+{
+  const uint64_t *l = (const uint64_t *) &stats_local;
+  uint64_t *t = (uint64_t *) &stats_total;
+#pragma omp critical (stats)
+  for (size_t k = 0; k < sizeof(c_stats_t) / sizeof(uint64_t); ++k) t[k] += l[k];
+  memset(&stats_local, 0, sizeof(stats_local));
+}
+#endif
+
+void stats_get(c_stats_t *s)
+{
+  stats_flush();
+  *s = stats_total;
+}
+
+void stats_reset()
+{
+  stats_flush();
+  memset(&stats_total, 0, sizeof(stats_total));
+}
+
+static uint64_t total_rays(const c_stats_t *s) { return s->rays_primary + s->rays_secondary + s->rays_shadow; }
+
+void stats_print(const c_stats_t *s, double seconds, FILE *out)
+{
+  uint64_t rays = total_rays(s), paths = 0, segs = 0;
+  for (int d = 0; d <= STATS_MAX_DEPTH; ++d) {
+    paths += s->depth[d];
+    segs += d * s->depth[d];
+  }
+  double r = rays ? 1. / rays : 0;
+  fprintf(out, "rays: %llu (%.2f Mrays/s)\n", (unsigned long long) rays, seconds > 0 ? rays / seconds * 1e-6 : 0.);
+  fprintf(out, "  primary %llu, secondary %llu, shadow %llu\n", (unsigned long long) s->rays_primary,
+          (unsigned long long) s->rays_secondary, (unsigned long long) s->rays_shadow);
+  fprintf(out, "tests per ray: %.2f spheres, %.2f triangles, %.2f BVH nodes\n",
+          s->sphere_tests * r, s->tri_tests * r, s->bvh_nodes * r);
+  fprintf(out, "paths: %llu, %.2f segments on average, %.1f%% ended on a miss\n", (unsigned long long) paths,
+          paths ? (double) segs / paths : 0., paths ? 100. * s->misses / paths : 0.);
+  for (int d = 0; d <= STATS_MAX_DEPTH; ++d) {
+    if (!s->depth[d]) continue;
+    fprintf(out, "  %2d%s %6.2f%%\n", d, d == STATS_MAX_DEPTH ? "+" : " ", 100. * s->depth[d] / paths);
+  }
+}
+
+void stats_json(const c_stats_t *s, double seconds, FILE *out)
+{
+  fprintf(out, "{ \"seconds\": %.4f, \"mrays_per_s\": %.3f, \"rays_primary\": %llu, \"rays_secondary\": %llu, "
+               "\"rays_shadow\": %llu, \"sphere_tests\": %llu, \"tri_tests\": %llu, \"bvh_nodes\": %llu, "
+               "\"misses\": %llu, \"depth\": [",
+          seconds, seconds > 0 ? total_rays(s) / seconds * 1e-6 : 0., (unsigned long long) s->rays_primary,
+          (unsigned long long) s->rays_secondary, (unsigned long long) s->rays_shadow,
+          (unsigned long long) s->sphere_tests, (unsigned long long) s->tri_tests,
+          (unsigned long long) s->bvh_nodes, (unsigned long long) s->misses);
+  /* trailing empty buckets are left out */
+  int n = STATS_MAX_DEPTH + 1;
+  while (n > 0 && !s->depth[n - 1]) --n;
+  for (int d = 0; d < n; ++d) fprintf(out, "%s%llu", d ? ", " : "", (unsigned long long) s->depth[d]);
+  fprintf(out, "] }");
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include <string.h>
+
+#include "tonemap.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/* Buckets are the doubles in [2^-21, 1] by exponent and the top
+ * TM_MANT_BITS of the mantissa, small enough that each holds at most one
+ * step of the gamma curve. Smaller values are below the first step. */
+#define TM_MANT_BITS        7
+#define TM_SHIFT            (52 - TM_MANT_BITS)
+#define TM_MIN_EXP          21
+#define TM_BUCKETS          (TM_MIN_EXP * (1 << TM_MANT_BITS) + 1)
+
+typedef struct c_tonemap_lut {
+  /* step[i] is the smallest value toInt() maps to i, step[256] = inf */
+  double step[257];
+  /* code of the first value of every bucket */
+  int32_t code[TM_BUCKETS];
+  /* bits of 2^-21 >> TM_SHIFT, the first bucket */
+  int64_t base;
+} c_tonemap_lut_t;
+
+static inline int64_t dbits(double x) { int64_t b; memcpy(&b, &x, sizeof(b)); return b; }
+static inline double bitsd(int64_t b) { double x; memcpy(&x, &b, sizeof(x)); return x; }
+
+static c_tonemap_lut_t lut_build()
+{
+  c_tonemap_lut_t l;
+
+  /* walk from the analytic step to the exact double of toInt() */
+  l.step[0] = 0;
+  for (int i = 1; i < 256; ++i) {
+    double x = pow((i - .5) / 255, 2.2);
+    while (toInt(x) >= i) x = bitsd(dbits(x) - 1);
+    while (toInt(x) < i) x = bitsd(dbits(x) + 1);
+    l.step[i] = x;
+  }
+  l.step[256] = INFINITY;
+  l.base = dbits(ldexp(1., -TM_MIN_EXP)) >> TM_SHIFT;
+
+  int c = 0;
+  for (int b = 0; b < TM_BUCKETS; ++b) {
+    double x = bitsd((l.base + b) << TM_SHIFT);
+    while (c < 255 && l.step[c + 1] <= x) ++c;
+    l.code[b] = c;
+  }
+  return l;
+}
+
+static const c_tonemap_lut_t &lut()
+{
+  static const c_tonemap_lut_t l = lut_build();
+  return l;
+}
+
+int tonemap_op(const char *name)
+{
+  if (!strcmp(name, "clamp"))    return TONEMAP_CLAMP;
+  if (!strcmp(name, "reinhard")) return TONEMAP_REINHARD;
+  if (!strcmp(name, "aces"))     return TONEMAP_ACES;
+  return -1;
+}
+
+#ifdef __AVX2__
+/* 4 values of the span, see tonemap_span() */
+static inline void tonemap4(const c_tonemap_lut_t &l, c_tonemap_op_t op, __m256d scale,
+                            const double *x, const double *div, uint8_t *out)
+{
+  const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1);
+  __m256d v = _mm256_mul_pd(_mm256_div_pd(_mm256_loadu_pd(x), _mm256_loadu_pd(div)), scale);
+
+  if (op == TONEMAP_REINHARD) {
+    v = _mm256_div_pd(v, _mm256_add_pd(one, v));
+  } else if (op == TONEMAP_ACES) {
+    /* Narkowicz's fit of the ACES filmic curve */
+    __m256d a = _mm256_mul_pd(v, _mm256_add_pd(_mm256_mul_pd(v, _mm256_set1_pd(2.51)), _mm256_set1_pd(.03)));
+    __m256d b = _mm256_add_pd(_mm256_mul_pd(v, _mm256_add_pd(_mm256_mul_pd(v, _mm256_set1_pd(2.43)),
+                                                            _mm256_set1_pd(.59))), _mm256_set1_pd(.14));
+    v = _mm256_div_pd(a, b);
+  }
+  /* NaNs become 0, like in toInt() */
+  v = _mm256_min_pd(_mm256_max_pd(v, zero), one);
+
+  __m256i b = _mm256_sub_epi64(_mm256_srli_epi64(_mm256_castpd_si256(v), TM_SHIFT), _mm256_set1_epi64x(l.base));
+  b = _mm256_andnot_si256(_mm256_cmpgt_epi64(_mm256_setzero_si256(), b), b);
+  __m128i c = _mm256_i64gather_epi32(l.code, b, 4);
+  __m256d s = _mm256_mask_i32gather_pd(zero, l.step + 1, c, _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8);
+  /* one more code if the value reached the next step, the mask is -1 */
+  __m256i ge = _mm256_castpd_si256(_mm256_cmp_pd(v, s, _CMP_GE_OQ));
+  ge = _mm256_permutevar8x32_epi32(ge, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+  c = _mm_sub_epi32(c, _mm256_castsi256_si128(ge));
+
+  __m128i w = _mm_packus_epi32(c, c);
+  int32_t p = _mm_cvtsi128_si32(_mm_packus_epi16(w, w));
+  memcpy(out, &p, 4);
+}
+
+void tonemap_span(const c_tonemap_t *tm, const double *x, const double *div, size_t n, uint8_t *out)
+{
+  const c_tonemap_lut_t &l = lut();
+  __m256d scale = _mm256_set1_pd(exp2(tm->exposure));
+  size_t i = 0;
+
+  for (; i + 4 <= n; i += 4) tonemap4(l, tm->op, scale, x + i, div + i, out + i);
+  if (i < n) {
+    /* the tail goes through the same kernel, so every value maps alike */
+    double xt[4] = { 0, 0, 0, 0 }, dt[4] = { 1, 1, 1, 1 };
+    uint8_t ot[4];
+    memcpy(xt, x + i, (n - i) * sizeof(double));
+    memcpy(dt, div + i, (n - i) * sizeof(double));
+    tonemap4(l, tm->op, scale, xt, dt, ot);
+    memcpy(out + i, ot, n - i);
+  }
+}
+#else
+void tonemap_span(const c_tonemap_t *tm, const double *x, const double *div, size_t n, uint8_t *out)
+{
+  const c_tonemap_lut_t &l = lut();
+  double scale = exp2(tm->exposure);
+
+  for (size_t i = 0; i < n; ++i) {
+    double v = x[i] / div[i] * scale;
+    if (tm->op == TONEMAP_REINHARD) v = v / (1 + v);
+    else if (tm->op == TONEMAP_ACES) v = (v * (2.51 * v + .03)) / (v * (2.43 * v + .59) + .14);
+    /* NaNs become 0, like in toInt() */
+    v = v > 0 ? (v < 1 ? v : 1) : 0;
+    int64_t b = (dbits(v) >> TM_SHIFT) - l.base;
+    int c = l.code[b > 0 ? b : 0];
+    out[i] = c + (v >= l.step[c + 1]);
+  }
+}
+#endif
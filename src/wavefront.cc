@@ -0,0 +1,351 @@
+/*
+ * Copyright 2023 Daniel Illner <illner.daniel@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wavefront.h"
+#include "renderer.h"
+#include "packet.h"
+#include "geom.h"
+#include "film.h"
+#include "mesh.h"
+
+/* Groups the shade stage sorts the paths into. */
+enum { WF_MISS, WF_DIFF, WF_REFL, WF_REFR, WF_OTHER, WF_GROUPS };
+
+static void paths_alloc(c_paths_t *q, uint32_t cap)
+{
+  real_t **d[] = { &q->ox, &q->oy, &q->oz, &q->dx, &q->dy, &q->dz, &q->tr, &q->tg, &q->tb, &q->lr, &q->lg, &q->lb, &q->t, &q->pdf };
+  bool ok = true;
+  for (real_t **p : d) ok &= (*p = (real_t *) malloc(cap * sizeof(real_t))) != NULL;
+  q->id = (int32_t *) malloc(cap * sizeof(int32_t));
+  q->pix = (uint32_t *) malloc(cap * sizeof(uint32_t));
+  q->depth = (uint32_t *) malloc(cap * sizeof(uint32_t));
+  q->rng = (c_rng_t *) malloc(cap * sizeof(c_rng_t));
+  if (!ok || !q->id || !q->pix || !q->depth || !q->rng) {
+    perror("Unable to allocate memory for the path queue.");
+    exit(1);
+  }
+  q->n = 0;
+}
+
+static void paths_free(c_paths_t *q)
+{
+  real_t *d[] = { q->ox, q->oy, q->oz, q->dx, q->dy, q->dz, q->tr, q->tg, q->tb, q->lr, q->lg, q->lb, q->t, q->pdf };
+  for (real_t *p : d) free(p);
+  free(q->id); free(q->pix); free(q->depth); free(q->rng);
+}
+
+static inline c_ray_t path_ray(const c_paths_t *q, uint32_t k)
+{
+  return c_ray(vec3(q->ox[k], q->oy[k], q->oz[k]), vec3(q->dx[k], q->dy[k], q->dz[k]));
+}
+
+static inline void path_set_ray(c_paths_t *q, uint32_t k, const c_ray_t &r)
+{
+  q->ox[k] = r.o.x; q->oy[k] = r.o.y; q->oz[k] = r.o.z;
+  q->dx[k] = r.d.x; q->dy[k] = r.d.y; q->dz[k] = r.d.z;
+}
+
+static inline vec3 path_tp(const c_paths_t *q, uint32_t k)
+{
+  return vec3(q->tr[k], q->tg[k], q->tb[k]);
+}
+
+static inline void path_set_tp(c_paths_t *q, uint32_t k, const vec3 &c)
+{
+  q->tr[k] = c.x; q->tg[k] = c.y; q->tb[k] = c.z;
+}
+
+static inline void path_add(c_paths_t *q, uint32_t k, const vec3 &c)
+{
+  q->lr[k] += c.x; q->lg[k] += c.y; q->lb[k] += c.z;
+}
+
+/* generate
+ *
+ * Starts one path per pixel of the tile for every sample in [s0, s1). The
+ * paths are laid out in PACKET_DIM x PACKET_DIM blocks so that the first
+ * extend can trace them as coherent packets.
+ */
+static void wf_generate(c_paths_t *q, c_state_t *st, cam_t *cam, uint32_t x0, uint32_t y0,
+                        uint32_t x1, uint32_t y1, uint32_t s0, uint32_t s1)
+{
+  /* rt() gives up before the first hit if maxd <= 1 */
+  bool dead = !st->pt && st->maxd <= 1;
+
+  q->n = 0;
+  for (uint32_t s = s0; s < s1; ++s) {
+    for (uint32_t by = y0; by < y1; by += PACKET_DIM) {
+      for (uint32_t bx = x0; bx < x1; bx += PACKET_DIM) {
+        uint32_t ex = bx + PACKET_DIM < x1 ? bx + PACKET_DIM : x1;
+        uint32_t ey = by + PACKET_DIM < y1 ? by + PACKET_DIM : y1;
+        for (uint32_t j = by; j < ey; ++j) {
+          for (uint32_t i = bx; i < ex; ++i) {
+            uint32_t pix = film_index(st->film, i, j);
+            if (!pixel_active(st, pix)) continue;
+            if (dead) {
+              film_add(st->film, pix, vec3(0, 0, 0));
+              continue;
+            }
+            uint32_t k = q->n++;
+            q->rng[k] = c_rng_t(st->seed, j*st->w + i, s, st->sampler);
+            path_set_ray(q, k, cam->get_ray(i, j, &q->rng[k]));
+            path_set_tp(q, k, vec3(1, 1, 1));
+            q->lr[k] = q->lg[k] = q->lb[k] = 0;
+            q->pdf[k] = 0;
+            q->pix[k] = pix;
+            q->depth[k] = st->pt ? 0 : 1;
+          }
+        }
+      }
+    }
+  }
+}
+
+/* extend
+ *
+ * Finds the closest hit of every path. Camera rays are traced in packets of
+ * PACKET_SIZE, secondary rays are incoherent and traced one by one.
+ */
+static void wf_extend(c_paths_t *q, c_scene_t *scene, real_t tmin, bool primary)
+{
+  if (primary) {
+    c_packet_t p;
+    for (uint32_t b = 0; b < q->n; b += PACKET_SIZE) {
+      p.n = q->n - b < PACKET_SIZE ? q->n - b : PACKET_SIZE;
+      for (uint32_t k = 0; k < p.n; ++k) p.set(k, path_ray(q, b + k));
+      packet_trace(&p, scene, tmin);
+      for (uint32_t k = 0; k < p.n; ++k) {
+        q->t[b + k] = p.t[k];
+        q->id[b + k] = p.k[k] < 0 ? -1 : (int32_t) scene->geom->id[(int) p.k[k]];
+        /* packets only cover the spheres */
+        c_ray_t r = path_ray(q, b + k);
+        int m = closest_mesh(r, scene, tmin, &q->t[b + k]);
+        if (m >= 0) q->id[b + k] = m;
+      }
+    }
+    return;
+  }
+  STAT_ADD(rays_secondary, q->n);
+  for (uint32_t k = 0; k < q->n; ++k) {
+    c_ray_t r = path_ray(q, k);
+    real_t t = 1e20;
+    q->id[k] = closest(r, scene, tmin, &t);
+    q->t[k] = t;
+  }
+}
+
+/* Counting sort of the paths by the material they hit into order. */
+static void wf_sort(const c_paths_t *q, const c_scene_t *scene, uint32_t *order, uint32_t *start)
+{
+  uint32_t *g = (uint32_t *) order + q->n;
+
+  memset(start, 0, (WF_GROUPS + 1) * sizeof(uint32_t));
+  for (uint32_t k = 0; k < q->n; ++k) {
+    int id = q->id[k];
+    int m = id < 0 ? -1 : scene_material(scene, id);
+    g[k] = id < 0 ? WF_MISS : m == DIFF ? WF_DIFF : m == REFL ? WF_REFL
+         : m == REFR ? WF_REFR : WF_OTHER;
+    start[g[k] + 1]++;
+  }
+  for (int i = 0; i < WF_GROUPS; ++i) start[i + 1] += start[i];
+
+  uint32_t pos[WF_GROUPS];
+  memcpy(pos, start, sizeof(pos));
+  for (uint32_t k = 0; k < q->n; ++k) order[pos[g[k]]++] = k;
+}
+
+/* shade (rt)
+ *
+ * Continues path k from its hit with the same decisions and random numbers
+ * as scatter(). Returns false once the path terminated.
+ */
+static bool wf_shade_rt(c_paths_t *q, uint32_t k, c_scene_t *scene, int max_depth, int rr_depth)
+{
+  c_ray_t r = path_ray(q, k);
+  vec3 tp = path_tp(q, k);
+
+  if (q->id[k] < 0) {
+    STAT_ADD(misses, 1);
+    vec3 bg = background();
+    path_add(q, k, tp.mul(&bg));
+    return false;
+  }
+  c_hit_t h;
+  vec3 nd;
+  scene_set_hit(scene, q->id[k], r, q->t[k], &h);
+  rng_bounce(&q->rng[k], scene, q->depth[k]);
+  if (!bounce(r, &h, &q->rng[k], &nd)) return false;
+  tp = tp.mul(&h.col);
+  if (q->depth[k] >= (uint32_t) rr_depth && !roulette(&tp, &q->rng[k])) return false;
+  if (++q->depth[k] >= (uint32_t) max_depth) return false;
+
+  path_set_tp(q, k, tp);
+  path_set_ray(q, k, c_ray(h.spawn(nd), nd));
+  return true;
+}
+
+/* shade (pt)
+ *
+ * Adds the emission of the hit and the sampled direct light to the pixel
+ * and continues diffuse paths, with the same russian roulette, light
+ * samples and random numbers as radiance_hit().
+ */
+static bool wf_shade_pt(c_paths_t *q, uint32_t k, c_scene_t *scene)
+{
+  if (q->id[k] < 0) {
+    STAT_ADD(misses, 1);
+    return false;
+  }
+
+  c_ray_t r = path_ray(q, k);
+  vec3 tp = path_tp(q, k);
+  c_rng_t *rng = &q->rng[k];
+  c_hit_t h;
+  scene_set_hit(scene, q->id[k], r, q->t[k], &h);
+  vec3 c = h.col;
+  real_t p = c.x > c.y && c.x > c.z ? c.x : c.y > c.z ? c.y : c.z;
+  vec3 e = emission_mis(h, q->id[k], r, q->pdf[k], scene);
+  path_add(q, k, tp.mul(&e));
+  rng_bounce(rng, scene, ++q->depth[k]);
+  if (q->depth[k] > 5) {
+    rng->seek(DIM_ROULETTE);
+    if (!(randd(rng) < p)) return false;
+  }
+  if (h.mat != DIFF) return false;
+
+  if (scene->num_lights) {
+    vec3 ld = sample_lights(h, q->id[k], scene, rng);
+    path_add(q, k, tp.mul(&ld));
+  }
+  vec3 nd = cosine_dir(h.n, rng);
+  path_set_tp(q, k, tp.mul(&h.col));
+  path_set_ray(q, k, c_ray(h.spawn(nd), nd));
+  q->pdf[k] = h.n.dot(&nd) / M_PI;
+  return true;
+}
+
+/* accumulate
+ *
+ * Adds the radiance of the terminated paths to the film and moves the
+ * paths flagged in alive to the front, keeping their order. All paths in
+ * the queue have been extended segments times.
+ */
+static void wf_compact(c_paths_t *q, const unsigned char *alive, c_film_t *film, uint32_t segments)
+{
+  uint32_t n = 0;
+  for (uint32_t k = 0; k < q->n; ++k) {
+    if (!alive[k]) {
+      stats_path(segments);
+      film_add(film, q->pix[k], vec3(q->lr[k], q->lg[k], q->lb[k]));
+      continue;
+    }
+    if (n != k) {
+      q->ox[n] = q->ox[k]; q->oy[n] = q->oy[k]; q->oz[n] = q->oz[k];
+      q->dx[n] = q->dx[k]; q->dy[n] = q->dy[k]; q->dz[n] = q->dz[k];
+      q->tr[n] = q->tr[k]; q->tg[n] = q->tg[k]; q->tb[n] = q->tb[k];
+      q->lr[n] = q->lr[k]; q->lg[n] = q->lg[k]; q->lb[n] = q->lb[k];
+      q->pdf[n] = q->pdf[k];
+      q->pix[n] = q->pix[k]; q->depth[n] = q->depth[k]; q->rng[n] = q->rng[k];
+    }
+    n++;
+  }
+  q->n = n;
+}
+
+void wavefront(c_state_t *st, c_scene_t *scene, cam_t *cam, uint32_t s0, uint32_t s1)
+{
+  int threads = st->threads > 0 ? st->threads : omp_get_max_threads();
+  real_t tmin = st->pt ? 1e-4 : 0.001;
+
+  /* one queue per render thread, reused for all its tiles */
+  c_paths_t *queues = (c_paths_t *) calloc(threads, sizeof(c_paths_t));
+  uint32_t **orders = (uint32_t **) calloc(threads, sizeof(uint32_t *));
+  unsigned char **alive = (unsigned char **) calloc(threads, sizeof(unsigned char *));
+  if (!queues || !orders || !alive) {
+    perror("Unable to allocate memory for the path queues.");
+    exit(1);
+  }
+
+  const c_film_t *f = st->film;
+  render_tiles(f->x0, f->y0, f->x0 + f->w, f->y0 + f->h, threads, st->pt ? "(pt)" : "(rt)", st->deadline,
+               [&](uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1) {
+    int tid = omp_get_thread_num();
+    uint32_t npx = (x1 - x0) * (y1 - y0);
+    uint32_t batch = WF_QUEUE_SIZE / npx;
+    c_paths_t *q = &queues[tid];
+
+    if (!orders[tid]) {
+      paths_alloc(q, WF_QUEUE_SIZE);
+      orders[tid] = (uint32_t *) malloc(2 * WF_QUEUE_SIZE * sizeof(uint32_t));
+      alive[tid] = (unsigned char *) malloc(WF_QUEUE_SIZE);
+      if (!orders[tid] || !alive[tid]) {
+        perror("Unable to allocate memory for the path queue.");
+        exit(1);
+      }
+    }
+    /* the active pixels of the tile share its time */
+    uint32_t act[TILE_SIZE * TILE_SIZE], nact = 0;
+    double t0 = 0;
+    if (st->film->cost) {
+      for (uint32_t j = y0; j < y1; ++j)
+        for (uint32_t i = x0; i < x1; ++i)
+          if (pixel_active(st, film_index(st->film, i, j))) act[nact++] = film_index(st->film, i, j);
+      t0 = omp_get_wtime();
+    }
+    for (uint32_t b0 = s0; b0 < s1; b0 += batch) {
+      uint32_t b1 = b0 + batch < s1 ? b0 + batch : s1;
+      wf_generate(q, st, cam, x0, y0, x1, y1, b0, b1);
+
+      for (uint32_t segments = 1; q->n; ++segments) {
+        uint32_t start[WF_GROUPS + 1];
+        wf_extend(q, scene, tmin, segments == 1);
+        if (segments == 1 && (st->film->feat || st->film->id)) {
+          for (uint32_t k = 0; k < q->n; ++k) {
+            c_ray_t r = path_ray(q, k);
+            add_first_hit(st->film, scene, q->pix[k], r, q->t[k], q->id[k]);
+          }
+        }
+        wf_sort(q, scene, orders[tid], start);
+        /* paths of one material are shaded back to back */
+        for (uint32_t i = 0; i < q->n; ++i) {
+          uint32_t k = orders[tid][i];
+          alive[tid][k] = st->pt ? wf_shade_pt(q, k, scene)
+                                 : wf_shade_rt(q, k, scene, st->maxd, st->rrd);
+        }
+        wf_compact(q, alive[tid], st->film, segments);
+      }
+    }
+    if (st->film->cost) add_cost(st->film, act, nact, omp_get_wtime() - t0);
+  });
+
+  for (int i = 0; i < threads; ++i) {
+    if (!orders[i]) continue;
+    paths_free(&queues[i]);
+    free(orders[i]);
+    free(alive[i]);
+  }
+  free(queues); free(orders); free(alive);
+}